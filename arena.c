@@ -0,0 +1,95 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+// Bump allocation for data that lives no longer than one iteration of the
+// event loop.  Nothing is freed piecemeal; arena_reset() drops everything
+// at once.  When an iteration overflows the block, more blocks are chained
+// and the next reset replaces them with a single block of the combined
+// size, so a steady workload stops adding arena blocks after its first
+// iterations.  The heap counters are the arena's own: what cairo, poppler
+// and Xlib allocate underneath is not seen here.
+
+#define ARENA_ALIGN 16
+
+struct ArenaBlock {
+    ArenaBlock *prev;
+    size_t size;
+    size_t used;
+    max_align_t data[];
+};
+
+static ArenaBlock *new_block(Arena *a, size_t size, ArenaBlock *prev)
+{
+    ArenaBlock *b = malloc(sizeof(ArenaBlock) + size);
+    if (b == NULL)
+        return NULL;
+    b->prev = prev;
+    b->size = size;
+    b->used = 0;
+    ++a->stats.heap_allocs;
+    return b;
+}
+
+void arena_init(Arena *a, size_t size)
+{
+    memset(a, 0, sizeof(Arena));
+    a->block = new_block(a, size, NULL);
+}
+
+void arena_release(Arena *a)
+{
+    while (a->block)
+    {
+        ArenaBlock *prev = a->block->prev;
+        free(a->block);
+        a->block = prev;
+    }
+    a->used = 0;
+}
+
+// size bytes aligned for any type, valid until the next arena_reset().
+void *arena_alloc(Arena *a, size_t size)
+{
+    size_t asked = size;
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    ArenaBlock *b = a->block;
+    if (b == NULL || b->size - b->used < size)
+    {
+        size_t grow = b ? b->size * 2 : 4096;
+        b = new_block(a, grow > size ? grow : size, a->block);
+        if (b == NULL)
+            return NULL;
+        a->block = b;
+    }
+
+    void *p = (char *)b->data + b->used;
+    b->used += size;
+    a->used += size;
+    ++a->stats.allocs;
+    a->stats.bytes += asked;
+    return p;
+}
+
+void arena_reset(Arena *a)
+{
+    ++a->stats.resets;
+    if (a->used > a->stats.peak)
+        a->stats.peak = a->used;
+
+    // Fold the chain into one block large enough for this iteration.
+    bool chained = a->block && a->block->prev;
+    if (chained)
+    {
+        size_t total = 0;
+        for (ArenaBlock *b = a->block; b; b = b->prev)
+            total += b->size;
+        arena_release(a);
+        a->block = new_block(a, total, NULL);
+        ++a->stats.heap_resets;
+    }
+    if (a->block)
+        a->block->used = 0;
+    a->used = 0;
+}
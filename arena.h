@@ -0,0 +1,28 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct {
+    unsigned long allocs;       // arena_alloc() calls
+    unsigned long bytes;        // bytes they asked for
+    unsigned long heap_allocs;  // arena blocks taken from malloc
+    unsigned long resets;
+    unsigned long heap_resets;  // resets after an iteration that needed a new block
+    size_t peak;                // most bytes in use between two resets, aligned
+} ArenaStats;
+
+typedef struct {
+    ArenaBlock *block;  // current block, older ones behind it
+    size_t used;        // bytes in use since the last reset, all blocks
+    ArenaStats stats;
+} Arena;
+
+void arena_init(Arena *a, size_t size);
+void arena_release(Arena *a);
+void *arena_alloc(Arena *a, size_t size);
+void arena_reset(Arena *a);
+
+#endif // ARENA_H
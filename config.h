@@ -6,6 +6,8 @@
 /* General Settings */
 static const char *font = "-misc-fixed-medium-r-normal-*-14-*-*-*-*-*-*-*";
 static const char *bg_color = "#2E3440";  // Nord theme background color
+static const unsigned startup_window_width  = 612;  // window size until the first page is known
+static const unsigned startup_window_height = 792;
 
 /* Scrolling and Zooming */
 static const double arrow_scroll = 0.01;
@@ -25,7 +27,31 @@ static const int default_rotation = 0;
 /* Features */
 static const int enable_text_selection = 1;
 static const int enable_link_following = 1;
+static const char *uri_handler = "xdg-open";  // opens web links and links to other files
+static const char *trusted_uri_schemes[] = {"http:", "https:", "mailto:"};  // opened on the first click, other links on a second
 static const int cache_size_mb = 64;
+static const int enable_text_index = 1;      // build a full-text search index in the background
+static const int persist_text_index = 0;     // keep it in <file>.breathe-index for the next start
+static const int enable_structure_index = 1; // read outline, named destinations and page labels in the background
+static const int search_threads = 0;         // threads scanning unindexed pages, 0 = one per core
+static const int incremental_search_delay_ms = 150;  // typing pause before search-as-you-type runs
+static const int auto_reload = 1;            // reload when the file changes on disk
+static const int auto_reload_delay_ms = 300; // quiet time after the last write before reloading
+static const int enable_disk_cache = 1;      // keep rendered pages in $XDG_CACHE_HOME/breathe
+static const int disk_cache_mb = 256;        // size limit of that cache, least recently used go first
+static const int large_file_mb = 512;        // bigger files open in bounded-memory mode
+static const int large_file_search_threads = 2;  // search threads in that mode
+static const int thumbnail_width = 120;      // page width in the overview grid, in pixels
+static const int thumbnail_threads = 0;      // threads rendering thumbnails per window, 0 = one per core
+static const int thumbnail_cache_kb = 32768; // memory for thumbnails, those farthest away go first
+static const int thumbnail_disk_cache = 1;   // keep thumbnails in the disk cache too
+static const double export_dpi = 150;        // --export resolution unless --dpi is given
+static const int export_threads = 0;         // threads rendering for --export, 0 = one per core
+static const int dump_text_threads = 0;      // threads extracting for --dump-text, 0 = one per core
+static const int resident_server = 0;        // open windows in one resident process, see --server
+static const int server_cached_docs = 4;     // documents it keeps parsed after their windows close
+static const int memory_budget_mb = 512;     // documents and caches of all windows together, hidden and idle ones give up theirs first
+static const int index_keep_s = 60;          // a text index rebuilt after the budget took it is not taken again sooner
 
 /* View Modes */
 static const int default_two_page_view = 0;
@@ -46,7 +72,13 @@ static const char *status_bar_bg_color_light = "#D8DEE9";    // Nord Snow Storm
 // Dark mode colors (Nord theme)
 static const char *status_bar_text_color_dark = "#ECEFF4";   // Nord Snow Storm
 static const char *status_bar_bg_color_dark = "#3B4252";     // Nord Polar Night
-static const char *page_bg_color_dark = "#d4b595";           // Nord Polar Night (darker)
+
+// Dark mode page palette: black ink maps to page_fg_color_dark, the white
+// page to page_bg_color_dark and every gray in between along that gradient.
+// Sepia, for instance, is "#5B4636" on "#F4ECD8".
+static const char *page_fg_color_dark = "#D8DEE9";           // Nord Snow Storm
+static const char *page_bg_color_dark = "#2E3440";           // Nord Polar Night
+static const int dark_mode_recolor_images = 1;               // 0 keeps images in their original colors
 
 /* Keyboard Shortcuts */
 typedef enum {
@@ -54,7 +86,9 @@ typedef enum {
     DOWN, UP, PG_DOWN, PG_UP, BACK, RELOAD, COPY,
     GOTO_PAGE, SEARCH, PAGE, MAGNIFY, ROTATE_CW, ROTATE_CCW,
     ZOOM_IN, ZOOM_OUT, TOGGLE_TWO_PAGE_VIEW,
-    TOGGLE_CONTINUOUS_MODE, TOGGLE_STATUS_BAR, TOGGLE_DARK_MODE
+    TOGGLE_CONTINUOUS_MODE, TOGGLE_STATUS_BAR, TOGGLE_DARK_MODE,
+    NEXT_MATCH, PREV_MATCH, OVERVIEW,
+    COPY_PAGE, COPY_DOCUMENT, OUTLINE
 } Action;
 
 typedef struct {
@@ -82,6 +116,8 @@ static const Shortcut shortcuts[] = {
     {AnyMask,     XK_g,            GOTO_PAGE},
     {AnyMask,     XK_s,            SEARCH},
     {EmptyMask,   XK_slash,        SEARCH},
+    {EmptyMask,   XK_n,            NEXT_MATCH},
+    {ShiftMask,   XK_N,            PREV_MATCH},
     {EmptyMask,   XK_p,            PAGE},
     {EmptyMask,   XK_m,            MAGNIFY},
     {EmptyMask,   XK_bracketright, ROTATE_CW},
@@ -91,7 +127,11 @@ static const Shortcut shortcuts[] = {
     {EmptyMask,   XK_t,            TOGGLE_TWO_PAGE_VIEW},
     {EmptyMask,   XK_c,            TOGGLE_CONTINUOUS_MODE},
     {EmptyMask,   XK_F7,           TOGGLE_STATUS_BAR},
-    {EmptyMask,   XK_i,            TOGGLE_DARK_MODE}
+    {EmptyMask,   XK_i,            TOGGLE_DARK_MODE},
+    {EmptyMask,   XK_o,            OVERVIEW},
+    {EmptyMask,   XK_y,            COPY_PAGE},
+    {ShiftMask,   XK_Y,            COPY_DOCUMENT},
+    {ShiftMask,   XK_O,            OUTLINE}
 };
 
 #endif // CONFIG_H
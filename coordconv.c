@@ -3,68 +3,137 @@
 #include "coordconv.h"
 #include <poppler.h>
 
-CoordConv coord_conv_create(PopplerPage *p, const Rectangle *r, bool i, int rotation)
+static CoordMatrix invert(const CoordMatrix *m)
 {
-    CoordConv cc;
-    cc.rect = *r;
-    cc.inverty = i;
+    double det = m->xx * m->yy - m->xy * m->yx;
+    CoordMatrix r;
+    r.xx =  m->yy / det;
+    r.xy = -m->xy / det;
+    r.yx = -m->yx / det;
+    r.yy =  m->xx / det;
+    r.x0 = -(r.xx * m->x0 + r.xy * m->y0);
+    r.y0 = -(r.yx * m->x0 + r.yy * m->y0);
+    return r;
+}
 
+// Maps points of page p to the pixels of a rendering at scale pixels per
+// point, turned clockwise by rotation degrees (a multiple of 90), whose crop
+// (in rotated pixels) is shown at pos.  With inverty PDF y grows upwards from
+// the bottom of the page, as in poppler's text search and link areas.
+CoordConv coord_conv_create(PopplerPage *p, const Rectangle *pos, const Rectangle *crop,
+    double scale, bool inverty, int rotation)
+{
     double width, height;
     poppler_page_get_size(p, &width, &height);
 
-    if (rotation % 180 != 0)
+    CoordMatrix m = {0, 0, 0, 0, 0, 0};
+    switch (((rotation % 360) + 360) % 360)
     {
-        double temp = width;
-        width = height;
-        height = temp;
+        case 90:
+            m.xy = -scale; m.x0 = height * scale;
+            m.yx = scale;
+            break;
+        case 180:
+            m.xx = -scale; m.x0 = width * scale;
+            m.yy = -scale; m.y0 = height * scale;
+            break;
+        case 270:
+            m.xy = scale;
+            m.yx = -scale; m.y0 = width * scale;
+            break;
+        default:
+            m.xx = scale;
+            m.yy = scale;
+            break;
     }
 
-    cc.xscale = width / (double)r->width;
-    cc.yscale = height / (double)r->height;
+    if (inverty)
+    {
+        m.x0 += m.xy * height;
+        m.y0 += m.yy * height;
+        m.xy = -m.xy;
+        m.yy = -m.yy;
+    }
 
-    return cc;
+    m.x0 += pos->x - crop->x;
+    m.y0 += pos->y - crop->y;
+
+    return (CoordConv){m, invert(&m)};
 }
 
-double coord_conv_to_pdf_x(const CoordConv *cc, int x)
+static inline CoordPoint apply(const CoordMatrix *m, double x, double y)
 {
-    return (x - cc->rect.x) * cc->xscale;
+    return (CoordPoint){m->xx * x + m->xy * y + m->x0, m->yx * x + m->yy * y + m->y0};
 }
 
-double coord_conv_to_pdf_y(const CoordConv *cc, int y)
+CoordPoint coord_conv_point_to_pdf(const CoordConv *cc, double x, double y)
 {
-    if (cc->inverty)
-        return (cc->rect.height - (y - cc->rect.y)) * cc->yscale;
-    return (y - cc->rect.y) * cc->yscale;
+    return apply(&cc->to_pdf, x, y);
 }
 
-Rectangle coord_conv_to_pdf(const CoordConv *cc, const Rectangle *r)
+CoordPoint coord_conv_point_to_screen(const CoordConv *cc, double x, double y)
 {
-    return (Rectangle){
-        (int)coord_conv_to_pdf_x(cc, r->x),
-        (int)coord_conv_to_pdf_y(cc, r->y),
-        (int)(coord_conv_to_pdf_x(cc, r->x + r->width) - coord_conv_to_pdf_x(cc, r->x)),
-        (int)(coord_conv_to_pdf_y(cc, r->y + r->height) - coord_conv_to_pdf_y(cc, r->y))
-    };
+    return apply(&cc->to_screen, x, y);
 }
 
-double coord_conv_to_screen_x(const CoordConv *cc, int x)
+static void apply_points(const CoordMatrix *m, const CoordPoint *in, CoordPoint *out, int n)
 {
-    return x / cc->xscale + cc->rect.x;
+    const double xx = m->xx, yx = m->yx, xy = m->xy, yy = m->yy, x0 = m->x0, y0 = m->y0;
+    for (int i = 0; i < n; ++i)
+    {
+        double x = in[i].x, y = in[i].y;
+        out[i].x = xx * x + xy * y + x0;
+        out[i].y = yx * x + yy * y + y0;
+    }
+}
+
+// Rotations are multiples of 90 degrees, so opposite corners map to opposite
+// corners and the result is their normalized span, widened to whole units.
+static void apply_rects(const CoordMatrix *m, const Rectangle *in, Rectangle *out, int n)
+{
+    const double xx = m->xx, yx = m->yx, xy = m->xy, yy = m->yy, x0 = m->x0, y0 = m->y0;
+    for (int i = 0; i < n; ++i)
+    {
+        double ax = in[i].x, ay = in[i].y;
+        double bx = ax + in[i].width, by = ay + in[i].height;
+        double px = xx * ax + xy * ay + x0, py = yx * ax + yy * ay + y0;
+        double qx = xx * bx + xy * by + x0, qy = yx * bx + yy * by + y0;
+        double lx = floor(fmin(px, qx)), ly = floor(fmin(py, qy));
+        out[i] = (Rectangle){(int)lx, (int)ly,
+            (int)(ceil(fmax(px, qx)) - lx), (int)(ceil(fmax(py, qy)) - ly)};
+    }
 }
 
-double coord_conv_to_screen_y(const CoordConv *cc, int y)
+Rectangle coord_conv_to_pdf(const CoordConv *cc, const Rectangle *r)
 {
-    if (cc->inverty)
-        return cc->rect.y + cc->rect.height - y / cc->yscale;
-    return y / cc->yscale + cc->rect.y;
+    Rectangle out;
+    apply_rects(&cc->to_pdf, r, &out, 1);
+    return out;
 }
 
 Rectangle coord_conv_to_screen(const CoordConv *cc, const Rectangle *r)
 {
-    return (Rectangle){
-        (int)coord_conv_to_screen_x(cc, r->x),
-        (int)coord_conv_to_screen_y(cc, r->y),
-        (int)(coord_conv_to_screen_x(cc, r->x + r->width) - coord_conv_to_screen_x(cc, r->x)),
-        (int)(coord_conv_to_screen_y(cc, r->y + r->height) - coord_conv_to_screen_y(cc, r->y))
-    };
+    Rectangle out;
+    apply_rects(&cc->to_screen, r, &out, 1);
+    return out;
+}
+
+void coord_conv_points_to_pdf(const CoordConv *cc, const CoordPoint *in, CoordPoint *out, int n)
+{
+    apply_points(&cc->to_pdf, in, out, n);
+}
+
+void coord_conv_points_to_screen(const CoordConv *cc, const CoordPoint *in, CoordPoint *out, int n)
+{
+    apply_points(&cc->to_screen, in, out, n);
+}
+
+void coord_conv_rects_to_pdf(const CoordConv *cc, const Rectangle *in, Rectangle *out, int n)
+{
+    apply_rects(&cc->to_pdf, in, out, n);
+}
+
+void coord_conv_rects_to_screen(const CoordConv *cc, const Rectangle *in, Rectangle *out, int n)
+{
+    apply_rects(&cc->to_screen, in, out, n);
 }
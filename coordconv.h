@@ -5,19 +5,32 @@
 #include <poppler.h>
 #include "rectangle.h"
 
+// An affine map x' = xx * x + xy * y + x0, y' = yx * x + yy * y + y0, laid
+// out like cairo_matrix_t.
 typedef struct {
-    Rectangle rect;
-    bool inverty;
-    double xscale;
-    double yscale;
+    double xx, yx;
+    double xy, yy;
+    double x0, y0;
+} CoordMatrix;
+
+typedef struct {
+    double x, y;
+} CoordPoint;
+
+typedef struct {
+    CoordMatrix to_screen;  // PDF points to screen pixels
+    CoordMatrix to_pdf;     // the inverse
 } CoordConv;
 
-CoordConv coord_conv_create(PopplerPage *p, const Rectangle *r, bool i, int rotation);
-double coord_conv_to_pdf_x(const CoordConv *cc, int x);
-double coord_conv_to_pdf_y(const CoordConv *cc, int y);
+CoordConv coord_conv_create(PopplerPage *p, const Rectangle *pos, const Rectangle *crop,
+    double scale, bool inverty, int rotation);
+CoordPoint coord_conv_point_to_pdf(const CoordConv *cc, double x, double y);
+CoordPoint coord_conv_point_to_screen(const CoordConv *cc, double x, double y);
 Rectangle coord_conv_to_pdf(const CoordConv *cc, const Rectangle *r);
-double coord_conv_to_screen_x(const CoordConv *cc, int x);
-double coord_conv_to_screen_y(const CoordConv *cc, int y);
 Rectangle coord_conv_to_screen(const CoordConv *cc, const Rectangle *r);
+void coord_conv_points_to_pdf(const CoordConv *cc, const CoordPoint *in, CoordPoint *out, int n);
+void coord_conv_points_to_screen(const CoordConv *cc, const CoordPoint *in, CoordPoint *out, int n);
+void coord_conv_rects_to_pdf(const CoordConv *cc, const Rectangle *in, Rectangle *out, int n);
+void coord_conv_rects_to_screen(const CoordConv *cc, const Rectangle *in, Rectangle *out, int n);
 
 #endif // COORDCONV_H
@@ -0,0 +1,483 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cairo/cairo.h>
+#include <glib.h>
+#include "diskcache.h"
+
+// Rendered pages kept under $XDG_CACHE_HOME/breathe, one file per page,
+// DPI, rotation and theme of a given file content.  A file holds the page as
+// horizontal tiles of TILE_ROWS rows, each PNG compressed.  Entries are
+// written by one background thread (to a temporary name, then renamed) and
+// evicted oldest first, by modification time, which a hit refreshes; the
+// directory is kept under max_bytes.
+
+#define CACHE_MAGIC "BRTHRC01"
+#define TILE_ROWS 256
+#define SAMPLE_BYTES 65536
+#define STORE_QUEUE_MAX 8       // pending stores; the oldest is dropped past this
+#define STALE_TMP_SECONDS 3600  // temporary files older than this were left by a crash
+
+struct DiskCache {
+    char *dir;
+    char file_key[17];
+    long max_bytes;
+};
+
+typedef struct StoreJob {
+    char *dir;
+    long max_bytes;
+    char *path;
+    cairo_surface_t *image;
+    struct StoreJob *next;
+} StoreJob;
+
+// The writer thread and its queue are shared by all caches of the process.
+static GMutex store_lock;
+static GCond store_cond;
+static StoreJob *store_head, *store_tail;
+static int store_count;
+static bool store_running;
+static long cache_bytes = -1;   // size of the directory, -1 until it is scanned
+
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t n)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < n; ++i)
+        h = (h ^ p[i]) * 1099511628211ULL;
+    return h;
+}
+
+// Identifies the file content by its size and its first and last 64 KiB,
+// which hold the header, the trailer and the document /ID, together with its
+// device, inode and modification time, since an edit in the middle of a file
+// can leave all of those bytes alone.  Reading the whole of a large file
+// would cost more than the renders it saves.
+static bool hash_file(const char *file_name, uint64_t *hash)
+{
+    int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat sb;
+    if (fstat(fd, &sb) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    uint64_t h = 14695981039346656037ULL;
+    h = hash_bytes(h, &sb.st_size, sizeof(sb.st_size));
+    h = hash_bytes(h, &sb.st_dev, sizeof(sb.st_dev));
+    h = hash_bytes(h, &sb.st_ino, sizeof(sb.st_ino));
+    h = hash_bytes(h, &sb.st_mtim, sizeof(sb.st_mtim));
+
+    unsigned char *buf = malloc(SAMPLE_BYTES);
+    off_t offsets[2] = {0, sb.st_size > SAMPLE_BYTES ? sb.st_size - SAMPLE_BYTES : 0};
+    for (int i = 0; i < 2; ++i)
+    {
+        ssize_t n = pread(fd, buf, SAMPLE_BYTES, offsets[i]);
+        if (n > 0)
+            h = hash_bytes(h, buf, n);
+    }
+    free(buf);
+    close(fd);
+
+    *hash = h;
+    return true;
+}
+
+DiskCache *disk_cache_new(const char *file_name, long max_bytes)
+{
+    uint64_t hash;
+    if (!hash_file(file_name, &hash))
+        return NULL;
+
+    char *dir = g_build_filename(g_get_user_cache_dir(), "breathe", NULL);
+    if (g_mkdir_with_parents(dir, 0700) != 0)
+    {
+        g_free(dir);
+        return NULL;
+    }
+
+    DiskCache *dc = calloc(1, sizeof(DiskCache));
+    dc->dir = strdup(dir);
+    g_free(dir);
+    snprintf(dc->file_key, sizeof(dc->file_key), "%016llx", (unsigned long long)hash);
+    dc->max_bytes = max_bytes;
+    return dc;
+}
+
+void disk_cache_free(DiskCache *dc)
+{
+    if (dc == NULL)
+        return;
+    free(dc->dir);
+    free(dc);
+}
+
+static char *entry_path(const DiskCache *dc, const DiskCacheKey *key)
+{
+    char name[96];
+    snprintf(name, sizeof(name), "%s-p%d-d%d-r%d-t%08x.brc", dc->file_key,
+        key->page, key->dpi, key->rotation, key->theme);
+    return g_build_filename(dc->dir, name, NULL);
+}
+
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+} ReadBuffer;
+
+static cairo_status_t read_buffer(void *closure, unsigned char *data, unsigned int length)
+{
+    ReadBuffer *rb = closure;
+    if (length > rb->size)
+        return CAIRO_STATUS_READ_ERROR;
+    memcpy(data, rb->data, length);
+    rb->data += length;
+    rb->size -= length;
+    return CAIRO_STATUS_SUCCESS;
+}
+
+static cairo_status_t write_file(void *closure, const unsigned char *data, unsigned int length)
+{
+    return fwrite(data, 1, length, closure) == length
+        ? CAIRO_STATUS_SUCCESS : CAIRO_STATUS_WRITE_ERROR;
+}
+
+// Decodes the entry at path; with width >= 0 only if it is width x height.
+static cairo_surface_t *load_entry(const char *path, int width, int height)
+{
+    gchar *contents;
+    gsize length;
+    if (!g_file_get_contents(path, &contents, &length, NULL))
+        return NULL;
+    utimensat(AT_FDCWD, path, NULL, 0);
+
+    cairo_surface_t *image = NULL;
+    int32_t header[3];
+    if (length < 8 + sizeof(header) || memcmp(contents, CACHE_MAGIC, 8) != 0)
+        goto out;
+    memcpy(header, contents + 8, sizeof(header));
+    if (width >= 0 && (header[0] != width || header[1] != height))
+        goto out;
+    if (header[0] <= 0 || header[1] <= 0 || header[2] != (header[1] + TILE_ROWS - 1) / TILE_ROWS)
+        goto out;
+
+    image = cairo_image_surface_create(CAIRO_FORMAT_RGB24, header[0], header[1]);
+    cairo_t *cr = cairo_create(image);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+
+    ReadBuffer rb = {(unsigned char *)contents + 8 + sizeof(header), length - 8 - sizeof(header)};
+    bool ok = true;
+    for (int t = 0; ok && t < header[2]; ++t)
+    {
+        uint32_t size;
+        ok = rb.size >= sizeof(size);
+        if (!ok)
+            break;
+        memcpy(&size, rb.data, sizeof(size));
+        rb.data += sizeof(size);
+        rb.size -= sizeof(size);
+        ok = size <= rb.size;
+        if (!ok)
+            break;
+
+        ReadBuffer tile = {rb.data, size};
+        cairo_surface_t *png = cairo_image_surface_create_from_png_stream(read_buffer, &tile);
+        ok = cairo_surface_status(png) == CAIRO_STATUS_SUCCESS;
+        if (ok)
+        {
+            cairo_set_source_surface(cr, png, 0, t * TILE_ROWS);
+            cairo_paint(cr);
+        }
+        cairo_surface_destroy(png);
+        rb.data += size;
+        rb.size -= size;
+    }
+    cairo_destroy(cr);
+
+    if (!ok)
+    {
+        cairo_surface_destroy(image);
+        image = NULL;
+    }
+
+out:
+    g_free(contents);
+    return image;
+}
+
+// Returns the cached page if it was stored at exactly width x height.
+cairo_surface_t *disk_cache_load(DiskCache *dc, const DiskCacheKey *key, int width, int height)
+{
+    if (dc == NULL)
+        return NULL;
+
+    char *path = entry_path(dc, key);
+    cairo_surface_t *image = load_entry(path, width, height);
+    g_free(path);
+    return image;
+}
+
+// Returns the most recently used rendering of key's page at any DPI, which
+// needs neither the document nor the page size to find.
+cairo_surface_t *disk_cache_load_any(DiskCache *dc, const DiskCacheKey *key)
+{
+    if (dc == NULL)
+        return NULL;
+
+    DIR *d = opendir(dc->dir);
+    if (d == NULL)
+        return NULL;
+
+    char prefix[48], suffix[48];
+    snprintf(prefix, sizeof(prefix), "%s-p%d-d", dc->file_key, key->page);
+    snprintf(suffix, sizeof(suffix), "-r%d-t%08x.brc", key->rotation, key->theme);
+
+    char *best = NULL;
+    time_t best_mtime = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL)
+    {
+        // Thumbnails (negative DPI) are too small to stand in for the page.
+        if (!g_str_has_prefix(de->d_name, prefix) || !g_str_has_suffix(de->d_name, suffix) ||
+            de->d_name[strlen(prefix)] == '-')
+            continue;
+
+        char *path = g_build_filename(dc->dir, de->d_name, NULL);
+        struct stat sb;
+        if (stat(path, &sb) == 0 && (best == NULL || sb.st_mtime > best_mtime))
+        {
+            g_free(best);
+            best = path;
+            best_mtime = sb.st_mtime;
+        }
+        else
+            g_free(path);
+    }
+    closedir(d);
+
+    cairo_surface_t *image = best ? load_entry(best, -1, -1) : NULL;
+    g_free(best);
+    return image;
+}
+
+typedef struct {
+    char *path;
+    time_t mtime;
+    off_t size;
+} Entry;
+
+static int compare_entries(const void *a, const void *b)
+{
+    time_t x = ((const Entry *)a)->mtime, y = ((const Entry *)b)->mtime;
+    return (x > y) - (x < y);
+}
+
+// Adds up the entries in dir, deleting temporary files left behind by a
+// crash and, if the total is over max_bytes, the least recently used entries
+// until it is back under nine tenths of the limit.  Returns what is left.
+static long scan_cache(const char *dir, long max_bytes)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL)
+        return 0;
+
+    Entry *entries = NULL;
+    int count = 0, capacity = 0;
+    long total = 0;
+    time_t now = time(NULL);
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL)
+    {
+        bool tmp = g_str_has_suffix(de->d_name, ".tmp");
+        if (!tmp && !g_str_has_suffix(de->d_name, ".brc"))
+            continue;
+
+        char *path = g_build_filename(dir, de->d_name, NULL);
+        struct stat sb;
+        bool found = stat(path, &sb) == 0;
+        if (found && tmp && now - sb.st_mtime > STALE_TMP_SECONDS)
+            unlink(path);
+        if (!found || tmp)
+        {
+            g_free(path);
+            continue;
+        }
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            entries = realloc(entries, capacity * sizeof(Entry));
+        }
+        entries[count++] = (Entry){path, sb.st_mtime, sb.st_size};
+        total += sb.st_size;
+    }
+    closedir(d);
+
+    if (total > max_bytes)
+    {
+        qsort(entries, count, sizeof(Entry), compare_entries);
+        for (int i = 0; i < count && total > max_bytes / 10 * 9; ++i)
+            if (unlink(entries[i].path) == 0)
+                total -= entries[i].size;
+    }
+
+    for (int i = 0; i < count; ++i)
+        g_free(entries[i].path);
+    free(entries);
+    return total;
+}
+
+static bool write_entry(FILE *f, cairo_surface_t *image)
+{
+    int width = cairo_image_surface_get_width(image);
+    int height = cairo_image_surface_get_height(image);
+    int32_t header[3] = {width, height, (height + TILE_ROWS - 1) / TILE_ROWS};
+    if (fwrite(CACHE_MAGIC, 8, 1, f) != 1 || fwrite(header, sizeof(header), 1, f) != 1)
+        return false;
+
+    unsigned char *data = cairo_image_surface_get_data(image);
+    int stride = cairo_image_surface_get_stride(image);
+    for (int t = 0; t < header[2]; ++t)
+    {
+        int rows = height - t * TILE_ROWS < TILE_ROWS ? height - t * TILE_ROWS : TILE_ROWS;
+        cairo_surface_t *tile = cairo_image_surface_create_for_data(
+            data + (size_t)t * TILE_ROWS * stride, CAIRO_FORMAT_RGB24, width, rows, stride);
+
+        // The tile's size goes in front of it once it is known.
+        long start = ftell(f);
+        uint32_t size = 0;
+        bool ok = fwrite(&size, sizeof(size), 1, f) == 1 &&
+            cairo_surface_write_to_png_stream(tile, write_file, f) == CAIRO_STATUS_SUCCESS;
+        cairo_surface_destroy(tile);
+        if (!ok)
+            return false;
+
+        long end = ftell(f);
+        size = end - start - sizeof(size);
+        ok = fseek(f, start, SEEK_SET) == 0 && fwrite(&size, sizeof(size), 1, f) == 1 &&
+            fseek(f, end, SEEK_SET) == 0;
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+// Writes one entry and keeps the running total of the directory; the
+// directory is only read again when that total goes over the limit, which
+// also corrects for what other processes have added or evicted.
+static void write_job(StoreJob *job)
+{
+    char *tmp_path = g_strdup_printf("%s.%d.tmp", job->path, (int)getpid());
+    FILE *f = fopen(tmp_path, "wb");
+    if (f != NULL)
+    {
+        bool ok = write_entry(f, job->image);
+        ok = (fclose(f) == 0) && ok;
+
+        struct stat sb, old;
+        bool replaced = stat(job->path, &old) == 0;
+        if (ok && stat(tmp_path, &sb) == 0 && rename(tmp_path, job->path) == 0)
+        {
+            if (cache_bytes >= 0)
+                cache_bytes += sb.st_size - (replaced ? old.st_size : 0);
+            if (cache_bytes < 0 || cache_bytes > job->max_bytes)
+                cache_bytes = scan_cache(job->dir, job->max_bytes);
+        }
+        else
+            unlink(tmp_path);
+    }
+    g_free(tmp_path);
+}
+
+static void free_job(StoreJob *job)
+{
+    free(job->dir);
+    g_free(job->path);
+    cairo_surface_destroy(job->image);
+    free(job);
+}
+
+// Runs for the rest of the process once the first page is stored.
+static gpointer store_thread(gpointer data)
+{
+    (void)data;
+    g_mutex_lock(&store_lock);
+    for (;;)
+    {
+        while (store_head == NULL)
+            g_cond_wait(&store_cond, &store_lock);
+        StoreJob *job = store_head;
+        store_head = job->next;
+        if (store_head == NULL)
+            store_tail = NULL;
+        --store_count;
+        g_mutex_unlock(&store_lock);
+
+        write_job(job);
+        free_job(job);
+        g_mutex_lock(&store_lock);
+    }
+    return NULL;
+}
+
+// Queues image to be compressed and written in the background; image is not
+// kept.  When the writer falls behind, the oldest pending page is dropped.
+void disk_cache_store(DiskCache *dc, const DiskCacheKey *key, cairo_surface_t *image)
+{
+    if (dc == NULL)
+        return;
+
+    int width = cairo_image_surface_get_width(image);
+    int height = cairo_image_surface_get_height(image);
+    cairo_surface_t *copy = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+    cairo_t *cr = cairo_create(copy);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_surface(cr, image, 0, 0);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+    cairo_surface_flush(copy);
+
+    // The job owns a copy of the cache settings, so dc may go away first.
+    StoreJob *job = malloc(sizeof(StoreJob));
+    job->dir = strdup(dc->dir);
+    job->max_bytes = dc->max_bytes;
+    job->path = entry_path(dc, key);
+    job->image = copy;
+    job->next = NULL;
+
+    StoreJob *dropped = NULL;
+    g_mutex_lock(&store_lock);
+    if (store_count == STORE_QUEUE_MAX)
+    {
+        dropped = store_head;
+        store_head = dropped->next;
+        --store_count;
+    }
+    if (store_head == NULL)
+        store_head = job;
+    else
+        store_tail->next = job;
+    store_tail = job;
+    ++store_count;
+    if (!store_running)
+    {
+        store_running = true;
+        g_thread_unref(g_thread_new("disk-cache", store_thread, NULL));
+    }
+    g_cond_signal(&store_cond);
+    g_mutex_unlock(&store_lock);
+
+    if (dropped != NULL)
+        free_job(dropped);
+}
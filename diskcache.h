@@ -0,0 +1,22 @@
+#ifndef DISKCACHE_H
+#define DISKCACHE_H
+
+#include <stdint.h>
+#include <cairo/cairo.h>
+
+typedef struct DiskCache DiskCache;
+
+typedef struct {
+    int page;
+    int dpi;            // dots per inch, rounded
+    int rotation;
+    uint32_t theme;     // 0 for the light theme, a palette hash otherwise
+} DiskCacheKey;
+
+DiskCache *disk_cache_new(const char *file_name, long max_bytes);
+void disk_cache_free(DiskCache *dc);
+cairo_surface_t *disk_cache_load(DiskCache *dc, const DiskCacheKey *key, int width, int height);
+cairo_surface_t *disk_cache_load_any(DiskCache *dc, const DiskCacheKey *key);
+void disk_cache_store(DiskCache *dc, const DiskCacheKey *key, cairo_surface_t *image);
+
+#endif // DISKCACHE_H
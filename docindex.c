@@ -0,0 +1,369 @@
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <poppler.h>
+#include "docindex.h"
+#include "docload.h"
+
+// The structure of a document, read once by a background thread with its
+// own PopplerDocument: the outline flattened in document order, every named
+// destination with its page and offset, and the page labels.  Names and
+// labels go into open addressing tables, so resolving a link or a label is
+// a single lookup.  Everything is immutable once doc_index_ready() says so.
+
+typedef struct {
+    char *key;
+    int page;
+    double top;
+} Target;
+
+typedef struct {
+    Target *slots;
+    uint32_t capacity;  // power of two, or 0
+    uint32_t size;
+} TargetTable;
+
+struct DocIndex {
+    char *file_name;
+    int wake_fd;
+    GThread *thread;
+    gint ready;
+    gint cancel;
+
+    OutlineEntry *outline;
+    int outline_size;
+    int outline_capacity;
+    TargetTable dests;
+    TargetTable labels;     // label -> first page with it
+    char **page_labels;     // NULL when all labels are the page numbers
+    int total_pages;
+};
+
+static uint32_t hash_string(const char *s)
+{
+    uint32_t h = 2166136261u;
+    for (; *s; ++s)
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    return h;
+}
+
+static const Target *table_lookup(const TargetTable *t, const char *key)
+{
+    if (t->capacity == 0)
+        return NULL;
+
+    uint32_t mask = t->capacity - 1;
+    for (uint32_t i = hash_string(key) & mask; t->slots[i].key; i = (i + 1) & mask)
+        if (strcmp(t->slots[i].key, key) == 0)
+            return &t->slots[i];
+    return NULL;
+}
+
+static void table_insert(TargetTable *t, Target target);
+
+static void table_grow(TargetTable *t)
+{
+    TargetTable old = *t;
+    t->capacity = old.capacity ? old.capacity * 2 : 64;
+    t->slots = calloc(t->capacity, sizeof(Target));
+    t->size = 0;
+    for (uint32_t i = 0; i < old.capacity; ++i)
+        if (old.slots[i].key)
+            table_insert(t, old.slots[i]);
+    free(old.slots);
+}
+
+// Takes target.key; the first target of a key wins.
+static void table_insert(TargetTable *t, Target target)
+{
+    if ((t->size + 1) * 2 > t->capacity)
+        table_grow(t);
+
+    uint32_t mask = t->capacity - 1;
+    uint32_t i = hash_string(target.key) & mask;
+    for (; t->slots[i].key; i = (i + 1) & mask)
+        if (strcmp(t->slots[i].key, target.key) == 0) {
+            free(target.key);
+            return;
+        }
+    t->slots[i] = target;
+    ++t->size;
+}
+
+static void table_free(TargetTable *t)
+{
+    for (uint32_t i = 0; i < t->capacity; ++i)
+        free(t->slots[i].key);
+    free(t->slots);
+}
+
+// Points below the top of a page of page_height where dest puts the view,
+// or -1 when it leaves the vertical position alone.
+double doc_dest_top(const PopplerDest *dest, double page_height)
+{
+    if (!dest->change_top && dest->type != POPPLER_DEST_FITR)
+        return -1;
+    double top = page_height - dest->top;
+    return top < 0 ? 0 : top;
+}
+
+typedef struct {
+    DocIndex *di;
+    const double *heights;
+} DestWalk;
+
+static gboolean add_dest(gpointer key, gpointer value, gpointer data)
+{
+    DestWalk *w = data;
+    const PopplerDest *dest = value;
+    if (dest->page_num < 1 || dest->page_num > w->di->total_pages)
+        return FALSE;
+
+    Target t = {strdup(key), dest->page_num, doc_dest_top(dest, w->heights[dest->page_num - 1])};
+    table_insert(&w->di->dests, t);
+    return g_atomic_int_get(&w->di->cancel);
+}
+
+static void resolve_dest(const DocIndex *di, const double *heights, const PopplerDest *dest,
+    int *page, double *top)
+{
+    *page = 0;
+    *top = -1;
+    if (dest->type == POPPLER_DEST_NAMED)
+    {
+        const Target *t = dest->named_dest ? table_lookup(&di->dests, dest->named_dest) : NULL;
+        if (t) {
+            *page = t->page;
+            *top = t->top;
+        }
+    }
+    else if (dest->page_num >= 1 && dest->page_num <= di->total_pages)
+    {
+        *page = dest->page_num;
+        *top = doc_dest_top(dest, heights[dest->page_num - 1]);
+    }
+}
+
+static void add_outline_entry(DocIndex *di, OutlineEntry e)
+{
+    if (di->outline_size == di->outline_capacity)
+    {
+        di->outline_capacity = di->outline_capacity ? di->outline_capacity * 2 : 64;
+        di->outline = realloc(di->outline, di->outline_capacity * sizeof(OutlineEntry));
+    }
+    di->outline[di->outline_size++] = e;
+}
+
+static void collect_outline(DocIndex *di, const double *heights, PopplerIndexIter *iter, int level)
+{
+    do
+    {
+        PopplerAction *action = poppler_index_iter_get_action(iter);
+        if (action)
+        {
+            OutlineEntry e = {strdup(action->any.title ? action->any.title : ""), level, 0, -1};
+            for (char *c = e.title; *c; ++c)
+                if (*c == '\n' || *c == '\r' || *c == '\t')
+                    *c = ' ';
+            if (action->type == POPPLER_ACTION_GOTO_DEST && action->goto_dest.dest)
+                resolve_dest(di, heights, action->goto_dest.dest, &e.page, &e.top);
+            add_outline_entry(di, e);
+            poppler_action_free(action);
+        }
+
+        PopplerIndexIter *child = poppler_index_iter_get_child(iter);
+        if (child)
+        {
+            collect_outline(di, heights, child, level + 1);
+            poppler_index_iter_free(child);
+        }
+    } while (!g_atomic_int_get(&di->cancel) && poppler_index_iter_next(iter));
+}
+
+// Page sizes and labels, one page at a time.
+static double *collect_pages(DocIndex *di, PopplerDocument *doc)
+{
+    double *heights = calloc(di->total_pages + 1, sizeof(double));
+    char **labels = calloc(di->total_pages, sizeof(char *));
+    bool numbered = true;
+
+    for (int i = 0; i < di->total_pages && !g_atomic_int_get(&di->cancel); ++i)
+    {
+        PopplerPage *page = poppler_document_get_page(doc, i);
+        if (page == NULL)
+            continue;
+
+        double width;
+        poppler_page_get_size(page, &width, &heights[i]);
+        gchar *label = poppler_page_get_label(page);
+        if (label && *label)
+        {
+            char number[16];
+            snprintf(number, sizeof(number), "%d", i + 1);
+            numbered = numbered && strcmp(label, number) == 0;
+            labels[i] = strdup(label);
+            table_insert(&di->labels, (Target){strdup(label), i + 1, -1});
+        }
+        g_free(label);
+        g_object_unref(page);
+        if ((i + 1) % 256 == 0)
+            doc_trim(doc);
+    }
+
+    if (numbered)
+    {
+        for (int i = 0; i < di->total_pages; ++i)
+            free(labels[i]);
+        free(labels);
+        labels = NULL;
+        table_free(&di->labels);
+        di->labels = (TargetTable){NULL, 0, 0};
+    }
+    di->page_labels = labels;
+    return heights;
+}
+
+static gpointer build_thread(gpointer data)
+{
+    DocIndex *di = data;
+    PopplerDocument *doc = doc_load(di->file_name, NULL);
+    if (doc)
+    {
+        di->total_pages = poppler_document_get_n_pages(doc);
+        double *heights = collect_pages(di, doc);
+
+        GTree *dests = poppler_document_create_dests_tree(doc);
+        if (dests)
+        {
+            DestWalk w = {di, heights};
+            g_tree_foreach(dests, add_dest, &w);
+            g_tree_destroy(dests);
+        }
+
+        PopplerIndexIter *iter = poppler_index_iter_new(doc);
+        if (iter)
+        {
+            collect_outline(di, heights, iter, 0);
+            poppler_index_iter_free(iter);
+        }
+
+        free(heights);
+        g_object_unref(doc);
+    }
+    g_atomic_int_set(&di->ready, 1);
+
+    char c = 0;
+    ssize_t r = write(di->wake_fd, &c, 1);
+    (void)r;
+    return NULL;
+}
+
+// Reads the structure of file_name in the background; wake_fd gets a byte
+// when it is ready.
+DocIndex *doc_index_new(const char *file_name, int wake_fd)
+{
+    DocIndex *di = calloc(1, sizeof(DocIndex));
+    di->file_name = strdup(file_name);
+    di->wake_fd = wake_fd;
+    di->thread = g_thread_new("doc-index", build_thread, di);
+    return di;
+}
+
+void doc_index_free(DocIndex *di)
+{
+    if (di == NULL)
+        return;
+
+    g_atomic_int_set(&di->cancel, 1);
+    g_thread_join(di->thread);
+
+    for (int i = 0; i < di->outline_size; ++i)
+        free(di->outline[i].title);
+    free(di->outline);
+    table_free(&di->dests);
+    table_free(&di->labels);
+    if (di->page_labels)
+        for (int i = 0; i < di->total_pages; ++i)
+            free(di->page_labels[i]);
+    free(di->page_labels);
+    free(di->file_name);
+    free(di);
+}
+
+bool doc_index_ready(const DocIndex *di)
+{
+    return di && g_atomic_int_get(&di->ready);
+}
+
+int doc_index_outline_size(const DocIndex *di)
+{
+    return doc_index_ready(di) ? di->outline_size : 0;
+}
+
+const OutlineEntry *doc_index_outline(const DocIndex *di, int i)
+{
+    return i >= 0 && i < doc_index_outline_size(di) ? &di->outline[i] : NULL;
+}
+
+static bool word_prefix(const char *title, const char *prefix, size_t n)
+{
+    for (const char *c = title; *c; ++c)
+        if ((c == title || !isalnum((unsigned char)c[-1])) && strncasecmp(c, prefix, n) == 0)
+            return true;
+    return false;
+}
+
+// The first outline entry from index from on (wrapping around) whose title
+// starts with prefix, ignoring case; failing that, the first with a word
+// starting with it.  -1 if none.
+int doc_index_find_outline(const DocIndex *di, const char *prefix, int from)
+{
+    int size = doc_index_outline_size(di);
+    size_t n = strlen(prefix);
+    if (size == 0 || n == 0)
+        return -1;
+    from = from < 0 || from >= size ? 0 : from;
+
+    for (int k = 0; k < size; ++k)
+    {
+        const char *title = di->outline[(from + k) % size].title;
+        while (isspace((unsigned char)*title))
+            ++title;
+        if (strncasecmp(title, prefix, n) == 0)
+            return (from + k) % size;
+    }
+    for (int k = 0; k < size; ++k)
+        if (word_prefix(di->outline[(from + k) % size].title, prefix, n))
+            return (from + k) % size;
+    return -1;
+}
+
+// Resolves a named destination, as found in PopplerDest.named_dest.
+bool doc_index_find_dest(const DocIndex *di, const char *name, int *page, double *top)
+{
+    const Target *t = doc_index_ready(di) ? table_lookup(&di->dests, name) : NULL;
+    if (t == NULL)
+        return false;
+    *page = t->page;
+    *top = t->top;
+    return true;
+}
+
+// The label of page, or NULL when it is just the page number.
+const char *doc_index_page_label(const DocIndex *di, int page)
+{
+    if (!doc_index_ready(di) || di->page_labels == NULL || page < 1 || page > di->total_pages)
+        return NULL;
+    return di->page_labels[page - 1];
+}
+
+// The first page labelled label, or 0.
+int doc_index_label_page(const DocIndex *di, const char *label)
+{
+    const Target *t = doc_index_ready(di) ? table_lookup(&di->labels, label) : NULL;
+    return t ? t->page : 0;
+}
@@ -0,0 +1,29 @@
+#ifndef DOCINDEX_H
+#define DOCINDEX_H
+
+#include <stdbool.h>
+#include <poppler.h>
+
+typedef struct {
+    char *title;
+    int level;      // depth in the outline tree, 0 at the top
+    int page;       // 1-based, 0 when the entry leads nowhere
+    double top;     // points below the top of the page, -1 if unspecified
+} OutlineEntry;
+
+typedef struct DocIndex DocIndex;
+
+DocIndex *doc_index_new(const char *file_name, int wake_fd);
+void doc_index_free(DocIndex *di);
+bool doc_index_ready(const DocIndex *di);
+
+int doc_index_outline_size(const DocIndex *di);
+const OutlineEntry *doc_index_outline(const DocIndex *di, int i);
+int doc_index_find_outline(const DocIndex *di, const char *prefix, int from);
+bool doc_index_find_dest(const DocIndex *di, const char *name, int *page, double *top);
+const char *doc_index_page_label(const DocIndex *di, int page);
+int doc_index_label_page(const DocIndex *di, const char *label);
+
+double doc_dest_top(const PopplerDest *dest, double page_height);
+
+#endif // DOCINDEX_H
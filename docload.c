@@ -0,0 +1,173 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poppler.h>
+#include "docload.h"
+
+// Documents are parsed straight from a read-only mapping of the file, so
+// nothing is copied at startup and every viewer (and worker thread) of the
+// same file shares the OS page cache.  The mapping lives as long as the
+// GBytes poppler keeps for the document.
+//
+// That is only safe for files nobody writes to: pdflatex and friends
+// truncate and rewrite the file in place, and touching a mapping past the
+// new end raises SIGBUS.  Writable files are therefore opened by name and
+// read through poppler's own file stream, where a rewrite at worst renders
+// a page wrongly, or not at all, until the reload.
+
+enum { LOAD_RUNNING, LOAD_DONE, LOAD_CANCELLED };
+
+struct DocLoader {
+    char *file_name;
+    int wake_fd;
+    DocLoadCheck check;
+    void *check_data;
+    GThread *thread;
+    gint state;         // LOAD_RUNNING, LOAD_DONE or LOAD_CANCELLED
+    PopplerDocument *doc;
+    GError *error;
+};
+
+PopplerDocument *doc_load(const char *file_name, GError **error)
+{
+    int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+    struct stat sb;
+    if (fd < 0 || fstat(fd, &sb) != 0)
+    {
+        int err = errno;
+        if (fd >= 0)
+            close(fd);
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+            "Cannot open %s: %s", file_name, g_strerror(err));
+        return NULL;
+    }
+    if (sb.st_size == 0)
+    {
+        close(fd);
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s is empty", file_name);
+        return NULL;
+    }
+
+    if (sb.st_mode & (S_IWUSR | S_IWGRP | S_IWOTH))
+    {
+        close(fd);
+        char *path = g_canonicalize_filename(file_name, NULL);
+        char *uri = g_filename_to_uri(path, NULL, error);
+        g_free(path);
+        if (uri == NULL)
+            return NULL;
+        PopplerDocument *doc = poppler_document_new_from_file(uri, NULL, error);
+        g_free(uri);
+        return doc;
+    }
+
+    GMappedFile *mf = g_mapped_file_new_from_fd(fd, FALSE, error);
+    close(fd);
+    if (mf == NULL)
+        return NULL;
+    GBytes *bytes = g_mapped_file_get_bytes(mf);
+    g_mapped_file_unref(mf);
+
+    PopplerDocument *doc = poppler_document_new_from_bytes(bytes, NULL, error);
+    if (doc)
+        g_object_set_data_full(G_OBJECT(doc), "breathe-bytes", bytes, (GDestroyNotify)g_bytes_unref);
+    else
+        g_bytes_unref(bytes);
+    return doc;
+}
+
+// Drops the pages of doc's file mapping from resident memory; they are read
+// back from the file when touched again.  Keeps memory bounded while large
+// documents are paged or scanned through.  Writable files, read through
+// poppler's file stream, have no mapping to drop.
+void doc_trim(PopplerDocument *doc)
+{
+    GBytes *bytes = g_object_get_data(G_OBJECT(doc), "breathe-bytes");
+    if (bytes == NULL)
+        return;
+
+    gsize size;
+    gconstpointer data = g_bytes_get_data(bytes, &size);
+    if (data != NULL && size > 0)
+        madvise((void *)data, size, MADV_DONTNEED);
+}
+
+static gpointer load_thread(gpointer data)
+{
+    DocLoader *dl = data;
+    dl->doc = doc_load(dl->file_name, &dl->error);
+    if (dl->doc && dl->check)
+        dl->check(dl->doc, dl->check_data);
+
+    // A cancelled loader is no longer looked at, nor is its wake_fd open.
+    if (!g_atomic_int_compare_and_exchange(&dl->state, LOAD_RUNNING, LOAD_DONE))
+    {
+        if (dl->doc)
+            g_object_unref(dl->doc);
+        if (dl->error)
+            g_error_free(dl->error);
+        free(dl->file_name);
+        free(dl);
+        return NULL;
+    }
+
+    char c = 0;
+    ssize_t r = write(dl->wake_fd, &c, 1);
+    (void)r;
+    return NULL;
+}
+
+// Parses file_name on a background thread; wake_fd gets a byte when done.
+// check, if given, is run on that thread with the parsed document first,
+// for work on it that should not hold up the main thread.
+DocLoader *doc_loader_new(const char *file_name, int wake_fd, DocLoadCheck check, void *data)
+{
+    DocLoader *dl = calloc(1, sizeof(DocLoader));
+    dl->file_name = strdup(file_name);
+    dl->wake_fd = wake_fd;
+    dl->check = check;
+    dl->check_data = data;
+    dl->thread = g_thread_new("doc-load", load_thread, dl);
+    return dl;
+}
+
+bool doc_loader_done(DocLoader *dl)
+{
+    return g_atomic_int_get(&dl->state) == LOAD_DONE;
+}
+
+// Gives up on the load.  Poppler cannot be interrupted, so a parse still
+// running finishes in the background and then frees what it made.
+void doc_loader_cancel(DocLoader *dl)
+{
+    GThread *thread = dl->thread;
+    if (g_atomic_int_compare_and_exchange(&dl->state, LOAD_RUNNING, LOAD_CANCELLED))
+    {
+        g_thread_unref(thread);
+        return;
+    }
+
+    PopplerDocument *doc = doc_loader_finish(dl, NULL);
+    if (doc)
+        g_object_unref(doc);
+}
+
+// Waits for the load and frees the loader, returning the new document or
+// NULL with error set.
+PopplerDocument *doc_loader_finish(DocLoader *dl, GError **error)
+{
+    g_thread_join(dl->thread);
+
+    PopplerDocument *doc = dl->doc;
+    if (dl->error)
+        g_propagate_error(error, dl->error);
+
+    free(dl->file_name);
+    free(dl);
+    return doc;
+}
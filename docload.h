@@ -0,0 +1,18 @@
+#ifndef DOCLOAD_H
+#define DOCLOAD_H
+
+#include <stdbool.h>
+#include <poppler.h>
+
+typedef struct DocLoader DocLoader;
+typedef void (*DocLoadCheck)(PopplerDocument *doc, void *data);
+
+PopplerDocument *doc_load(const char *file_name, GError **error);
+void doc_trim(PopplerDocument *doc);
+
+DocLoader *doc_loader_new(const char *file_name, int wake_fd, DocLoadCheck check, void *data);
+bool doc_loader_done(DocLoader *dl);
+void doc_loader_cancel(DocLoader *dl);
+PopplerDocument *doc_loader_finish(DocLoader *dl, GError **error);
+
+#endif // DOCLOAD_H
@@ -0,0 +1,95 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <glib.h>
+#include "filewatch.h"
+
+// Watches the directory of a file rather than the file itself, so the watch
+// survives builds that replace it by rename.  A build touches the file many
+// times; every event pushes the deadline back by debounce_ms, and the watch
+// fires once the file has been quiet that long.
+
+struct FileWatch {
+    int fd;
+    int wd;
+    char *base_name;
+    int debounce_ms;
+    gint64 deadline;        // monotonic usec, 0 when idle
+};
+
+FileWatch *file_watch_new(const char *file_name, int debounce_ms)
+{
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    char *dir = g_path_get_dirname(file_name);
+    int wd = inotify_add_watch(fd, dir,
+        IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO | IN_CREATE);
+    g_free(dir);
+    if (wd < 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    FileWatch *fw = calloc(1, sizeof(FileWatch));
+    fw->fd = fd;
+    fw->wd = wd;
+    char *base = g_path_get_basename(file_name);
+    fw->base_name = strdup(base);
+    g_free(base);
+    fw->debounce_ms = debounce_ms;
+    return fw;
+}
+
+void file_watch_free(FileWatch *fw)
+{
+    if (fw == NULL)
+        return;
+    close(fw->fd);
+    free(fw->base_name);
+    free(fw);
+}
+
+int file_watch_fd(const FileWatch *fw)
+{
+    return fw->fd;
+}
+
+// Drains pending events, arming the deadline if any concern the file.
+void file_watch_read(FileWatch *fw)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(fw->fd, buf, sizeof(buf))) > 0)
+    {
+        for (char *p = buf; p < buf + len; )
+        {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            if (ev->len > 0 && strcmp(ev->name, fw->base_name) == 0)
+                fw->deadline = g_get_monotonic_time() + fw->debounce_ms * 1000;
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+}
+
+// Milliseconds until the watch fires, or -1 when nothing is pending.
+int file_watch_timeout(const FileWatch *fw)
+{
+    if (fw->deadline == 0)
+        return -1;
+    gint64 left = fw->deadline - g_get_monotonic_time();
+    return left > 0 ? (int)((left + 999) / 1000) : 0;
+}
+
+// Whether the file settled after a change; clears the pending state.
+bool file_watch_fired(FileWatch *fw)
+{
+    if (fw->deadline == 0 || g_get_monotonic_time() < fw->deadline)
+        return false;
+    fw->deadline = 0;
+    return true;
+}
@@ -0,0 +1,15 @@
+#ifndef FILEWATCH_H
+#define FILEWATCH_H
+
+#include <stdbool.h>
+
+typedef struct FileWatch FileWatch;
+
+FileWatch *file_watch_new(const char *file_name, int debounce_ms);
+void file_watch_free(FileWatch *fw);
+int file_watch_fd(const FileWatch *fw);
+void file_watch_read(FileWatch *fw);
+int file_watch_timeout(const FileWatch *fw);
+bool file_watch_fired(FileWatch *fw);
+
+#endif // FILEWATCH_H
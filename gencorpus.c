@@ -0,0 +1,393 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cairo/cairo.h>
+#include <cairo/cairo-pdf.h>
+
+// Writes synthetic stress documents for benchmarks and large-file tests,
+// so performance problems can be reproduced without the PDFs that showed
+// them.  Everything is drawn from a seeded PRNG and the creation date is
+// fixed, so the same options give the same file on any machine.
+
+#define USAGE "usage: gencorpus [--preset name] [options] out.pdf\n" \
+    "  --preset name        pages, links, paths, images, mixed or huge\n" \
+    "  --pages n            page count (default 100)\n" \
+    "  --lines n            lines of text per page (default 50)\n" \
+    "  --links n            links per page (default 0)\n" \
+    "  --path-segments n    segments of one stroked path per page (default 0)\n" \
+    "  --image-kb n         an incompressible image of n KiB per page (default 0)\n" \
+    "  --mixed-sizes        cycle through page sizes and orientations\n" \
+    "  --outline            an outline entry and named destination per chapter\n" \
+    "  --labels             roman page labels for the front matter\n" \
+    "  --seed n             PRNG seed (default 1)\n" \
+    "  --help               this text\n"
+
+typedef struct {
+    int pages;
+    int lines;
+    int links;
+    int path_segments;
+    int image_kb;
+    bool mixed_sizes;
+    bool outline;
+    bool labels;
+    uint64_t seed;
+} Params;
+
+typedef struct {
+    const char *name;
+    Params params;
+} Preset;
+
+static const Preset presets[] = {
+    // Many pages of plain text.
+    {"pages",  {10000, 50,    0,      0,    0, false, true,  true,  1}},
+    // Dense text under thousands of links per page.
+    {"links",  {200,   80,    2000,   0,    0, false, true,  false, 1}},
+    // Vector paths of hundreds of thousands of segments.
+    {"paths",  {50,    0,     0, 200000,    0, false, false, false, 1}},
+    // A large photo-like image on every page.
+    {"images", {200,   10,    0,      0, 4096, false, false, false, 1}},
+    // Every page size and orientation in turn.
+    {"mixed",  {500,   50,   20,   1000,   64, true,  true,  true,  1}},
+    // Several GB of images and text.
+    {"huge",   {2000,  50,   10,      0, 1536, true,  true,  true,  1}},
+};
+
+typedef struct {
+    double width, height;   // points
+    bool rotated;           // content turned by 90 degrees
+} PageSize;
+
+static const PageSize page_sizes[] = {
+    {595, 842, false},      // A4
+    {612, 792, false},      // Letter
+    {842, 595, true},       // A4 landscape
+    {842, 1191, false},     // A3
+    {420, 595, false},      // A5
+    {792, 612, true},       // Letter landscape
+    {1684, 1191, false},    // A2 landscape, unrotated content
+};
+
+static uint64_t rng_state;
+
+// xorshift64*, the same sequence everywhere for a seed.
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static double rng_unit(void)
+{
+    return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static const char *syllables[] = {
+    "ka", "lo", "mi", "ten", "ra", "sol", "vi", "qu", "an", "der", "el", "po",
+    "stra", "ne", "ti", "gor", "ba", "lu", "si", "ma", "ver", "on", "chi", "es",
+};
+
+static void random_word(char *word, size_t size)
+{
+    int n = 1 + rng() % 3;
+    word[0] = '\0';
+    for (int i = 0; i < n; ++i)
+        strncat(word, syllables[rng() % (sizeof(syllables) / sizeof(*syllables))],
+            size - strlen(word) - 1);
+}
+
+static void to_roman(int n, char *out, size_t size)
+{
+    static const struct { int value; const char *digits; } table[] = {
+        {1000, "m"}, {900, "cm"}, {500, "d"}, {400, "cd"}, {100, "c"}, {90, "xc"},
+        {50, "l"}, {40, "xl"}, {10, "x"}, {9, "ix"}, {5, "v"}, {4, "iv"}, {1, "i"},
+    };
+    out[0] = '\0';
+    for (size_t i = 0; i < sizeof(table) / sizeof(*table); ++i)
+        for (; n >= table[i].value; n -= table[i].value)
+            strncat(out, table[i].digits, size - strlen(out) - 1);
+}
+
+// Lines are filled to a character count estimated from the font size, not
+// to measured text widths: those depend on the installed fonts, and so would
+// the number of words drawn, and with it everything after on the PRNG.
+static void draw_text(cairo_t *cr, const Params *p, double width, double height, int page)
+{
+    cairo_select_font_face(cr, "serif", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+    double margin = 54, leading = (height - 2 * margin) / (p->lines > 0 ? p->lines : 1);
+    double font_size = fmin(leading * 0.8, 11);
+    cairo_set_font_size(cr, font_size);
+    cairo_set_source_rgb(cr, 0, 0, 0);
+
+    // About half an em per character in a serif face.
+    size_t line_chars = (size_t)((width - 2 * margin) / (font_size * 0.5));
+    char line[512];
+    if (line_chars > sizeof(line) - 1)
+        line_chars = sizeof(line) - 1;
+
+    char heading[64];
+    snprintf(heading, sizeof(heading), "Page %d", page);
+    cairo_move_to(cr, margin, margin - 12);
+    cairo_show_text(cr, heading);
+
+    for (int l = 0; l < p->lines; ++l)
+    {
+        line[0] = '\0';
+        for (;;)
+        {
+            char word[32];
+            random_word(word, sizeof(word));
+            size_t len = strlen(line);
+            if (len + (len > 0) + strlen(word) > line_chars)
+                break;
+            snprintf(line + len, sizeof(line) - len, "%s%s", len > 0 ? " " : "", word);
+        }
+        cairo_move_to(cr, margin, margin + (l + 1) * leading);
+        cairo_show_text(cr, line);
+    }
+}
+
+// Links on a grid over the page: to other pages, to named destinations
+// (with --outline) and to web addresses.
+static void draw_links(cairo_t *cr, const Params *p, double width, double height)
+{
+    int cols = (int)ceil(sqrt(p->links * width / height));
+    int rows = (p->links + cols - 1) / cols;
+    double cw = width / cols, ch = height / rows;
+
+    cairo_set_source_rgba(cr, 0, 0, 1, 0.3);
+    cairo_set_line_width(cr, 0.5);
+    for (int i = 0; i < p->links; ++i)
+    {
+        double x = (i % cols) * cw, y = (i / cols) * ch;
+        char attrs[256];
+        int kind = rng() % 3;
+        if (kind == 0 || (kind == 1 && !p->outline))
+            snprintf(attrs, sizeof(attrs), "rect=[%g %g %g %g] page=%d pos=[%g %g]",
+                x + 1, y + 1, cw - 2, ch - 2, 1 + (int)(rng() % p->pages), 72.0, 72.0 + rng() % 400);
+        else if (kind == 1)
+            snprintf(attrs, sizeof(attrs), "rect=[%g %g %g %g] dest='chapter.%d'",
+                x + 1, y + 1, cw - 2, ch - 2, (int)(rng() % ((p->pages + 9) / 10)));
+        else
+            snprintf(attrs, sizeof(attrs), "rect=[%g %g %g %g] uri='https://example.com/%llu'",
+                x + 1, y + 1, cw - 2, ch - 2, (unsigned long long)(rng() % 100000));
+        cairo_tag_begin(cr, CAIRO_TAG_LINK, attrs);
+        cairo_tag_end(cr, CAIRO_TAG_LINK);
+        cairo_rectangle(cr, x + 1, y + 1, cw - 2, ch - 2);
+    }
+    cairo_stroke(cr);
+}
+
+// One stroked random walk; stays within the page.
+static void draw_path(cairo_t *cr, const Params *p, double width, double height)
+{
+    double x = width / 2, y = height / 2;
+    cairo_move_to(cr, x, y);
+    for (int i = 0; i < p->path_segments; ++i)
+    {
+        x = fmin(width - 10, fmax(10, x + (rng_unit() - 0.5) * 20));
+        y = fmin(height - 10, fmax(10, y + (rng_unit() - 0.5) * 20));
+        if (i % 4 == 3)
+            cairo_curve_to(cr, x + 5, y - 5, x - 5, y + 5, x, y);
+        else
+            cairo_line_to(cr, x, y);
+    }
+    cairo_set_source_rgb(cr, rng_unit(), rng_unit(), rng_unit());
+    cairo_set_line_width(cr, 0.3);
+    cairo_stroke(cr);
+}
+
+// Noise, which no PDF filter compresses, so the file grows by about the
+// image size.
+static void draw_image(cairo_t *cr, const Params *p, double width, double height)
+{
+    int side = (int)sqrt(p->image_kb * 1024.0 / 3);
+    if (side < 1)
+        return;
+
+    cairo_surface_t *img = cairo_image_surface_create(CAIRO_FORMAT_RGB24, side, side);
+    unsigned char *data = cairo_image_surface_get_data(img);
+    int stride = cairo_image_surface_get_stride(img);
+    for (int y = 0; y < side; ++y)
+    {
+        uint32_t *row = (uint32_t *)(data + (size_t)y * stride);
+        for (int x = 0; x < side; ++x)
+            row[x] = (uint32_t)rng() & 0xffffff;
+    }
+    cairo_surface_mark_dirty(img);
+
+    double scale = fmin(width, height) * 0.8 / side;
+    cairo_save(cr);
+    cairo_translate(cr, (width - side * scale) / 2, (height - side * scale) / 2);
+    cairo_scale(cr, scale, scale);
+    cairo_set_source_surface(cr, img, 0, 0);
+    cairo_paint_with_alpha(cr, 0.6);
+    cairo_restore(cr);
+    cairo_surface_destroy(img);
+}
+
+static int generate(const Params *p, const char *file_name)
+{
+    rng_state = p->seed ? p->seed : 1;
+
+    cairo_surface_t *surface = cairo_pdf_surface_create(file_name, page_sizes[0].width,
+        page_sizes[0].height);
+    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+        fprintf(stderr, "Error: Cannot create %s.\n", file_name);
+        cairo_surface_destroy(surface);
+        return 1;
+    }
+    cairo_pdf_surface_set_metadata(surface, CAIRO_PDF_METADATA_CREATOR, "gencorpus");
+    cairo_pdf_surface_set_metadata(surface, CAIRO_PDF_METADATA_CREATE_DATE, "2000-01-01T00:00:00");
+    cairo_t *cr = cairo_create(surface);
+
+    int front_matter = p->labels ? (p->pages > 20 ? 10 : p->pages / 2) : 0;
+    for (int page = 1; page <= p->pages; ++page)
+    {
+        PageSize ps = p->mixed_sizes ? page_sizes[(page - 1) % (sizeof(page_sizes) / sizeof(*page_sizes))]
+                                     : page_sizes[0];
+        cairo_pdf_surface_set_size(surface, ps.width, ps.height);
+
+        if (p->labels)
+        {
+            char label[32];
+            if (page <= front_matter)
+                to_roman(page, label, sizeof(label));
+            else
+                snprintf(label, sizeof(label), "%d", page - front_matter);
+            cairo_pdf_surface_set_page_label(surface, label);
+        }
+
+        if (p->outline && (page - 1) % 10 == 0)
+        {
+            char attrs[64], title[64], link[64];
+            int chapter = (page - 1) / 10;
+            snprintf(attrs, sizeof(attrs), "name='chapter.%d'", chapter);
+            cairo_tag_begin(cr, CAIRO_TAG_DEST, attrs);
+            cairo_tag_end(cr, CAIRO_TAG_DEST);
+
+            snprintf(title, sizeof(title), "%d Chapter %d", chapter + 1, chapter + 1);
+            snprintf(link, sizeof(link), "dest='chapter.%d'", chapter);
+            int id = cairo_pdf_surface_add_outline(surface, CAIRO_PDF_OUTLINE_ROOT, title, link, 0);
+            snprintf(title, sizeof(title), "%d.1 Section", chapter + 1);
+            snprintf(link, sizeof(link), "page=%d pos=[0 %g]", page, ps.height / 2);
+            cairo_pdf_surface_add_outline(surface, id, title, link, 0);
+        }
+
+        // Landscape pages draw portrait content turned by 90 degrees.
+        double w = ps.width, h = ps.height;
+        cairo_save(cr);
+        if (ps.rotated)
+        {
+            cairo_translate(cr, ps.width, 0);
+            cairo_rotate(cr, M_PI / 2);
+            w = ps.height;
+            h = ps.width;
+        }
+
+        if (p->image_kb > 0)
+            draw_image(cr, p, w, h);
+        if (p->path_segments > 0)
+            draw_path(cr, p, w, h);
+        if (p->lines > 0)
+            draw_text(cr, p, w, h, page);
+        cairo_restore(cr);
+
+        if (p->links > 0)
+            draw_links(cr, p, ps.width, ps.height);
+
+        cairo_show_page(cr);
+        if (page % 100 == 0)
+            fprintf(stderr, "\r%d/%d pages", page, p->pages);
+    }
+
+    cairo_destroy(cr);
+    cairo_surface_finish(surface);
+    cairo_status_t status = cairo_surface_status(surface);
+    cairo_surface_destroy(surface);
+    if (p->pages >= 100)
+        fputc('\n', stderr);
+    if (status != CAIRO_STATUS_SUCCESS) {
+        fprintf(stderr, "Error: Writing %s: %s\n", file_name, cairo_status_to_string(status));
+        return 1;
+    }
+    return 0;
+}
+
+static int int_value(int argc, char **argv, int *i)
+{
+    if (*i + 1 >= argc) {
+        fprintf(stderr, "Error: %s needs a value.\n", argv[*i]);
+        exit(1);
+    }
+    char *end;
+    long v = strtol(argv[++*i], &end, 10);
+    if (*end || v < 0 || v > 100000000) {
+        fprintf(stderr, "Error: Bad value for %s: %s\n", argv[*i - 1], argv[*i]);
+        exit(1);
+    }
+    return (int)v;
+}
+
+int main(int argc, char **argv)
+{
+    Params p = {100, 50, 0, 0, 0, false, false, false, 1};
+    const char *out = NULL;
+
+    // A preset goes first; the options after it adjust it.
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--preset") == 0 && i + 1 < argc)
+        {
+            const char *name = argv[++i];
+            size_t n = 0;
+            while (n < sizeof(presets) / sizeof(*presets) && strcmp(presets[n].name, name) != 0)
+                ++n;
+            if (n == sizeof(presets) / sizeof(*presets)) {
+                fprintf(stderr, "Error: No preset %s.\n", name);
+                return 1;
+            }
+            p = presets[n].params;
+        }
+        else if (strcmp(argv[i], "--pages") == 0)
+            p.pages = int_value(argc, argv, &i);
+        else if (strcmp(argv[i], "--lines") == 0)
+            p.lines = int_value(argc, argv, &i);
+        else if (strcmp(argv[i], "--links") == 0)
+            p.links = int_value(argc, argv, &i);
+        else if (strcmp(argv[i], "--path-segments") == 0)
+            p.path_segments = int_value(argc, argv, &i);
+        else if (strcmp(argv[i], "--image-kb") == 0)
+            p.image_kb = int_value(argc, argv, &i);
+        else if (strcmp(argv[i], "--seed") == 0)
+            p.seed = int_value(argc, argv, &i);
+        else if (strcmp(argv[i], "--mixed-sizes") == 0)
+            p.mixed_sizes = true;
+        else if (strcmp(argv[i], "--outline") == 0)
+            p.outline = true;
+        else if (strcmp(argv[i], "--labels") == 0)
+            p.labels = true;
+        else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+            fputs(USAGE, stdout);
+            return 0;
+        }
+        else if (argv[i][0] != '-' && out == NULL)
+            out = argv[i];
+        else {
+            fputs(USAGE, stderr);
+            return 1;
+        }
+    }
+
+    if (out == NULL || p.pages < 1) {
+        fputs(USAGE, stderr);
+        return 1;
+    }
+    return generate(&p, out);
+}
@@ -0,0 +1,205 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poppler.h>
+#include "incsearch.h"
+
+// Search-as-you-type runs on its own thread against the text index.  Each
+// keystroke posts a new generation, which cancels the query in flight; the
+// worker waits until the query has been stable for delay_ms before it runs.
+// The pages matching the last completed query are kept, and a query that
+// extends it (same case mode) only re-checks those plus newly indexed pages.
+
+struct IncSearch {
+    TextIndex *ti;
+    int wake_fd;
+    int delay_ms;
+    GThread *thread;
+    GMutex lock;
+    GCond cond;
+    bool quit;
+
+    // Pending request, guarded by lock
+    unsigned generation;
+    char *query;
+    PopplerFindFlags flags;
+    int origin;
+    gint cancel;
+
+    // Last result, guarded by lock
+    bool has_result;
+    IncSearchResult result;
+
+    // Worker-only candidate cache
+    char *prev_query;
+    PopplerFindFlags prev_flags;
+    int *prev_pages;
+    int prev_count;
+    int prev_done;
+};
+
+static bool can_reuse(const IncSearch *is, const char *query, PopplerFindFlags flags)
+{
+    return is->prev_query != NULL &&
+        (is->prev_flags & POPPLER_FIND_CASE_SENSITIVE) == (flags & POPPLER_FIND_CASE_SENSITIVE) &&
+        strncmp(query, is->prev_query, strlen(is->prev_query)) == 0;
+}
+
+static void run_query(IncSearch *is, const char *query, PopplerFindFlags flags, int origin,
+    IncSearchResult *res)
+{
+    res->page = 0;
+    if (query[0] == '\0')
+        return;
+
+    bool reuse = can_reuse(is, query, flags);
+    int *pages, done;
+    int count = text_index_match_pages(is->ti, query, flags,
+        reuse ? is->prev_pages : NULL, reuse ? is->prev_count : 0,
+        reuse ? is->prev_done : 0, &done, &is->cancel, &pages);
+    if (count < 0)
+        return;
+
+    free(is->prev_query);
+    free(is->prev_pages);
+    is->prev_query = strdup(query);
+    is->prev_flags = flags;
+    is->prev_pages = pages;
+    is->prev_count = count;
+    is->prev_done = done;
+
+    // The first page in search order that also passes the whole-word check
+    bool backwards = flags & POPPLER_FIND_BACKWARDS;
+    int i = 0;
+    while (i < count && pages[i] < origin)
+        ++i;
+    if (backwards && (i == count || pages[i] > origin))
+        --i;
+    for (; i >= 0 && i < count && res->page == 0; i += backwards ? -1 : 1)
+        res->page = text_index_find(is->ti, query, flags, pages[i], pages[i], &res->rect);
+}
+
+static gpointer inc_search_thread(gpointer data)
+{
+    IncSearch *is = data;
+
+    g_mutex_lock(&is->lock);
+    unsigned handled = 0;
+    while (!is->quit)
+    {
+        if (is->generation == handled || is->query == NULL)
+        {
+            g_cond_wait(&is->cond, &is->lock);
+            continue;
+        }
+
+        // Debounce: restart the delay whenever a newer query arrives.
+        unsigned generation = is->generation;
+        gint64 end = g_get_monotonic_time() + (gint64)is->delay_ms * 1000;
+        while (!is->quit && is->generation == generation &&
+               g_cond_wait_until(&is->cond, &is->lock, end))
+            ;
+        if (is->quit || is->generation != generation)
+            continue;
+
+        char *query = strdup(is->query);
+        PopplerFindFlags flags = is->flags;
+        int origin = is->origin;
+        g_atomic_int_set(&is->cancel, 0);
+        g_mutex_unlock(&is->lock);
+
+        IncSearchResult res = {generation, 0, {0, 0, 0, 0}};
+        run_query(is, query, flags, origin, &res);
+        free(query);
+
+        g_mutex_lock(&is->lock);
+        handled = generation;
+        if (is->generation == generation)
+        {
+            is->result = res;
+            is->has_result = true;
+            // A full pipe already holds a pending wakeup.
+            char c = 1;
+            ssize_t r = write(is->wake_fd, &c, 1);
+            (void)r;
+        }
+    }
+    g_mutex_unlock(&is->lock);
+
+    return NULL;
+}
+
+IncSearch *inc_search_new(TextIndex *ti, int wake_fd, int delay_ms)
+{
+    if (ti == NULL)
+        return NULL;
+
+    IncSearch *is = calloc(1, sizeof(IncSearch));
+    is->ti = ti;
+    is->wake_fd = wake_fd;
+    is->delay_ms = delay_ms;
+    g_mutex_init(&is->lock);
+    g_cond_init(&is->cond);
+    is->thread = g_thread_new("inc-search", inc_search_thread, is);
+    return is;
+}
+
+void inc_search_free(IncSearch *is)
+{
+    if (is == NULL)
+        return;
+
+    g_mutex_lock(&is->lock);
+    is->quit = true;
+    g_atomic_int_set(&is->cancel, 1);
+    g_cond_signal(&is->cond);
+    g_mutex_unlock(&is->lock);
+    g_thread_join(is->thread);
+
+    g_mutex_clear(&is->lock);
+    g_cond_clear(&is->cond);
+    free(is->query);
+    free(is->prev_query);
+    free(is->prev_pages);
+    free(is);
+}
+
+// Posts a new query; its result is announced through the wake fd and
+// identified by the returned generation.
+unsigned inc_search_update(IncSearch *is, const char *query, PopplerFindFlags flags, int origin)
+{
+    g_mutex_lock(&is->lock);
+    free(is->query);
+    is->query = strdup(query);
+    is->flags = flags;
+    is->origin = origin;
+    is->has_result = false;
+    unsigned generation = ++is->generation;
+    g_atomic_int_set(&is->cancel, 1);
+    g_cond_signal(&is->cond);
+    g_mutex_unlock(&is->lock);
+    return generation;
+}
+
+void inc_search_cancel(IncSearch *is)
+{
+    g_mutex_lock(&is->lock);
+    ++is->generation;
+    free(is->query);
+    is->query = NULL;
+    is->has_result = false;
+    g_atomic_int_set(&is->cancel, 1);
+    g_mutex_unlock(&is->lock);
+}
+
+bool inc_search_get_result(IncSearch *is, IncSearchResult *result)
+{
+    g_mutex_lock(&is->lock);
+    bool has = is->has_result && is->result.generation == is->generation;
+    if (has)
+        *result = is->result;
+    is->has_result = false;
+    g_mutex_unlock(&is->lock);
+    return has;
+}
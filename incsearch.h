@@ -0,0 +1,22 @@
+#ifndef INCSEARCH_H
+#define INCSEARCH_H
+
+#include <stdbool.h>
+#include <poppler.h>
+#include "textindex.h"
+
+typedef struct IncSearch IncSearch;
+
+typedef struct {
+    unsigned generation;
+    int page;                 // 0 when nothing matched
+    PopplerRectangle rect;
+} IncSearchResult;
+
+IncSearch *inc_search_new(TextIndex *ti, int wake_fd, int delay_ms);
+void inc_search_free(IncSearch *is);
+unsigned inc_search_update(IncSearch *is, const char *query, PopplerFindFlags flags, int origin);
+void inc_search_cancel(IncSearch *is);
+bool inc_search_get_result(IncSearch *is, IncSearchResult *result);
+
+#endif // INCSEARCH_H
@@ -0,0 +1,220 @@
+#include <stdlib.h>
+#include <string.h>
+#include <poppler.h>
+#include "linkmap.h"
+
+// A page's links are fetched once, their actions resolved up front and
+// bucketed into a uniform grid over the page, so a hit test only looks at
+// the few links overlapping one cell.  Named destinations are resolved
+// through the structure index only; until it is ready, or for a name it
+// lacks, the link keeps the name (LINK_DEST) and link_find_dest() looks up
+// just that one when it is clicked.
+
+#define GRID 16
+
+struct LinkMap {
+    int page_num;
+    Link *links;
+    int nlinks;
+    double cell_w, cell_h;
+    int cell_start[GRID * GRID + 1];  // links of cell c: cell_links[cell_start[c] .. cell_start[c+1])
+    int *cell_links;
+};
+
+static void resolve_dest(PopplerDocument *doc, const PopplerDest *dest, Link *link)
+{
+    link->kind = LINK_PAGE;
+    link->page = dest->page_num;
+    link->top = -1;
+    if (!dest->change_top && dest->type != POPPLER_DEST_FITR)
+        return;
+
+    PopplerPage *page = poppler_document_get_page(doc, dest->page_num - 1);
+    if (page)
+    {
+        double width, height;
+        poppler_page_get_size(page, &width, &height);
+        link->top = doc_dest_top(dest, height);
+        g_object_unref(page);
+    }
+}
+
+static void resolve_action(PopplerDocument *doc, const DocIndex *di, const PopplerAction *action,
+    Link *link)
+{
+    link->kind = LINK_NONE;
+    if (action == NULL)
+        return;
+
+    switch (action->type)
+    {
+        case POPPLER_ACTION_GOTO_DEST: {
+            PopplerDest *dest = action->goto_dest.dest;
+            if (dest == NULL)
+                break;
+            if (dest->type != POPPLER_DEST_NAMED)
+                resolve_dest(doc, dest, link);
+            else if (dest->named_dest &&
+                doc_index_find_dest(di, dest->named_dest, &link->page, &link->top))
+                link->kind = LINK_PAGE;
+            else if (dest->named_dest)
+            {
+                link->kind = LINK_DEST;
+                link->target = strdup(dest->named_dest);
+            }
+            break;
+        }
+        case POPPLER_ACTION_URI:
+            if (action->uri.uri)
+            {
+                link->kind = LINK_URI;
+                link->target = strdup(action->uri.uri);
+            }
+            break;
+        case POPPLER_ACTION_GOTO_REMOTE:
+            if (action->goto_remote.file_name)
+            {
+                link->kind = LINK_REMOTE;
+                link->target = strdup(action->goto_remote.file_name);
+            }
+            break;
+        case POPPLER_ACTION_NAMED:
+            if (action->named.named_dest)
+            {
+                link->kind = LINK_NAMED;
+                link->target = strdup(action->named.named_dest);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void get_cell_range(const LinkMap *lm, const PopplerRectangle *a,
+    int *cx0, int *cy0, int *cx1, int *cy1)
+{
+    *cx0 = a->x1 / lm->cell_w;
+    *cy0 = a->y1 / lm->cell_h;
+    *cx1 = a->x2 / lm->cell_w;
+    *cy1 = a->y2 / lm->cell_h;
+    *cx0 = *cx0 < 0 ? 0 : (*cx0 >= GRID ? GRID - 1 : *cx0);
+    *cy0 = *cy0 < 0 ? 0 : (*cy0 >= GRID ? GRID - 1 : *cy0);
+    *cx1 = *cx1 < 0 ? 0 : (*cx1 >= GRID ? GRID - 1 : *cx1);
+    *cy1 = *cy1 < 0 ? 0 : (*cy1 >= GRID ? GRID - 1 : *cy1);
+}
+
+LinkMap *link_map_new(PopplerDocument *doc, const DocIndex *di, PopplerPage *page, int page_num)
+{
+    LinkMap *lm = calloc(1, sizeof(LinkMap));
+    lm->page_num = page_num;
+
+    double width, height;
+    poppler_page_get_size(page, &width, &height);
+    lm->cell_w = (width > 0 ? width : 1) / GRID;
+    lm->cell_h = (height > 0 ? height : 1) / GRID;
+
+    GList *mapping = poppler_page_get_link_mapping(page);
+    lm->links = malloc((g_list_length(mapping) + 1) * sizeof(Link));
+    for (GList *l = mapping; l != NULL; l = l->next)
+    {
+        PopplerLinkMapping *m = l->data;
+        Link link = {m->area, LINK_NONE, 0, -1, NULL};
+        if (link.area.x1 > link.area.x2)
+        {
+            double t = link.area.x1; link.area.x1 = link.area.x2; link.area.x2 = t;
+        }
+        if (link.area.y1 > link.area.y2)
+        {
+            double t = link.area.y1; link.area.y1 = link.area.y2; link.area.y2 = t;
+        }
+        resolve_action(doc, di, m->action, &link);
+        if (link.kind != LINK_NONE)
+            lm->links[lm->nlinks++] = link;
+    }
+    poppler_page_free_link_mapping(mapping);
+
+    // Counting pass, prefix sums, then a filling pass.
+    int counts[GRID * GRID] = {0};
+    for (int i = 0; i < lm->nlinks; ++i)
+    {
+        int cx0, cy0, cx1, cy1;
+        get_cell_range(lm, &lm->links[i].area, &cx0, &cy0, &cx1, &cy1);
+        for (int cy = cy0; cy <= cy1; ++cy)
+            for (int cx = cx0; cx <= cx1; ++cx)
+                ++counts[cy * GRID + cx];
+    }
+
+    lm->cell_start[0] = 0;
+    for (int c = 0; c < GRID * GRID; ++c)
+        lm->cell_start[c + 1] = lm->cell_start[c] + counts[c];
+
+    lm->cell_links = malloc((lm->cell_start[GRID * GRID] + 1) * sizeof(int));
+    memset(counts, 0, sizeof(counts));
+    for (int i = 0; i < lm->nlinks; ++i)
+    {
+        int cx0, cy0, cx1, cy1;
+        get_cell_range(lm, &lm->links[i].area, &cx0, &cy0, &cx1, &cy1);
+        for (int cy = cy0; cy <= cy1; ++cy)
+            for (int cx = cx0; cx <= cx1; ++cx)
+            {
+                int c = cy * GRID + cx;
+                lm->cell_links[lm->cell_start[c] + counts[c]++] = i;
+            }
+    }
+
+    return lm;
+}
+
+void link_map_free(LinkMap *lm)
+{
+    if (lm == NULL)
+        return;
+
+    for (int i = 0; i < lm->nlinks; ++i)
+        free(lm->links[i].target);
+    free(lm->links);
+    free(lm->cell_links);
+    free(lm);
+}
+
+int link_map_page(const LinkMap *lm)
+{
+    return lm->page_num;
+}
+
+// The first link in document order containing (x, y), in PDF coordinates.
+const Link *link_map_at(const LinkMap *lm, double x, double y)
+{
+    if (x < 0 || y < 0)
+        return NULL;
+
+    // Links reaching past the page edge are bucketed into the edge cells.
+    int cx = x / lm->cell_w, cy = y / lm->cell_h;
+    cx = cx >= GRID ? GRID - 1 : cx;
+    cy = cy >= GRID ? GRID - 1 : cy;
+
+    int c = cy * GRID + cx;
+    for (int i = lm->cell_start[c]; i < lm->cell_start[c + 1]; ++i)
+    {
+        const Link *link = &lm->links[lm->cell_links[i]];
+        if (x >= link->area.x1 && x <= link->area.x2 &&
+            y >= link->area.y1 && y <= link->area.y2)
+            return link;
+    }
+    return NULL;
+}
+
+// Resolves the named destination of a LINK_DEST link.
+bool link_find_dest(PopplerDocument *doc, const char *name, int *page, double *top)
+{
+    PopplerDest *dest = poppler_document_find_dest(doc, name);
+    if (dest == NULL)
+        return false;
+
+    Link link = {.top = -1};
+    resolve_dest(doc, dest, &link);
+    poppler_dest_free(dest);
+    *page = link.page;
+    *top = link.top;
+    return true;
+}
@@ -0,0 +1,28 @@
+#ifndef LINKMAP_H
+#define LINKMAP_H
+
+#include <poppler.h>
+#include "docindex.h"
+
+typedef enum {
+    LINK_NONE, LINK_PAGE, LINK_DEST, LINK_URI, LINK_REMOTE, LINK_NAMED
+} LinkKind;
+
+typedef struct {
+    PopplerRectangle area;   // PDF coordinates, bottom-left origin
+    LinkKind kind;
+    int page;                // LINK_PAGE: 1-based destination page
+    double top;              // LINK_PAGE: points below the top of that page, -1 if unspecified
+    char *target;            // LINK_DEST: destination name, LINK_URI: uri,
+                             // LINK_REMOTE: file, LINK_NAMED: action name
+} Link;
+
+typedef struct LinkMap LinkMap;
+
+LinkMap *link_map_new(PopplerDocument *doc, const DocIndex *di, PopplerPage *page, int page_num);
+void link_map_free(LinkMap *lm);
+int link_map_page(const LinkMap *lm);
+const Link *link_map_at(const LinkMap *lm, double x, double y);
+bool link_find_dest(PopplerDocument *doc, const char *name, int *page, double *top);
+
+#endif // LINKMAP_H
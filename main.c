@@ -1,4 +1,5 @@
 #include <ctype.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <locale.h>
 #include <stdbool.h>
@@ -7,8 +8,14 @@
 #include <string.h>
 #include <wchar.h>
 #include <math.h>
+#include <signal.h>
+#include <spawn.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include <X11/Xatom.h>
+#include <X11/cursorfont.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/keysym.h>
@@ -18,16 +25,63 @@
 
 #include <poppler.h>
 
+#include "arena.h"
 #include "coordconv.h"
+#include "diskcache.h"
+#include "docindex.h"
+#include "docload.h"
+#include "filewatch.h"
+#include "incsearch.h"
+#include "linkmap.h"
+#include "matchtable.h"
+#include "pagescan.h"
+#include "recolor.h"
 #include "rectangle.h"
+#include "selection.h"
+#include "server.h"
+#include "textindex.h"
+#include "textdump.h"
+#include "textlayout.h"
+#include "thumbs.h"
 
 #define AnyMask   UINT_MAX
 #define EmptyMask 0
 
+#define LINK_CACHE_SIZE 8
+
+extern char **environ;
+
 typedef struct {
     int page, offset;
 } PageAndOffset;
 
+typedef struct {
+    Rectangle *rects;
+    int size;
+    int capacity;
+} SelectionRects;
+
+typedef struct {
+    double dpi;
+    Rectangle pos;
+    Rectangle crop;
+} PdfRenderConf;
+
+// How the image on screen was rendered.  A reload draws the new document
+// the same way on its loader thread and keeps the render when both images
+// hash alike.
+typedef struct {
+    int page_num;           // 0 when nothing is on screen
+    PdfRenderConf prc;
+    bool two_page_view;
+    int rotation;
+    bool dark_mode;
+    guint64 print;          // hash of the image
+    guint64 new_print;      // of the reloaded document's, 0 if not drawn
+    bool whole_page;        // a single page as the disk cache keeps them
+    cairo_surface_t *new_image;  // the reloaded document's render, or NULL
+} RenderPrint;
+
 typedef struct {
     PopplerDocument *doc;
     PopplerPage *page;
@@ -45,16 +99,32 @@ typedef struct {
     Rectangle main_pos;
     Pixmap pdf;
     Rectangle pdf_pos;
+    RenderPrint shown;      // what pdf was rendered from
+    RenderPrint reload_check;   // the same, handed to the reload in progress
+
+    LinkMap *links[LINK_CACHE_SIZE];
+    int links_next;
+    char *confirm_link;     // external link target waiting for a second click
+    Cursor link_cursor;
+    bool link_hover;
 
     GC selection_gc;
+    GC match_gc;
     Rectangle selection;
     Rectangle pdf_selection;
     bool selecting;
+    Rectangle pdf_crop;     // area of the rotated page shown at pdf_pos, in pixels
+    double pdf_scale;       // pixels per PDF point
+    TextLayout *layout;
+    SelectionRects sel_rects;       // glyph selection, one screen box per line
+    SelectionRects prev_sel_rects;  // scratch for the previous highlight
+    int sel_first, sel_last;
 
-    char *primary;
-    char *clipboard;
+    Selection *sel;         // PRIMARY and CLIPBOARD we own
+    TextCopy *text_copy;    // whole page or document copy in progress
 
     GC status_gc;
+    XFontStruct *status_font;   // loaded on first use
     GC text_gc;
     XFontSet fset;
     int fheight;
@@ -67,8 +137,35 @@ typedef struct {
 
     double left, top, right, bottom;
     bool searching;
+    TextIndex *index;
+    DocIndex *structure;    // outline, named destinations and page labels
+    bool structure_shown;   // the status bar has been redrawn with its labels
+    int outline_pos;        // entry the outline prompt jumped to, -1 for none
+    bool index_dropped;     // given up for the memory budget, rebuilt on use
+    gint64 index_restored;  // when it was last rebuilt, see index_pinned()
+    PageScanner *scanner;   // the session's, shared by all windows
+    IncSearch *inc_search;
+    MatchTable *matches;
+    int search_origin;
+    int wake_pipe[2];
+    DocLoader *loader;      // reload in progress
+    bool reload_pending;    // the file changed again during it
+    FileWatch *watch;
+    DiskCache *disk_cache;  // rendered pages kept across runs
+    bool large_file;        // bounded-memory mode, see scan_pages_for_text()
+    off_t file_size;        // what the document counts in the memory budget
+    gint64 start_time;      // for --startup-stats, 0 when not reporting
+    bool first_paint_done;  // the first page is on screen, background work may start
+    bool keep_pdf_pos;      // next render keeps the scroll position
+    bool reload_render;     // a control batch left its render to the reload
+    bool overview;          // thumbnail grid shown instead of the page
+    ThumbCache *thumbs;
+    int overview_y;         // scroll offset of the grid
+    int overview_page;      // page shown when the overview was opened
 
     bool xembed_init;
+    bool mapped;            // hidden windows give up their caches first
+    gint64 last_used;       // last input, for the memory budget
 
     bool magnifying;
     Rectangle magnify;
@@ -89,14 +186,12 @@ typedef struct {
 #include "config.h"
 
 typedef struct {
-    Display *display;
     Window main;
     GC selection;
+    GC match;
     GC status;
+    Cursor link_cursor;
     GC text;
-    XFontSet fset;
-    int fheight;
-    int fbase;
 } SetupXRet;
 
 static void draw_status_bar(AppState *st);
@@ -106,15 +201,52 @@ static bool print_error(const char *m) {
     return false;
 }
 
-static SetupXRet setup_x(unsigned width, unsigned height, const char *file_name,
-    Window root)
+// The display and the font set, shared by all windows of the process.
+typedef struct {
+    Display *display;
+    XFontSet fset;
+    int fheight;
+    int fbase;
+} XConn;
+
+static XConn open_display(void)
 {
     Display *display = XOpenDisplay(NULL);
     if (!display) {
         print_error("Cannot open X display.");
-        return (SetupXRet){0};
+        return (XConn){0};
+    }
+
+    char **missing;
+    int nmissing;
+    char *def_string;
+    XFontSet fset = XCreateFontSet(display, font, &missing, &nmissing, &def_string);
+    if (!fset) {
+        print_error("Cannot create font set.");
+        XCloseDisplay(display);
+        return (XConn){0};
     }
 
+    XFreeStringList(missing);
+
+    XFontSetExtents *fset_extents = XExtentsOfFontSet(fset);
+    return (XConn){
+        .display = display,
+        .fset = fset,
+        .fheight = fset_extents->max_logical_extent.height,
+        .fbase = -fset_extents->max_logical_extent.y
+    };
+}
+
+static void close_display(const XConn *xc)
+{
+    XFreeFontSet(xc->display, xc->fset);
+    XCloseDisplay(xc->display);
+}
+
+static SetupXRet setup_x(Display *display, unsigned width, unsigned height,
+    const char *file_name, Window root)
+{
     XColor sc, ec;
     XAllocNamedColor(display, DefaultColormap(display, DefaultScreen(display)),
         bg_color, &sc, &ec);
@@ -145,6 +277,7 @@ static SetupXRet setup_x(unsigned width, unsigned height, const char *file_name,
     XGCValues gcvals;
     gcvals.function = GXinvert;
     GC gc = XCreateGC(display, main, GCFunction, &gcvals);
+    GC match_gc = XCreateGC(display, main, GCFunction, &gcvals);
 
     XSelectInput(display, main,
         ExposureMask | KeyPressMask | ButtonPressMask | ButtonReleaseMask |
@@ -152,21 +285,6 @@ static SetupXRet setup_x(unsigned width, unsigned height, const char *file_name,
 
     XMapWindow(display, main);
 
-    char **missing;
-    int nmissing;
-    char *def_string;
-    XFontSet fset = XCreateFontSet(display, font, &missing, &nmissing, &def_string);
-    if (!fset) {
-        print_error("Cannot create font set.");
-        return (SetupXRet){0};
-    }
-
-    XFreeStringList(missing);
-
-    XFontSetExtents *fset_extents = XExtentsOfFontSet(fset);
-    int fheight = fset_extents->max_logical_extent.height;
-    int fbase = -fset_extents->max_logical_extent.y;
-
     XGCValues text_gcvals;
     text_gcvals.foreground = WhitePixel(display, DefaultScreen(display));
     GC text_gc = XCreateGC(display, main, GCForeground, &text_gcvals);
@@ -177,33 +295,30 @@ static SetupXRet setup_x(unsigned width, unsigned height, const char *file_name,
     GC status_gc = XCreateGC(display, main, GCForeground | GCBackground, &status_gcvals);
 
     return (SetupXRet){
-        .display = display,
         .main = main,
         .selection = gc,
+        .match = match_gc,
+        .link_cursor = XCreateFontCursor(display, XC_hand2),
         .status = status_gc,
-        .text = text_gc,
-        .fset = fset,
-        .fheight = fheight,
-        .fbase = fbase
+        .text = text_gc
     };
 }
 
+// Frees the window and its resources; the display stays open.
 static void cleanup_x(const AppState *st)
 {
-    if (st->fset != NULL)
-        XFreeFontSet(st->display, st->fset);
     if (st->pdf != None)
         XFreePixmap(st->display, st->pdf);
-    if (st->display != NULL)
-        XCloseDisplay(st->display);
+    XFreeGC(st->display, st->selection_gc);
+    XFreeGC(st->display, st->match_gc);
+    XFreeGC(st->display, st->status_gc);
+    XFreeGC(st->display, st->text_gc);
+    XFreeCursor(st->display, st->link_cursor);
+    if (st->status_font)
+        XFreeFont(st->display, st->status_font);
+    XDestroyWindow(st->display, st->main);
 }
 
-typedef struct {
-    double dpi;
-    Rectangle pos;
-    Rectangle crop;
-} PdfRenderConf;
-
 static PdfRenderConf get_pdf_render_conf(bool fit_page, bool scrolling_up, int offset,
     Rectangle p, PopplerPage *page, bool magnifying, Rectangle m, int rotation, double zoom_level)
 {
@@ -218,10 +333,14 @@ static PdfRenderConf get_pdf_render_conf(bool fit_page, bool scrolling_up, int o
 
     double x0 = 0, y0 = 0;
     if (magnifying) {
-        x0 = m.x;
-        y0 = m.y;
-        width = m.width;
-        height = m.height;
+        // The magnified area is in page points; crop the rotated page.
+        Rectangle origin = {0, 0, 0, 0};
+        CoordConv cc = coord_conv_create(page, &origin, &origin, 1.0, false, rotation);
+        Rectangle rm = coord_conv_to_screen(&cc, &m);
+        x0 = rm.x;
+        y0 = rm.y;
+        width = rm.width;
+        height = rm.height;
     }
 
     int x, y, w, h;
@@ -278,95 +397,185 @@ static PdfRenderConf get_pdf_render_conf(bool fit_page, bool scrolling_up, int o
 #include <poppler.h>
 #include "config.h"
 
-static Pixmap render_pdf_page_to_pixmap(AppState *st, const PdfRenderConf *prc)
+// Appends the device-space bounding boxes of the images on page, as drawn
+// with the current transformation of cr, to keep.
+static int collect_image_rects(cairo_t *cr, PopplerPage *page, Rectangle *keep, int nkeep, int max)
 {
-    Pixmap pixmap = XCreatePixmap(st->display, st->main, prc->pos.width, prc->pos.height,
-                                  DefaultDepth(st->display, DefaultScreen(st->display)));
-
-    cairo_surface_t *surface = cairo_xlib_surface_create(st->display, pixmap,
-                                                         DefaultVisual(st->display, DefaultScreen(st->display)),
-                                                         prc->pos.width, prc->pos.height);
-    cairo_t *cr = cairo_create(surface);
+    GList *images = poppler_page_get_image_mapping(page);
 
-    // Set background color based on dark mode
-    if (st->dark_mode) {
-        // Parse the hex color string to RGB values
-        int r, g, b;
-        sscanf(page_bg_color_dark + 1, "%02x%02x%02x", &r, &g, &b);
-        cairo_set_source_rgb(cr, r / 255.0, g / 255.0, b / 255.0);
-    } else {
-        cairo_set_source_rgb(cr, 1, 1, 1);  // White background for light mode
+    for (GList *l = images; l != NULL && nkeep < max; l = l->next)
+    {
+        PopplerImageMapping *im = (PopplerImageMapping *)l->data;
+        double xs[4] = {im->area.x1, im->area.x2, im->area.x1, im->area.x2};
+        double ys[4] = {im->area.y1, im->area.y1, im->area.y2, im->area.y2};
+        double x0 = INFINITY, y0 = INFINITY, x1 = -INFINITY, y1 = -INFINITY;
+        for (int i = 0; i < 4; ++i)
+        {
+            cairo_user_to_device(cr, &xs[i], &ys[i]);
+            x0 = fmin(x0, xs[i]);
+            y0 = fmin(y0, ys[i]);
+            x1 = fmax(x1, xs[i]);
+            y1 = fmax(y1, ys[i]);
+        }
+        keep[nkeep++] = (Rectangle){(int)floor(x0), (int)floor(y0),
+            (int)ceil(x1 - x0), (int)ceil(y1 - y0)};
     }
-    cairo_paint(cr);
 
-    cairo_save(cr);
+    poppler_page_free_image_mapping(images);
+    return nkeep;
+}
+
+// Renders the page(s) client side, so dark mode can recolor the buffer in one
+// pass before it is uploaded to the server.
+static cairo_surface_t *render_pdf_page_to_image(AppState *st, const PdfRenderConf *prc)
+{
+    cairo_surface_t *image = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
+                                                        prc->pos.width, prc->pos.height);
+    cairo_t *cr = cairo_create(image);
 
-    // Apply zoom and rotation
-    cairo_translate(cr, prc->pos.width / 2.0, prc->pos.height / 2.0);
-    cairo_rotate(cr, st->rotation * M_PI / 180.0);
-    cairo_scale(cr, st->zoom_level, st->zoom_level);
-    cairo_translate(cr, -prc->pos.width / 2.0, -prc->pos.height / 2.0);
+    cairo_set_source_rgb(cr, 1, 1, 1);
+    cairo_paint(cr);
 
-    // Calculate the scale factor
-    double page_width, page_height;
-    poppler_page_get_size(st->page, &page_width, &page_height);
-    double scale_x = prc->pos.width / page_width;
-    double scale_y = prc->pos.height / page_height;
-    double scale = (scale_x < scale_y) ? scale_x : scale_y;
+    bool keep_images = st->dark_mode && !dark_mode_recolor_images;
+    Rectangle keep[64];
+    int nkeep = 0;
 
-    // Apply the scale
-    cairo_scale(cr, scale, scale);
+    // Draw through the same page-to-pixel transform CoordConv uses, so
+    // selection, links and search highlights line up at any rotation.
+    Rectangle origin = {0, 0, prc->pos.width, prc->pos.height};
+    CoordConv cc = coord_conv_create(st->page, &origin, &prc->crop, prc->dpi / 72.0,
+        false, st->rotation);
+    cairo_matrix_t m;
+    cairo_matrix_init(&m, cc.to_screen.xx, cc.to_screen.yx, cc.to_screen.xy, cc.to_screen.yy,
+        cc.to_screen.x0, cc.to_screen.y0);
 
-    // Render the PDF page
+    cairo_save(cr);
+    cairo_transform(cr, &m);
     poppler_page_render(st->page, cr);
-
+    if (keep_images)
+        nkeep = collect_image_rects(cr, st->page, keep, nkeep, 64);
     cairo_restore(cr);
 
-    // Apply color inversion for dark mode
-    if (st->dark_mode) {
-        cairo_set_operator(cr, CAIRO_OPERATOR_DIFFERENCE);
-        cairo_set_source_rgb(cr, 1, 1, 1);
-        cairo_paint(cr);
-    }
-
     // Render the second page if in two-page view mode
     if (st->two_page_view && st->second_page) {
-        cairo_save(cr);
+        cc = coord_conv_create(st->second_page, &origin, &prc->crop, prc->dpi / 72.0,
+            false, st->rotation);
+        cairo_matrix_init(&m, cc.to_screen.xx, cc.to_screen.yx, cc.to_screen.xy, cc.to_screen.yy,
+            cc.to_screen.x0, cc.to_screen.y0);
 
-        // Calculate the position for the second page
-        double second_page_x = prc->pos.width / 2.0;
-        cairo_translate(cr, second_page_x, 0);
+        cairo_save(cr);
+        cairo_translate(cr, prc->pos.width / 2.0, 0);
+        cairo_transform(cr, &m);
+        poppler_page_render(st->second_page, cr);
+        if (keep_images)
+            nkeep = collect_image_rects(cr, st->second_page, keep, nkeep, 64);
+        cairo_restore(cr);
+    }
 
-        // Apply zoom and rotation for the second page
-        cairo_translate(cr, prc->pos.width / 4.0, prc->pos.height / 2.0);
-        cairo_rotate(cr, st->rotation * M_PI / 180.0);
-        cairo_scale(cr, st->zoom_level, st->zoom_level);
-        cairo_translate(cr, -prc->pos.width / 4.0, -prc->pos.height / 2.0);
+    cairo_destroy(cr);
+    cairo_surface_flush(image);
 
-        // Apply the scale for the second page
-        cairo_scale(cr, scale, scale);
+    // Recolor both pages at once for dark mode
+    if (st->dark_mode) {
+        RecolorPalette palette;
+        if (recolor_parse_palette(&palette, page_fg_color_dark, page_bg_color_dark)) {
+            recolor_image(cairo_image_surface_get_data(image),
+                cairo_image_surface_get_width(image), cairo_image_surface_get_height(image),
+                cairo_image_surface_get_stride(image), &palette, keep, nkeep);
+            cairo_surface_mark_dirty(image);
+        } else {
+            print_error("Invalid dark mode page colors.");
+        }
+    }
 
-        // Render the second PDF page
-        poppler_page_render(st->second_page, cr);
+    return image;
+}
 
-        cairo_restore(cr);
+// Hashes the pixels of image, a word at a time.
+static guint64 image_print(cairo_surface_t *image)
+{
+    int width = cairo_image_surface_get_width(image);
+    int height = cairo_image_surface_get_height(image);
+    int stride = cairo_image_surface_get_stride(image);
+    const unsigned char *data = cairo_image_surface_get_data(image);
 
-        // Apply color inversion for dark mode on the second page
-        if (st->dark_mode) {
-            cairo_rectangle(cr, second_page_x, 0, prc->pos.width / 2.0, prc->pos.height);
-            cairo_set_operator(cr, CAIRO_OPERATOR_DIFFERENCE);
-            cairo_set_source_rgb(cr, 1, 1, 1);
-            cairo_fill(cr);
+    guint64 h = 14695981039346656037ULL ^ ((guint64)width << 32 | (guint32)height);
+    for (int y = 0; y < height; ++y)
+    {
+        const unsigned char *row = data + (size_t)y * stride;
+        for (int x = 0; x + 1 < width; x += 2)
+        {
+            guint64 v;
+            memcpy(&v, row + 4 * x, sizeof(v));
+            h = (h ^ v) * 1099511628211ULL;
         }
+        if (width % 2)
+        {
+            guint32 v;
+            memcpy(&v, row + 4 * (width - 1), sizeof(v));
+            h = (h ^ v) * 1099511628211ULL;
+        }
+    }
+    return h;
+}
+
+// Identifies the look of a rendering for the disk cache: 0 for the light
+// theme, else a hash of the dark mode settings.
+static uint32_t theme_key(const AppState *st)
+{
+    if (!st->dark_mode)
+        return 0;
+    char theme[64];
+    snprintf(theme, sizeof(theme), "%s/%s/%d", page_fg_color_dark, page_bg_color_dark,
+        dark_mode_recolor_images);
+    return g_str_hash(theme) | 1;
+}
+
+static Pixmap render_pdf_page_to_pixmap(AppState *st, const PdfRenderConf *prc)
+{
+    // Whole single pages are looked up in the disk cache before poppler
+    // renders them, and stored there after.
+    bool whole_page = !st->magnifying && !(st->two_page_view && st->second_page);
+    bool cacheable = st->disk_cache && whole_page;
+    DiskCacheKey key = {st->page_num, (int)lround(prc->dpi), st->rotation, theme_key(st)};
+
+    cairo_surface_t *image = cacheable
+        ? disk_cache_load(st->disk_cache, &key, prc->pos.width, prc->pos.height) : NULL;
+    if (image == NULL)
+    {
+        image = render_pdf_page_to_image(st, prc);
+        if (cacheable)
+            disk_cache_store(st->disk_cache, &key, image);
     }
+    st->shown = (RenderPrint){st->page_num, *prc, st->two_page_view && st->second_page,
+        st->rotation, st->dark_mode, image_print(image), 0, whole_page, NULL};
+
+    Pixmap pixmap = XCreatePixmap(st->display, st->main, prc->pos.width, prc->pos.height,
+                                  DefaultDepth(st->display, DefaultScreen(st->display)));
+
+    cairo_surface_t *surface = cairo_xlib_surface_create(st->display, pixmap,
+                                                         DefaultVisual(st->display, DefaultScreen(st->display)),
+                                                         prc->pos.width, prc->pos.height);
+    cairo_t *cr = cairo_create(surface);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_surface(cr, image, 0, 0);
+    cairo_paint(cr);
 
     cairo_destroy(cr);
     cairo_surface_destroy(surface);
+    cairo_surface_destroy(image);
 
     return pixmap;
 }
 
-static void copy_pixmap_on_expose_event(const AppState *st, const Rectangle *prev,
+// Conversion between page points and the screen for the page as drawn.
+static CoordConv page_coord_conv(const AppState *st, bool inverty)
+{
+    return coord_conv_create(st->page, &st->pdf_pos, &st->pdf_crop, st->pdf_scale,
+        inverty, st->rotation);
+}
+
+static void copy_pixmap_on_expose_event(AppState *st, const Rectangle *prev,
     const XExposeEvent *e)
 {
     if (st->pdf == None)
@@ -380,36 +589,56 @@ static void copy_pixmap_on_expose_event(const AppState *st, const Rectangle *pre
             st->pdf_pos.x, st->pdf_pos.y, st->pdf_pos.width, st->pdf_pos.height, False);
     }
 
-    Rectangle intersect_rect = rectangle_intersect(&(Rectangle){e->x, e->y, e->width, e->height}, &st->status_pos);
-    if (rectangle_is_invalid(&intersect_rect))
+    // Copy the exposed area around the status bar, which draws itself.
+    RectRegion damage;
+    region_init_rect(&damage, &(Rectangle){e->x, e->y, e->width, e->height});
+    if (st->show_status_bar)
+        region_subtract_rect(&damage, &st->status_pos);
+
+    for (int i = 0; i < damage.size; ++i)
     {
+        const Rectangle *r = &damage.rects[i];
         XCopyArea(st->display, st->pdf, st->main, DefaultGC(st->display, DefaultScreen(st->display)),
-            e->x - st->pdf_pos.x, e->y - st->pdf_pos.y,
-            e->width, e->height, e->x, e->y);
+            r->x - st->pdf_pos.x, r->y - st->pdf_pos.y,
+            r->width, r->height, r->x, r->y);
     }
-    else
-    {
-        Rectangle top = {e->x, e->y, e->width, intersect_rect.y - e->y};
-        Rectangle bottom = {e->x, intersect_rect.y + intersect_rect.height,
-            e->width, (e->y + e->height) - (intersect_rect.y + intersect_rect.height)};
 
-        if (!rectangle_is_invalid(&top))
-            XCopyArea(st->display, st->pdf, st->main, DefaultGC(st->display, DefaultScreen(st->display)),
-                top.x - st->pdf_pos.x, top.y - st->pdf_pos.y,
-                top.width, top.height, top.x, top.y);
+    // Inverting drawing is clipped to the exposed area, so parts outside it
+    // aren't inverted twice.
+    XRectangle clip = {e->x, e->y, e->width, e->height};
+    XSetClipRectangles(st->display, st->selection_gc, 0, 0, &clip, 1, Unsorted);
 
-        if (!rectangle_is_invalid(&bottom))
-            XCopyArea(st->display, st->pdf, st->main, DefaultGC(st->display, DefaultScreen(st->display)),
-                bottom.x - st->pdf_pos.x, bottom.y - st->pdf_pos.y,
-                bottom.width, bottom.height, bottom.x, bottom.y);
+    if (st->sel_rects.size > 0)
+    {
+        for (int i = 0; i < st->sel_rects.size; ++i)
+            XFillRectangle(st->display, st->main, st->selection_gc,
+                st->sel_rects.rects[i].x, st->sel_rects.rects[i].y,
+                st->sel_rects.rects[i].width, st->sel_rects.rects[i].height);
     }
-
-    if (st->selection.width > 0 && st->selection.height > 0)
+    else if (st->selection.width > 0 && st->selection.height > 0)
     {
         XFillRectangle(st->display, st->main, st->selection_gc,
             st->selection.x, st->selection.y,
             st->selection.width, st->selection.height);
     }
+
+    // Outline the other matches of the last search on this page.
+    if (st->matches)
+    {
+        int n;
+        CoordConv cc = page_coord_conv(st, false);
+        const Rectangle *rects = match_table_screen_rects(st->matches, st->page_num, st->page,
+            st->index, &cc, &n);
+
+        XSetClipRectangles(st->display, st->match_gc, 0, 0, &clip, 1, Unsorted);
+        for (int i = 0; i < n; ++i)
+        {
+            if (st->matches->current_page == st->page_num && st->matches->current == i)
+                continue;
+            XDrawRectangle(st->display, st->main, st->match_gc,
+                rects[i].x - 1, rects[i].y - 1, rects[i].width + 1, rects[i].height + 1);
+        }
+    }
 }
 
 static void force_render_page(AppState *st, bool clear)
@@ -425,6 +654,7 @@ static void force_render_page(AppState *st, bool clear)
 
     XEvent e;
     e.type = ConfigureNotify;
+    e.xconfigure.event = e.xconfigure.window = st->main;
     e.xconfigure.x = attrs.x;
     e.xconfigure.y = attrs.y;
     e.xconfigure.width  = attrs.width;
@@ -432,6 +662,8 @@ static void force_render_page(AppState *st, bool clear)
     XSendEvent(st->display, st->main, False, StructureNotifyMask, &e);
 
     e.type = Expose;
+    e.xexpose.window = st->main;
+    e.xexpose.count = 0;
     e.xexpose.x = 0;
     e.xexpose.y = 0;
     e.xexpose.width  = attrs.width;
@@ -460,6 +692,8 @@ static void send_expose(const AppState *st, const Rectangle *r)
 {
     XEvent e;
     e.type = Expose;
+    e.xexpose.window = st->main;
+    e.xexpose.count = 0;
     e.xexpose.x = r->x;
     e.xexpose.y = r->y;
     e.xexpose.width  = r->width;
@@ -480,103 +714,258 @@ static int get_pdf_scroll_diff(const AppState *st, double percent)
         sc : -(st->pdf_pos.height - st->main_pos.height + st->pdf_pos.y);
 }
 
-static bool find_page_link(AppState *st, const XButtonEvent *e)
+static LinkMap *get_link_map(AppState *st)
 {
-    GList *link_mapping = poppler_page_get_link_mapping(st->page);
-    if (link_mapping == NULL)
-        return false;
+    for (int i = 0; i < LINK_CACHE_SIZE; ++i)
+        if (st->links[i] && link_map_page(st->links[i]) == st->page_num)
+            return st->links[i];
+
+    LinkMap **slot = &st->links[st->links_next];
+    st->links_next = (st->links_next + 1) % LINK_CACHE_SIZE;
+    link_map_free(*slot);
+    *slot = link_map_new(st->doc, st->structure, st->page, st->page_num);
+    return *slot;
+}
+
+static void clear_link_maps(AppState *st)
+{
+    for (int i = 0; i < LINK_CACHE_SIZE; ++i)
+    {
+        link_map_free(st->links[i]);
+        st->links[i] = NULL;
+    }
+}
 
-    CoordConv cc = coord_conv_create(st->page, &st->pdf_pos, true, st->rotation);
-    double ex = coord_conv_to_pdf_x(&cc, e->x);
-    double ey = coord_conv_to_pdf_y(&cc, e->y);
+static const Link *get_link_at(AppState *st, int x, int y)
+{
+    if (!enable_link_following || st->page == NULL ||
+        x < st->pdf_pos.x || y < st->pdf_pos.y ||
+        x > st->pdf_pos.x + st->pdf_pos.width || y > st->pdf_pos.y + st->pdf_pos.height)
+        return NULL;
+
+    CoordConv cc = page_coord_conv(st, true);
+    CoordPoint p = coord_conv_point_to_pdf(&cc, x, y);
+    return link_map_at(get_link_map(st), p.x, p.y);
+}
 
-    bool found = false;
-    for (GList *l = link_mapping; l != NULL; l = l->next)
+static void push_page_stack(AppState *st, int page)
+{
+    if (st->page_stack_size == st->page_stack_capacity)
     {
-        PopplerLinkMapping *link = (PopplerLinkMapping *)l->data;
-        if (ex >= link->area.x1 && ex <= link->area.x2 &&
-            ey >= link->area.y1 && ey <= link->area.y2)
-        {
-            PopplerAction *action = link->action;
-            if (action != NULL && action->type == POPPLER_ACTION_GOTO_DEST)
-            {
-                PopplerActionGotoDest *goto_dest = &action->goto_dest;
-                if (goto_dest->dest->type == POPPLER_DEST_NAMED)
-                {
-                    PopplerDest *dest = poppler_document_find_dest(st->doc, goto_dest->dest->named_dest);
-                    if (dest != NULL)
-                    {
-                        int prev_page = st->page_num;
-                        st->page_num = dest->page_num;
-                        if (prev_page != st->page_num)
-                        {
-                            if (st->page_stack_size == st->page_stack_capacity)
-                            {
-                                st->page_stack_capacity *= 2;
-                                st->page_stack = realloc(st->page_stack, st->page_stack_capacity * sizeof(PageAndOffset));
-                            }
-                            st->page_stack[st->page_stack_size++] = (PageAndOffset){prev_page, st->pdf_pos.y};
-                            found = true;
-                        }
-                        poppler_dest_free(dest);
-                    }
-                }
-                else if (goto_dest->dest->type == POPPLER_DEST_XYZ)
-                {
-                    int prev_page = st->page_num;
-                    st->page_num = goto_dest->dest->page_num;
-                    if (prev_page != st->page_num)
-                    {
-                        if (st->page_stack_size == st->page_stack_capacity)
-                        {
-                            st->page_stack_capacity *= 2;
-                            st->page_stack = realloc(st->page_stack, st->page_stack_capacity * sizeof(PageAndOffset));
-                        }
-                        st->page_stack[st->page_stack_size++] = (PageAndOffset){prev_page, st->pdf_pos.y};
-                        found = true;
-                    }
-                }
-            }
+        st->page_stack_capacity *= 2;
+        st->page_stack = realloc(st->page_stack, st->page_stack_capacity * sizeof(PageAndOffset));
+    }
+    st->page_stack[st->page_stack_size++] = (PageAndOffset){page, st->pdf_pos.y};
+}
+
+// Hands a uri or file to the external handler from config.h.
+static void open_external(const AppState *st, const char *target)
+{
+    char *path = NULL;
+    if (strstr(target, "://") == NULL && target[0] != '/')
+    {
+        char *dir = g_path_get_dirname(st->file_name);
+        path = g_build_filename(dir, target, NULL);
+        g_free(dir);
+    }
+
+    char *argv[] = {(char *)uri_handler, path ? path : (char *)target, NULL};
+    pid_t pid;
+    if (posix_spawnp(&pid, uri_handler, NULL, NULL, argv, environ) != 0)
+        print_error("Cannot start uri handler.");
+
+    g_free(path);
+}
+
+static bool is_trusted_uri(const char *target)
+{
+    for (size_t i = 0; i < sizeof(trusted_uri_schemes) / sizeof(trusted_uri_schemes[0]); ++i)
+        if (g_ascii_strncasecmp(target, trusted_uri_schemes[i], strlen(trusted_uri_schemes[i])) == 0)
+            return true;
+    return false;
+}
+
+// Web and mail links open right away.  Any other target, a file or a uri
+// of another scheme, is shown in the status bar first and opens when the
+// same link is clicked again.
+static void open_external_link(AppState *st, const char *target, const char *confirmed)
+{
+    if (is_trusted_uri(target) || (confirmed && strcmp(confirmed, target) == 0))
+    {
+        open_external(st, target);
+        return;
+    }
+
+    st->confirm_link = strdup(target);
+    if (st->show_status_bar)
+        draw_status_bar(st);
+    else
+        fprintf(stderr, "Click the link again to open %s\n", target);
+}
+
+static void clear_confirm_link(AppState *st)
+{
+    if (st->confirm_link == NULL)
+        return;
+    free(st->confirm_link);
+    st->confirm_link = NULL;
+    if (st->show_status_bar)
+        draw_status_bar(st);
+}
+
+// Follows the link at (x, y).  Returns false when there is none there;
+// *moved tells whether the current page changed.
+static bool follow_link(AppState *st, int x, int y, bool *moved)
+{
+    *moved = false;
+    // Any click ends a pending confirmation, the second one on the same
+    // link by opening it.
+    char *confirmed = st->confirm_link;
+    st->confirm_link = NULL;
+    if (confirmed && st->show_status_bar)
+        draw_status_bar(st);
+
+    const Link *link = get_link_at(st, x, y);
+    if (link == NULL) {
+        free(confirmed);
+        return false;
+    }
+
+    int target = 0;
+    double top = -1;
+    switch (link->kind)
+    {
+        case LINK_PAGE:
+            target = link->page;
+            top = link->top;
+            break;
+        case LINK_DEST:
+            if (!link_find_dest(st->doc, link->target, &target, &top))
+                target = 0;
+            break;
+        case LINK_NAMED:
+            if (strcmp(link->target, "NextPage") == 0)
+                target = st->page_num + 1;
+            else if (strcmp(link->target, "PrevPage") == 0)
+                target = st->page_num - 1;
+            else if (strcmp(link->target, "FirstPage") == 0)
+                target = 1;
+            else if (strcmp(link->target, "LastPage") == 0)
+                target = st->total_pages;
+            break;
+        case LINK_URI:
+        case LINK_REMOTE:
+            open_external_link(st, link->target, confirmed);
+            break;
+        case LINK_NONE:
             break;
-        }
     }
 
-    poppler_page_free_link_mapping(link_mapping);
-    return found;
+    if (target >= 1 && target <= st->total_pages && (target != st->page_num || top >= 0))
+    {
+        push_page_stack(st, st->page_num);
+        st->page_num = target;
+        if (top >= 0)
+            st->next_pos_y = -(int)lround(top * st->pdf_scale);
+        *moved = true;
+    }
+    free(confirmed);
+    return true;
 }
 
-static void copy_text(AppState *st, bool primary)
+static TextLayout *get_text_layout(AppState *st)
 {
-    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 1, 1);
-    cairo_t *cr = cairo_create(surface);
+    if (st->layout == NULL || text_layout_page(st->layout) != st->page_num)
+    {
+        text_layout_free(st->layout);
+        st->layout = text_layout_new(st->page, st->page_num);
+    }
+    return st->layout;
+}
 
-    PopplerRectangle rect;
-    CoordConv cc = coord_conv_create(st->page, &st->pdf_pos, false, st->rotation);
-    Rectangle sr = rectangle_normalize(&st->selection);
-    rect.x1 = coord_conv_to_pdf_x(&cc, sr.x);
-    rect.y1 = coord_conv_to_pdf_y(&cc, sr.y);
-    rect.x2 = coord_conv_to_pdf_x(&cc, sr.x + sr.width);
-    rect.y2 = coord_conv_to_pdf_y(&cc, sr.y + sr.height);
+static void send_expose_region(const AppState *st, const RectRegion *r)
+{
+    for (int i = 0; i < r->size; ++i)
+        send_expose(st, &r->rects[i]);
+}
 
-    char *text = poppler_page_get_selected_text(st->page, POPPLER_SELECTION_GLYPH, &rect);
+static void clear_glyph_selection(AppState *st)
+{
+    RectRegion damage;
+    region_init_rects(&damage, st->sel_rects.rects, st->sel_rects.size);
+    send_expose_region(st, &damage);
+    st->sel_rects.size = 0;
+}
 
-    if (primary)
+// Snaps the dragged st->selection to characters: the text between its start
+// and end point is selected and highlighted line by line.  Only the area whose
+// highlight changed is exposed.
+static void update_glyph_selection(AppState *st)
+{
+    TextLayout *tl = get_text_layout(st);
+    CoordConv cc = page_coord_conv(st, false);
+    CoordPoint ends[2] = {
+        {st->selection.x, st->selection.y},
+        {st->selection.x + st->selection.width, st->selection.y + st->selection.height},
+    };
+    coord_conv_points_to_pdf(&cc, ends, ends, 2);
+    int a = text_layout_hit(tl, ends[0].x, ends[0].y);
+    int b = text_layout_hit(tl, ends[1].x, ends[1].y);
+    st->sel_first = a < b ? a : b;
+    st->sel_last  = a < b ? b : a;
+
+    SelectionRects old = st->sel_rects;
+    st->sel_rects = st->prev_sel_rects;
+
+    SelectionRects *sr = &st->sel_rects;
+    sr->size = text_layout_selection(tl, st->sel_first, st->sel_last, sr->rects, sr->capacity);
+    if (sr->size > sr->capacity)
     {
-        free(st->primary);
-        st->primary = strdup(text);
-        XSetSelectionOwner(st->display, XA_PRIMARY, st->main, CurrentTime);
+        sr->capacity = sr->size * 2;
+        sr->rects = realloc(sr->rects, sr->capacity * sizeof(Rectangle));
+        text_layout_selection(tl, st->sel_first, st->sel_last, sr->rects, sr->capacity);
     }
-    else
+    coord_conv_rects_to_screen(&cc, sr->rects, sr->rects, sr->size);
+
+    RectRegion before, after, damage;
+    region_init_rects(&before, old.rects, old.size);
+    region_init_rects(&after, sr->rects, sr->size);
+    region_xor(&damage, &before, &after);
+    send_expose_region(st, &damage);
+
+    st->prev_sel_rects = old;
+}
+
+// Copies the selected text, taken from the cached page layout.  Without a
+// glyph selection (a search hit) the text between the corners of
+// st->selection is used.
+static void copy_text(AppState *st, bool primary)
+{
+    TextLayout *tl = get_text_layout(st);
+    int first = st->sel_first, last = st->sel_last;
+    if (st->sel_rects.size == 0)
     {
-        free(st->clipboard);
-        st->clipboard = strdup(text);
-        XSetSelectionOwner(st->display, XInternAtom(st->display, "CLIPBOARD", 0),
-            st->main, CurrentTime);
+        // The corners of the hit in page space, which rotation may swap.
+        Rectangle pr = st->pdf_selection;
+        first = text_layout_hit(tl, pr.x, pr.y);
+        last = text_layout_hit(tl, pr.x + pr.width, pr.y + pr.height);
     }
 
-    g_free(text);
-    cairo_destroy(cr);
-    cairo_surface_destroy(surface);
+    char *text = text_layout_get_text(tl, first, last);
+
+    Atom selection = primary ? XA_PRIMARY : XInternAtom(st->display, "CLIPBOARD", False);
+    selection_own(st->sel, selection, text, strlen(text));
+}
+
+// Copies the text of pages first..last to the clipboard.  The text is
+// extracted in the background and owned once complete; a new copy replaces
+// one still running.
+static void start_text_copy(AppState *st, int first, int last)
+{
+    size_t len;
+    if (st->text_copy)
+        text_copy_finish(st->text_copy, true, &len);
+    st->text_copy = text_copy_new(st->file_name, first, last, dump_text_threads, st->wake_pipe[1]);
 }
 
 static Rectangle get_status_pos(const AppState *st)
@@ -587,7 +976,14 @@ static Rectangle get_status_pos(const AppState *st)
 static void draw_status_bar(AppState *st)
 {
     char status[256];
-    snprintf(status, sizeof(status), "[%d/%d] %s", st->page_num, st->total_pages, st->file_name);
+    const char *label = doc_index_page_label(st->structure, st->page_num);
+    if (st->confirm_link)
+        snprintf(status, sizeof(status), "Click again to open %s", st->confirm_link);
+    else if (label)
+        snprintf(status, sizeof(status), "[%s (%d/%d)] %s", label, st->page_num, st->total_pages,
+            st->file_name);
+    else
+        snprintf(status, sizeof(status), "[%d/%d] %s", st->page_num, st->total_pages, st->file_name);
 
     const char *text_color = st->dark_mode ? status_bar_text_color_dark : status_bar_text_color_light;
     const char *bg_color = st->dark_mode ? status_bar_bg_color_dark : status_bar_bg_color_light;
@@ -605,7 +1001,10 @@ static void draw_status_bar(AppState *st)
 
     XSetForeground(st->display, st->status_gc, text_xcolor.pixel);
 
-    XFontStruct *font_info = XLoadQueryFont(st->display, status_bar_font);
+    // Kept: the status bar is redrawn on every scroll step.
+    if (st->status_font == NULL)
+        st->status_font = XLoadQueryFont(st->display, status_bar_font);
+    XFontStruct *font_info = st->status_font;
     if (font_info == NULL) {
         fprintf(stderr, "Failed to load status bar font\n");
         return;
@@ -618,33 +1017,76 @@ static void draw_status_bar(AppState *st)
     int y = st->status_pos.y + (st->status_pos.height - font_info->ascent - font_info->descent) / 2 + font_info->ascent;
 
     XDrawString(st->display, st->main, st->status_gc, x, y, status, strlen(status));
+}
+
+static void render_page_lambda(AppState *st);
 
-    XFreeFont(st->display, font_info);
+static Bool is_escape_press(Display *display, XEvent *e, XPointer arg)
+{
+    (void)display;
+    return e->type == KeyPress && e->xkey.window == *(Window *)arg &&
+        XLookupKeysym(&e->xkey, 0) == XK_Escape;
 }
 
-static void search_text(AppState *st)
+static Bool is_paint_event(Display *display, XEvent *e, XPointer arg)
+{
+    (void)display;
+    return (e->type == Expose || e->type == ConfigureNotify) &&
+        e->xany.window == *(Window *)arg;
+}
+
+static bool handle_event(AppState *st, XEvent *event);
+
+// Scans pages from..to (inclusive, in search direction) with poppler on all
+// cores.  Escape cancels the scan and is then handled as usual; exposures
+// and resizes are handled meanwhile, so the window keeps painting.  Large
+// files skip the in-memory text index, whose thread would read the whole
+// file, and search with a few workers that keep little of it resident.
+static int scan_pages_for_text(AppState *st, const char *str, PopplerFindFlags flags,
+    int from, int to, PopplerRectangle *rect)
+{
+    if (st->scanner == NULL || (from > to && !(flags & POPPLER_FIND_BACKWARDS)) ||
+        (from < to && (flags & POPPLER_FIND_BACKWARDS)))
+        return 0;
+
+    page_scanner_use(st->scanner, st->file_name,
+        st->large_file ? large_file_search_threads : search_threads, st->large_file);
+    page_scanner_start(st->scanner, str, flags, from, to);
+    while (!page_scanner_wait(st->scanner, 20))
+    {
+        XEvent e;
+        if (XCheckIfEvent(st->display, &e, is_escape_press, (XPointer)&st->main))
+        {
+            page_scanner_cancel(st->scanner);
+            XPutBackEvent(st->display, &e);
+        }
+        while (XCheckIfEvent(st->display, &e, is_paint_event, (XPointer)&st->main))
+            handle_event(st, &e);
+    }
+    return page_scanner_finish(st->scanner, rect);
+}
+
+// Splits the trailing '?' (backwards), '~' (ignore case) and '%' (whole
+// words) flags off a search prompt value.
+static PopplerFindFlags parse_search_query(const char *value, char *query, size_t size)
 {
     bool backwards   = false;
     bool ignore_case = false;
     bool whole_words = false;
-    char *str = strdup(st->value);
-    size_t len = strlen(str);
-    while (len > 0 && (str[len-1] == '?' || str[len-1] == '~' || str[len-1] == '%'))
+    snprintf(query, size, "%s", value);
+    size_t len = strlen(query);
+    while (len > 0 && (query[len-1] == '?' || query[len-1] == '~' || query[len-1] == '%'))
     {
-        char flag = str[--len];
+        char flag = query[--len];
         if (flag == '?')
             backwards = true;
         if (flag == '~')
             ignore_case = true;
         if (flag == '%')
             whole_words = true;
-        str[len] = '\0';
+        query[len] = '\0';
     }
 
-    bool found = false;
-    bool whole = false;
-    int page   = st->page_num;
-
     PopplerFindFlags find_flags = 0;
     if (backwards)
         find_flags |= POPPLER_FIND_BACKWARDS;
@@ -652,722 +1094,2780 @@ static void search_text(AppState *st)
         find_flags |= POPPLER_FIND_CASE_SENSITIVE;
     if (whole_words)
         find_flags |= POPPLER_FIND_WHOLE_WORDS_ONLY;
+    return find_flags;
+}
 
-    while (!whole)
-    {
-        GList *matches = poppler_page_find_text_with_options(st->page, str, find_flags);
-        found = (matches != NULL);
-
-        if (found)
-        {
-            PopplerRectangle *rect = (PopplerRectangle *)matches->data;
-            st->left = rect->x1;
-            st->top = rect->y1;
-            st->right = rect->x2;
-            st->bottom = rect->y2;
-            g_list_free_full(matches, (GDestroyNotify)poppler_rectangle_free);
-            break;
-        }
-
-        if (!backwards && page < st->total_pages)
-        {
-            ++page;
-            st->searching = false;
-            g_object_unref(st->page);
-            st->page = poppler_document_get_page(st->doc, page - 1);
-        }
-        else if (backwards && page > 1)
-        {
-            --page;
-            st->searching = false;
-            g_object_unref(st->page);
-            st->page = poppler_document_get_page(st->doc, page - 1);
-        }
-        else {
-            whole = true;
-        }
-    }
+// Replaces the match table unless it already belongs to this query.
+static void set_match_table(AppState *st, const char *query, PopplerFindFlags flags)
+{
+    flags &= ~POPPLER_FIND_BACKWARDS;
+    if (st->matches && st->matches->flags == flags && strcmp(st->matches->query, query) == 0)
+        return;
 
-    free(str);
+    match_table_free(st->matches);
+    st->matches = (query[0] != '\0') ? match_table_new(query, flags, st->total_pages) : NULL;
+}
 
+// Moves to page (0 clears the hit) and selects rect on it.
+static void show_search_hit(AppState *st, int page, const PopplerRectangle *rect)
+{
+    bool found = (page != 0);
+    clear_glyph_selection(st);
     if (found)
     {
+        st->left = rect->x1;
+        st->top = rect->y1;
+        st->right = rect->x2;
+        st->bottom = rect->y2;
+
         if (page != st->page_num)
         {
             st->page_num = page;
-            force_render_page(st, true);
+            render_page_lambda(st);
         }
 
-        CoordConv cc = coord_conv_create(st->page, &st->pdf_pos, false, st->rotation);
+        // Search results have a bottom-left origin, selections a top-left one.
+        double width, height;
+        poppler_page_get_size(st->page, &width, &height);
+        CoordConv cc = page_coord_conv(st, false);
 
-        st->pdf_selection = (Rectangle){(int)st->left, (int)st->top, (int)(st->right - st->left), (int)(st->bottom - st->top)};
+        st->pdf_selection = (Rectangle){(int)st->left, (int)(height - st->bottom), (int)(st->right - st->left), (int)(st->bottom - st->top)};
         st->selection     = coord_conv_to_screen(&cc, &st->pdf_selection);
+
+        if (st->matches)
+        {
+            const PageMatches *pm = match_table_get(st->matches, page, st->page, st->index);
+            st->matches->current_page = page;
+            st->matches->current = match_table_nearest(pm, &st->pdf_selection);
+        }
     }
     else {
         st->pdf_selection = (Rectangle){0, 0, 0, 0};
         st->selection = (Rectangle){0, 0, 0, 0};
+        if (st->matches)
+            st->matches->current_page = 0;
     }
 
     st->searching = found;
 }
 
-typedef struct {
-    char *fname;
-    Window root;
-} Args;
+// Finds the first match from page from on in the direction of flags.
+static int find_text_from(AppState *st, const char *str, PopplerFindFlags flags, int from,
+    PopplerRectangle *rect)
+{
+    if (from < 1 || from > st->total_pages)
+        return 0;
 
-Args parse_args(int argc, char **argv)
+    // Pages the background index already covers are answered from it, the
+    // rest (always the tail of the document) are scanned with poppler.
+    int page = 0;
+    int done = st->index ? text_index_pages_done(st->index) : 0;
+    if (!(flags & POPPLER_FIND_BACKWARDS))
+    {
+        if (done > 0)
+            page = text_index_find(st->index, str, flags, from, st->total_pages, rect);
+        if (page == 0)
+            page = scan_pages_for_text(st, str, flags,
+                from > done ? from : done + 1, st->total_pages, rect);
+    }
+    else
+    {
+        if (from > done)
+            page = scan_pages_for_text(st, str, flags, from, done + 1, rect);
+        if (page == 0 && done > 0)
+            page = text_index_find(st->index, str, flags, from, 1, rect);
+    }
+    return page;
+}
+
+static void search_text(AppState *st)
 {
-    char *fname = NULL;
-    Window root  = None;
+    char str[sizeof(st->value)];
+    PopplerFindFlags find_flags = parse_search_query(st->value, str, sizeof(str));
 
-    for (int i = 1; i < argc; ++i)
+    PopplerRectangle rect;
+    int page = find_text_from(st, str, find_flags, st->page_num, &rect);
+
+    set_match_table(st, str, find_flags);
+    show_search_hit(st, page, &rect);
+}
+
+// Steps to the next or previous match of the last search.  Matches on the
+// current page come from the match table; only crossing to another page
+// searches.
+static void step_match(AppState *st, bool forward)
+{
+    MatchTable *mt = st->matches;
+    if (mt == NULL)
+        return;
+
+    const PageMatches *pm = match_table_get(mt, st->page_num, st->page, st->index);
+    if (pm == NULL)
+        return;
+
+    int i;
+    if (mt->current_page == st->page_num && mt->current >= 0)
+        i = mt->current + (forward ? 1 : -1);
+    else
+        i = forward ? 0 : pm->count - 1;
+
+    if (i < 0 || i >= pm->count)
     {
-        if (strcmp(argv[i], "-w") == 0)
+        PopplerRectangle rect;
+        PopplerFindFlags flags = mt->flags | (forward ? 0 : POPPLER_FIND_BACKWARDS);
+        int page = find_text_from(st, mt->query, flags, st->page_num + (forward ? 1 : -1), &rect);
+        if (page == 0)
+            return;
+
+        if (page != st->page_num)
         {
-            if (i < argc - 1)
-            {
-                root = strtol(argv[++i], NULL, 0);
-                if (root == 0) {
-                    fprintf(stderr, "Invalid window (-w) value.\n");
-                    exit(1);
-                }
-            }
-            else {
-                fprintf(stderr, "Missing window (-w) parameter.\n");
-                exit(1);
-            }
+            st->page_num = page;
+            render_page_lambda(st);
         }
-        else
-            fname = argv[i];
+        pm = match_table_get(mt, page, st->page, st->index);
+        if (pm == NULL || pm->count == 0)
+            return;
+        i = forward ? 0 : pm->count - 1;
     }
 
-    if (fname == NULL) {
-        fprintf(stderr, "Missing pdf file, usage: breathe [-w window] pdf_file.\n");
-        exit(1);
-    }
+    Rectangle normalized = rectangle_normalize(&st->selection);
+    send_expose(st, &normalized);
+    clear_glyph_selection(st);
 
-    return (Args){fname, root};
+    CoordConv cc = page_coord_conv(st, false);
+    st->pdf_selection = pm->rects[i];
+    st->selection = coord_conv_to_screen(&cc, &st->pdf_selection);
+    st->searching = true;
+    mt->current_page = st->page_num;
+    mt->current = i;
+
+    normalized = rectangle_normalize(&st->selection);
+    send_expose(st, &normalized);
 }
 
-static void render_page_lambda(AppState *st) {
-    if (st->page) {
-        g_object_unref(st->page);
+// Hands the current prompt value to the search-as-you-type worker.
+static void update_incremental_search(AppState *st)
+{
+    if (st->inc_search == NULL)
+        return;
+
+    char str[sizeof(st->value)];
+    PopplerFindFlags find_flags = parse_search_query(st->value, str, sizeof(str));
+    inc_search_update(st->inc_search, str, find_flags, st->search_origin);
+}
+
+// Thumbnails for the overview grid, kept in the disk cache too when enabled.
+static ThumbCache *new_thumb_cache(const AppState *st)
+{
+    long disk_bytes = enable_disk_cache && thumbnail_disk_cache ? (long)disk_cache_mb << 20 : 0;
+    return thumb_cache_new(st->file_name, st->total_pages, thumbnail_width,
+        thumbnail_threads, thumbnail_cache_kb, st->wake_pipe[1], disk_bytes);
+}
+
+// Runs on the loader thread once a reloaded doc is parsed: renders the
+// view described by data (a RenderPrint) from it and hashes the image.
+static void check_reload_render(PopplerDocument *doc, void *data)
+{
+    RenderPrint *rp = data;
+    rp->new_print = 0;
+    int total_pages = poppler_document_get_n_pages(doc);
+    if (rp->page_num < 1 || rp->page_num > total_pages)
+        return;
+
+    AppState st = {0};
+    st.doc = doc;
+    st.page_num = rp->page_num;
+    st.page = poppler_document_get_page(doc, rp->page_num - 1);
+    st.second_page = rp->two_page_view && rp->page_num < total_pages
+        ? poppler_document_get_page(doc, rp->page_num) : NULL;
+    st.two_page_view = rp->two_page_view;
+    st.rotation = rp->rotation;
+    st.dark_mode = rp->dark_mode;
+    if (st.page && (st.second_page || !rp->two_page_view))
+    {
+        rp->new_image = render_pdf_page_to_image(&st, &rp->prc);
+        rp->new_print = image_print(rp->new_image);
     }
-    st->page = poppler_document_get_page(st->doc, st->page_num - 1);
-    if (!st->page) {
-        char error_msg[100];
-        snprintf(error_msg, sizeof(error_msg), "Cannot create page: %d.", st->page_num);
-        print_error(error_msg);
+    if (st.page)
+        g_object_unref(st.page);
+    if (st.second_page)
+        g_object_unref(st.second_page);
+}
+
+// Replaces the document with a freshly loaded doc of the same file, restarting
+// everything that holds state of the old one.  The page, zoom and scroll
+// position stay; when the loader found the view to draw the same as before
+// (see check_reload_render()), the current render is kept as is, and goes
+// into the disk cache under the file's new key.  Thumbnails are checked
+// again page by page, see thumb_cache_reload(); other pages' renders in the
+// disk cache are not carried over, as checking one costs the render it
+// would save.
+static void swap_document(AppState *st, PopplerDocument *doc)
+{
+    cairo_surface_t *new_image = st->reload_check.new_image;
+    st->reload_check.new_image = NULL;
+    int total_pages = poppler_document_get_n_pages(doc);
+    if (total_pages <= 0)
+    {
+        print_error("Reloaded document has no pages.");
+        if (new_image)
+            cairo_surface_destroy(new_image);
+        g_object_unref(doc);
+        return;
     }
-    
-    if (st->two_page_view && st->page_num < st->total_pages) {
-        if (st->second_page) {
-            g_object_unref(st->second_page);
+
+    int page_num = st->page_num < total_pages ? st->page_num : total_pages;
+    PopplerPage *page = poppler_document_get_page(doc, page_num - 1);
+    PopplerPage *second_page = (st->second_page && page_num < total_pages)
+        ? poppler_document_get_page(doc, page_num) : NULL;
+    const RenderPrint *check = &st->reload_check;
+    bool unchanged = page_num == st->page_num && st->pdf != None &&
+        st->shown.page_num == page_num && check->page_num == page_num &&
+        st->shown.print == check->print && check->new_print == check->print;
+
+    g_object_unref(st->doc);
+    st->doc = doc;
+    st->total_pages = total_pages;
+    st->page_num = page_num;
+
+    // The file may have grown past large_file_mb or shrunk below it; the
+    // text index follows.
+    struct stat sb;
+    if (stat(st->file_name, &sb) == 0)
+    {
+        st->file_size = sb.st_size;
+        st->large_file = sb.st_size >= (off_t)large_file_mb << 20;
+    }
+    bool want_index = enable_text_index && !st->large_file && st->first_paint_done &&
+        !st->index_dropped;
+    if (st->index || want_index)
+    {
+        inc_search_free(st->inc_search);
+        text_index_free(st->index);
+        st->index = want_index
+            ? text_index_new(st->file_name, st->total_pages, persist_text_index) : NULL;
+        st->inc_search = inc_search_new(st->index, st->wake_pipe[1], incremental_search_delay_ms);
+    }
+    if (st->structure)
+    {
+        doc_index_free(st->structure);
+        st->structure = doc_index_new(st->file_name, st->wake_pipe[1]);
+        st->structure_shown = false;
+    }
+    page_scanner_forget(st->scanner, st->file_name);
+    if (st->disk_cache)
+    {
+        disk_cache_free(st->disk_cache);
+        st->disk_cache = disk_cache_new(st->file_name, (long)disk_cache_mb << 20);
+        if (unchanged && new_image && check->whole_page && check->dark_mode == st->dark_mode)
+        {
+            DiskCacheKey key = {page_num, (int)lround(check->prc.dpi), check->rotation,
+                theme_key(st)};
+            disk_cache_store(st->disk_cache, &key, new_image);
         }
-        st->second_page = poppler_document_get_page(st->doc, st->page_num);
-    } else {
-        if (st->second_page) {
+    }
+    if (new_image)
+        cairo_surface_destroy(new_image);
+    if (st->thumbs)
+    {
+        thumb_cache_reload(st->thumbs, total_pages);
+        if (st->overview_page > total_pages)
+            st->overview_page = total_pages;
+    }
+    if (st->matches)
+    {
+        MatchTable *mt = match_table_new(st->matches->query, st->matches->flags, st->total_pages);
+        match_table_free(st->matches);
+        st->matches = mt;
+    }
+    clear_link_maps(st);
+    text_layout_free(st->layout);
+    st->layout = NULL;
+
+    if (unchanged && !st->reload_render)
+    {
+        if (st->page)
+            g_object_unref(st->page);
+        if (st->second_page)
             g_object_unref(st->second_page);
-            st->second_page = NULL;
-        }
+        st->page = page;
+        st->second_page = second_page;
+        return;
     }
-    
-    force_render_page(st, true);
-    st->selection = (Rectangle){0, 0, 0, 0};
-    st->pdf_selection = (Rectangle){0, 0, 0, 0};
-    st->selecting = false;
+
+    if (page)
+        g_object_unref(page);
+    if (second_page)
+        g_object_unref(second_page);
+    st->keep_pdf_pos = !st->reload_render;
+    st->reload_render = false;
+    render_page_lambda(st);
 }
 
-int main(int argc, char **argv)
+static void start_reload(AppState *st)
 {
-    setlocale(LC_ALL, "");
-
-    if (argc < 2) {
-        fprintf(stderr, "Missing pdf file, usage: breathe [-w window] pdf_file.\n");
-        return 1;
+    if (st->loader)
+        st->reload_pending = true;
+    else
+    {
+        // The view on screen now is what the reload compares against.
+        st->reload_check = st->pdf != None ? st->shown : (RenderPrint){0};
+        st->loader = doc_loader_new(st->file_name, st->wake_pipe[1],
+            check_reload_render, &st->reload_check);
     }
+}
 
-    Args args = parse_args(argc, argv);
-    char *file_name = args.fname;
-
-    GError *error = NULL;
-    char *uri = g_filename_to_uri(file_name, NULL, &error);
-    if (uri == NULL) {
-        fprintf(stderr, "Error converting filename to URI: %s\n", error->message);
-        g_error_free(error);
-        return 1;
-    }
+static void handle_background_results(AppState *st)
+{
+    if (st->loader && doc_loader_done(st->loader))
+    {
+        GError *error = NULL;
+        PopplerDocument *doc = doc_loader_finish(st->loader, &error);
+        st->loader = NULL;
+        if (doc)
+            swap_document(st, doc);
+        else
+        {
+            print_error("Error re-loading pdf file.");
+            g_clear_error(&error);
+            if (st->reload_render)
+            {
+                st->reload_render = false;
+                render_page_lambda(st);
+            }
+        }
 
-    AppState st = {0};
-    st.page_stack_capacity = 10;
-    st.page_stack = malloc(st.page_stack_capacity * sizeof(PageAndOffset));
-    st.rotation = 0;
-    st.zoom_level = 1.0;
-    st.two_page_view = false;
-    st.continuous_mode = false;
-    st.show_status_bar = true;
-    st.dark_mode = false;
-    st.file_name = strdup(file_name);
-
-    st.doc = poppler_document_new_from_file(uri, NULL, &error);
-    g_free(uri);
-
-    if (!st.doc) {
-        fprintf(stderr, "Error loading PDF file: %s\n", file_name);
-        if (error) {
-            fprintf(stderr, "Poppler error: %s\n", error->message);
-            g_error_free(error);
+        if (st->reload_pending)
+        {
+            st->reload_pending = false;
+            start_reload(st);
         }
-        return 1;
     }
 
-    st.total_pages = poppler_document_get_n_pages(st.doc);
-    if (st.total_pages <= 0) {
-        fprintf(stderr, "Error: The document has no pages or failed to load properly.\n");
-        g_object_unref(st.doc);
-        return 1;
+    // Page labels for the status bar; link maps built before now left their
+    // named destinations to be looked up on click.
+    if (doc_index_ready(st->structure) && !st->structure_shown)
+    {
+        st->structure_shown = true;
+        clear_link_maps(st);
+        if (st->show_status_bar)
+            send_expose(st, &st->status_pos);
     }
 
-    printf("Successfully loaded PDF with %d pages.\n", st.total_pages);
+    if (st->text_copy && text_copy_done(st->text_copy))
+    {
+        size_t len;
+        char *text = text_copy_finish(st->text_copy, false, &len);
+        st->text_copy = NULL;
+        if (text)
+            selection_own(st->sel, XInternAtom(st->display, "CLIPBOARD", False), text, len);
+        else
+            print_error("Error extracting text.");
+    }
 
-    st.page_num = 1;
-    st.page = poppler_document_get_page(st.doc, st.page_num - 1);
-    if (!st.page) {
-        fprintf(stderr, "Error: Failed to load the first page of the document.\n");
-        g_object_unref(st.doc);
-        return 1;
+    IncSearchResult res;
+    if (st->inc_search && inc_search_get_result(st->inc_search, &res) &&
+        st->status && strncmp(st->prompt, "search", 6) == 0)
+    {
+        char str[sizeof(st->value)];
+        PopplerFindFlags find_flags = parse_search_query(st->value, str, sizeof(str));
+        set_match_table(st, str, find_flags);
+
+        Rectangle normalized = rectangle_normalize(&st->selection);
+        send_expose(st, &normalized);
+        show_search_hit(st, res.page, &res.rect);
+        normalized = rectangle_normalize(&st->selection);
+        send_expose(st, &normalized);
     }
 
-    printf("Successfully loaded first page.\n");
+    // New thumbnails are ready.
+    if (st->overview)
+        send_expose(st, &(Rectangle){0, 0, st->main_pos.width, st->main_pos.height});
+}
 
-    double width, height;
-    poppler_page_get_size(st.page, &width, &height);
-    SetupXRet xret = setup_x((unsigned)width, (unsigned)height, file_name, args.root);
-    if (xret.display == NULL) {
-        fprintf(stderr, "Error: Failed to set up X window.\n");
-        g_object_unref(st.doc);
-        return 1;
+// Handles what poll() found on the window's wakeup pipe (fds[0]) and file
+// watch (fds[1]): results from background threads and changes to the file.
+static void handle_window_wakeups(AppState *st, const struct pollfd *fds)
+{
+    if (fds[0].revents & POLLIN)
+    {
+        char buf[64];
+        while (read(st->wake_pipe[0], buf, sizeof(buf)) > 0)
+            ;
+        handle_background_results(st);
     }
 
-    st.display = xret.display;
-    st.main    = xret.main;
+    if (st->watch)
+    {
+        if (fds[1].revents & POLLIN)
+            file_watch_read(st->watch);
+        if (file_watch_fired(st->watch))
+            start_reload(st);
+    }
+}
 
-    st.fit_page     = true;
-    st.scrolling_up = false;
+static void report_startup(const AppState *st, const char *event)
+{
+    if (st->start_time != 0)
+        fprintf(stderr, "startup: %-20s %8.1f ms\n", event,
+            (g_get_monotonic_time() - st->start_time) / 1000.0);
+}
 
-    st.selection_gc = xret.selection;
-    st.status_gc    = xret.status;
-    st.text_gc      = xret.text;
+// Shows a cached rendering of the first page, at whatever size it was
+// stored, scaled into the window while the document is still being parsed.
+static void draw_startup_preview(const AppState *st, cairo_surface_t *preview)
+{
+    if (preview == NULL || st->main_pos.width <= 0 || st->main_pos.height <= 0)
+        return;
 
-    st.fset    = xret.fset;
-    st.fheight = xret.fheight;
-    st.fbase   = xret.fbase;
+    int width = cairo_image_surface_get_width(preview);
+    int height = cairo_image_surface_get_height(preview);
+    double scale = fmin((double)st->main_pos.width / width, (double)st->main_pos.height / height);
 
-    XEvent event;
-    while (true)
+    cairo_surface_t *surface = cairo_xlib_surface_create(st->display, st->main,
+        DefaultVisual(st->display, DefaultScreen(st->display)),
+        st->main_pos.width, st->main_pos.height);
+    cairo_t *cr = cairo_create(surface);
+    cairo_translate(cr, (st->main_pos.width - width * scale) / 2,
+        (st->main_pos.height - height * scale) / 2);
+    cairo_scale(cr, scale, scale);
+    cairo_set_source_surface(cr, preview, 0, 0);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+    cairo_surface_destroy(surface);
+}
+
+static const Shortcut *find_shortcut(unsigned state, KeySym ksym)
+{
+    for (size_t i = 0; i < sizeof(shortcuts)/sizeof(shortcuts[0]); ++i)
     {
-        XNextEvent(st.display, &event);
+        const Shortcut *sc = &shortcuts[i];
+        if ((sc->mask == AnyMask || sc->mask == state) && sc->ksym == ksym)
+            return sc;
+    }
+    return NULL;
+}
+
+// The events of the starting window that wait_for_document() takes from the
+// queue: the ones that paint it and the ones that may close it.
+static Bool is_startup_event(Display *display, XEvent *e, XPointer arg)
+{
+    (void)display;
+    return e->xany.window == *(Window *)arg &&
+        (e->type == Expose || e->type == ConfigureNotify || e->type == KeyPress ||
+         e->type == ClientMessage);
+}
 
-        if (event.type == Expose)
+static bool closes_window(AppState *st, XEvent *e)
+{
+    if (e->type == ClientMessage)
+        return e->xclient.message_type != XInternAtom(st->display, "_XEMBED", False) &&
+            e->xclient.data.l[0] == (long)XInternAtom(st->display, "WM_DELETE_WINDOW", False);
+
+    KeySym ksym;
+    char buf[32];
+    XLookupString(&e->xkey, buf, sizeof buf, &ksym, NULL);
+    const Shortcut *sc = find_shortcut(e->xkey.state, ksym);
+    return sc != NULL && sc->action == QUIT;
+}
+
+// Keeps the freshly mapped window painted (with the cached preview, if any)
+// until the background parse of the document finishes.  Quitting or closing
+// the window meanwhile abandons the parse and sets *closed; other keys and
+// XEmbed messages are put back in the queue for when the document is there,
+// and events of other windows wait in it.  The first page itself cannot be
+// rendered before the parse ends, poppler needs the whole document for it.
+static PopplerDocument *wait_for_document(AppState *st, DocLoader *loader,
+    cairo_surface_t *preview, bool *closed, GError **error)
+{
+    XEvent *kept = NULL;
+    int nkept = 0, kept_capacity = 0;
+
+    while (!doc_loader_done(loader))
+    {
+        XEvent event;
+        while (XCheckIfEvent(st->display, &event, is_startup_event, (XPointer)&st->main))
         {
-            Rectangle prev = st.pdf_pos;
-            if (st.pdf == None)
+            if (event.type == ConfigureNotify)
             {
-                PdfRenderConf prc = get_pdf_render_conf(st.fit_page, st.scrolling_up,
-                    st.next_pos_y, st.main_pos, st.page, st.magnifying, st.magnify,
-                    st.rotation, st.zoom_level);
-                st.scrolling_up = false;
-                st.next_pos_y   = 0;
-
-                st.pdf = render_pdf_page_to_pixmap(&st, &prc);
-                st.pdf_pos = prc.pos;
+                st->main_pos = (Rectangle){event.xconfigure.x, event.xconfigure.y,
+                    event.xconfigure.width, event.xconfigure.height};
+                st->status_pos = get_status_pos(st);
             }
-            copy_pixmap_on_expose_event(&st, &prev, &event.xexpose);
-            
-            if (st.show_status_bar) {
-                draw_status_bar(&st);
+            else if (event.type == Expose)
+            {
+                if (event.xexpose.count == 0)
+                    draw_startup_preview(st, preview);
             }
-        }
-
-        if (event.type == ConfigureNotify)
-        {
-            if (st.main_pos.width != event.xconfigure.width ||
-                st.main_pos.height != event.xconfigure.height)
+            else if (closes_window(st, &event))
+            {
+                doc_loader_cancel(loader);
+                free(kept);
+                *closed = true;
+                return NULL;
+            }
+            else
             {
-                st.main_pos = (Rectangle){
-                    event.xconfigure.x,
-                    event.xconfigure.y,
-                    event.xconfigure.width,
-                    event.xconfigure.height
-                };
-
-                XClearWindow(st.display, st.main);
-                if (st.pdf != None)
+                if (nkept == kept_capacity)
                 {
-                    XFreePixmap(st.display, st.pdf);
-                    st.pdf = None;
+                    kept_capacity = kept_capacity ? kept_capacity * 2 : 16;
+                    kept = realloc(kept, kept_capacity * sizeof(XEvent));
                 }
-
-                st.status_pos = get_status_pos(&st);
+                kept[nkept++] = event;
             }
         }
+        XFlush(st->display);
 
-        if (event.type == ClientMessage)
+        struct pollfd fds[2] = {
+            {ConnectionNumber(st->display), POLLIN, 0},
+            {st->wake_pipe[0], POLLIN, 0}
+        };
+        if (poll(fds, 2, -1) > 0 && (fds[1].revents & POLLIN))
         {
-            Atom xembed_atom = XInternAtom(st.display, "_XEMBED", False);
-            Atom wmdel_atom  = XInternAtom(st.display, "WM_DELETE_WINDOW", False);
+            char buf[64];
+            while (read(st->wake_pipe[0], buf, sizeof(buf)) > 0)
+                ;
+        }
+    }
 
-            if (event.xclient.message_type == xembed_atom && event.xclient.format == 32)
-            {
-                if (!st.xembed_init)
-                {
-                    force_render_page(&st, true);
-                    st.xembed_init = true;
-                }
+    // Put back last first, so that they come out in the order they came in.
+    while (nkept > 0)
+        XPutBackEvent(st->display, &kept[--nkept]);
+    free(kept);
+    return doc_loader_finish(loader, error);
+}
+
+typedef struct {
+    char *fname;
+    Window root;
+    bool startup_stats;
+    bool alloc_stats;       // print the event loop's allocation counters at exit
+    const char *export_pattern;  // --export, NULL for the viewer
+    const char *pages;
+    double dpi;
+    int rotation;
+    double zoom;
+    bool dark_mode;
+    bool dump_text;
+    bool form_feed;
+    bool json;
+    bool server;            // --server, run as the resident server
+    const char *control;    // --control socket path
+    const char *send;       // --send, commands for a running viewer
+} Args;
+
+#define USAGE "usage: breathe [-w window] [--startup-stats] [--alloc-stats] [--control socket] pdf_file\n" \
+    "       breathe --server\n" \
+    "       breathe [--control socket] --send 'goto 12; zoom 1.5'\n" \
+    "       breathe --export out/%04d.png [--pages 1-10,12] [--dpi 150] [--rotate 90]\n" \
+    "               [--zoom 1.5] [--dark] pdf_file\n" \
+    "       breathe --dump-text [--pages 1-10,12] [--form-feed] [--json] pdf_file\n"
+
+static const char *option_value(int argc, char **argv, int *i)
+{
+    if (*i >= argc - 1) {
+        fprintf(stderr, "Missing %s parameter.\n", argv[*i]);
+        exit(1);
+    }
+    return argv[++*i];
+}
+
+Args parse_args(int argc, char **argv)
+{
+    Args args = {NULL, None, false, false, NULL, NULL, export_dpi, 0, 1.0, false, false, false, false, false,
+        NULL, NULL};
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-w") == 0)
+        {
+            args.root = strtol(option_value(argc, argv, &i), NULL, 0);
+            if (args.root == 0) {
+                fprintf(stderr, "Invalid window (-w) value.\n");
+                exit(1);
             }
-            else if (event.xclient.data.l[0] == (long)wmdel_atom)
+        }
+        else if (strcmp(argv[i], "--startup-stats") == 0)
+            args.startup_stats = true;
+        else if (strcmp(argv[i], "--alloc-stats") == 0)
+            args.alloc_stats = true;
+        else if (strcmp(argv[i], "--export") == 0)
+            args.export_pattern = option_value(argc, argv, &i);
+        else if (strcmp(argv[i], "--pages") == 0)
+            args.pages = option_value(argc, argv, &i);
+        else if (strcmp(argv[i], "--dpi") == 0)
+            args.dpi = atof(option_value(argc, argv, &i));
+        else if (strcmp(argv[i], "--rotate") == 0)
+            args.rotation = atoi(option_value(argc, argv, &i));
+        else if (strcmp(argv[i], "--zoom") == 0)
+            args.zoom = atof(option_value(argc, argv, &i));
+        else if (strcmp(argv[i], "--dark") == 0)
+            args.dark_mode = true;
+        else if (strcmp(argv[i], "--dump-text") == 0)
+            args.dump_text = true;
+        else if (strcmp(argv[i], "--form-feed") == 0)
+            args.form_feed = true;
+        else if (strcmp(argv[i], "--json") == 0)
+            args.json = true;
+        else if (strcmp(argv[i], "--server") == 0)
+            args.server = true;
+        else if (strcmp(argv[i], "--control") == 0)
+            args.control = option_value(argc, argv, &i);
+        else if (strcmp(argv[i], "--send") == 0)
+            args.send = option_value(argc, argv, &i);
+        else
+            args.fname = argv[i];
+    }
+
+    if (args.fname == NULL && !args.server && !args.send) {
+        fputs("Missing pdf file, " USAGE, stderr);
+        exit(1);
+    }
+    if (args.dpi <= 0 || args.zoom <= 0 || args.rotation % 90 != 0) {
+        fprintf(stderr, "Invalid --dpi, --zoom or --rotate value.\n");
+        exit(1);
+    }
+    args.rotation = (args.rotation % 360 + 360) % 360;
+
+    return args;
+}
+
+// Checks that an --export pattern formats exactly one int, like %04d.
+static bool valid_export_pattern(const char *pattern)
+{
+    int conversions = 0;
+    for (const char *c = pattern; *c; ++c)
+    {
+        if (*c != '%')
+            continue;
+        if (*++c == '%')
+            continue;
+        while (isdigit((unsigned char)*c))
+            ++c;
+        if (*c != 'd')
+            return false;
+        ++conversions;
+    }
+    return conversions == 1;
+}
+
+// Parses a --pages list like "1-10,12,20-" into page numbers; NULL selects
+// every page.
+static int *parse_page_list(const char *spec, int total_pages, int *count)
+{
+    int capacity = 16;
+    int *pages = malloc(capacity * sizeof(int));
+    *count = 0;
+
+    const char *c = spec ? spec : "1-";
+    while (*c)
+    {
+        char *end;
+        long first = strtol(c, &end, 10), last = first;
+        if (end == c)
+            goto invalid;
+        c = end;
+        if (*c == '-')
+        {
+            last = strtol(++c, &end, 10);
+            if (end == c)
+                last = total_pages;
+            c = end;
+        }
+        if (*c == ',')
+            ++c;
+        else if (*c)
+            goto invalid;
+
+        if (first < 1 || first > last || first > total_pages)
+            goto invalid;
+        if (last > total_pages)
+            last = total_pages;
+        for (long p = first; p <= last; ++p)
+        {
+            if (*count == capacity)
             {
-                goto endloop;
+                capacity *= 2;
+                pages = realloc(pages, capacity * sizeof(int));
             }
+            pages[(*count)++] = p;
         }
+    }
+    if (*count > 0)
+        return pages;
 
-        if (event.type == KeyPress)
-        {
-            KeySym ksym;
-            char buf[32];
-            XLookupString(&event.xkey, buf, sizeof buf, &ksym, NULL);
+invalid:
+    fprintf(stderr, "Invalid page list: %s (the document has %d pages).\n", spec, total_pages);
+    free(pages);
+    return NULL;
+}
 
-            bool status = st.status;
-            if (!status)
-            {
-                for (size_t i = 0; i < sizeof(shortcuts)/sizeof(shortcuts[0]); ++i)
-                {
-                    const Shortcut *sc = &shortcuts[i];
-                    if ((sc->mask == AnyMask || sc->mask == event.xkey.state) &&
-                        sc->ksym == ksym)
-                    {
-                        switch (sc->action)
-                        {
-                            case QUIT:
-                                goto endloop;
-                            case FIT_PAGE:
-                                if (!st.fit_page) {
-                                    st.fit_page = true;
-                                    force_render_page(&st, true);
-                                }
-                                break;
-                            case FIT_WIDTH:
-                                if (st.fit_page) {
-                                    st.fit_page = false;
-                                    force_render_page(&st, true);
-                                }
-                                break;
-                            case NEXT:
-                            case PG_DOWN:
-                                if (st.page_num < st.total_pages) {
-                                    ++st.page_num;
-                                    render_page_lambda(&st);
-                                }
-                                break;
-                            case PREV:
-                            case PG_UP:
-                                if (st.page_num > 1) {
-                                    --st.page_num;
-                                    render_page_lambda(&st);
-                                }
-                                break;
-                            case FIRST:
-                                st.page_num = 1;
-                                render_page_lambda(&st);
-                                break;
-                            case LAST:
-                                st.page_num = st.total_pages;
-                                render_page_lambda(&st);
-                                break;
-                            case DOWN:
-                                if (!st.fit_page) {
-                                    int diff = get_pdf_scroll_diff(&st, -arrow_scroll);
-                                    if (diff != 0) {
-                                        st.pdf_pos.y += diff;
-                                        force_render_page(&st, false);
-                                    }
-                                }
-                                break;
-                            case UP:
-                                if (!st.fit_page) {
-                                    int diff = get_pdf_scroll_diff(&st, arrow_scroll);
-                                    if (diff != 0) {
-                                        st.pdf_pos.y += diff;
-                                        force_render_page(&st, false);
-                                    }
-                                }
-                                break;
-                            case BACK:
-                                if (st.page_stack_size > 0) {
-                                    PageAndOffset elem = st.page_stack[--st.page_stack_size];
-                                    st.page_num = elem.page;
-                                    st.next_pos_y = elem.offset;
-                                    render_page_lambda(&st);
-                                }
-                                break;
-                            case RELOAD:
-                                g_object_unref(st.doc);
-                                st.doc = poppler_document_new_from_file(file_name, NULL, NULL);
-                                if (!st.doc) {
-                                    print_error("Error re-loading pdf file.");
-                                }
-                                if (st.page_num > st.total_pages) {
-                                    st.page_num = 1;
-                                }
-                                render_page_lambda(&st);
-                                break;
-                            case COPY:
-                                if (st.pdf_selection.width > 0 && st.pdf_selection.height > 0) {
-                                    copy_text(&st, false);
-                                }
-                                break;
-                            case GOTO_PAGE:
-                                st.status = true;
-                                st.input = true;
-                                snprintf(st.prompt, sizeof(st.prompt), "goto page [1, %d]: ", st.total_pages);
-                                st.value[0] = '\0';
-                                send_expose(&st, &st.status_pos);
-                                break;
-                            case SEARCH:
-                                st.status = true;
-                                st.input = true;
-                                strcpy(st.prompt, "search: ");
-                                st.value[0] = '\0';
-                                send_expose(&st, &st.status_pos);
-                                break;
-                            case PAGE:
-                                st.status = true;
-                                st.input = false;
-                                snprintf(st.prompt, sizeof(st.prompt), "page %d/%d", st.page_num, st.total_pages);
-                                st.value[0] = '\0';
-                                send_expose(&st, &st.status_pos);
-                                break;
-                            case MAGNIFY:
-                                if (st.pdf_selection.width > 0 && st.pdf_selection.height > 0) {
-                                    st.magnifying = true;
-                                    st.magnify = st.pdf_selection;
-                                    st.selection = (Rectangle){0, 0, 0, 0};
-                                    st.pdf_selection = (Rectangle){0, 0, 0, 0};
-                                    st.status = true;
-                                    st.input = false;
-                                    strcpy(st.prompt, "magnify");
-                                    st.value[0] = '\0';
-                                    st.pre_mag_y = st.pdf_pos.y;
-                                    st.pdf_pos.y = 0;
-                                    force_render_page(&st, true);
-                                }
-                                break;
-                            case ROTATE_CW:
-                                st.rotation = (st.rotation + 90) % 360;
-                                force_render_page(&st, true);
-                                break;
-                            case ROTATE_CCW:
-                                st.rotation = (st.rotation - 90 + 360) % 360;
-                                force_render_page(&st, true);
-                                break;
-                            case ZOOM_IN:
-                                st.zoom_level *= zoom_step;
-                                st.fit_page = false;
-                                force_render_page(&st, true);
-                                break;
-                            case ZOOM_OUT:
-                                st.zoom_level /= zoom_step;
-                                st.fit_page = false;
-                                force_render_page(&st, true);
-                                break;
-                            case TOGGLE_TWO_PAGE_VIEW:
-                                st.two_page_view = !st.two_page_view;
-                                render_page_lambda(&st);
-                                break;
-                            case TOGGLE_CONTINUOUS_MODE:
-                                st.continuous_mode = !st.continuous_mode;
-                                force_render_page(&st, true);
-                                break;
-                            case TOGGLE_STATUS_BAR:
-                                st.show_status_bar = !st.show_status_bar;
-                                force_render_page(&st, true);
-                                break;
-                            case TOGGLE_DARK_MODE:
-                                st.dark_mode = !st.dark_mode;
-                                force_render_page(&st, true);
-                                break;
-                        }
-                    }
-                }
-            }
+// The --pages of the document, after opening it to count them.
+static int *selected_pages(const Args *args, int *count)
+{
+    GError *error = NULL;
+    PopplerDocument *doc = doc_load(args->fname, &error);
+    if (doc == NULL) {
+        fprintf(stderr, "Error loading PDF file: %s\n", args->fname);
+        if (error) {
+            fprintf(stderr, "Poppler error: %s\n", error->message);
+            g_error_free(error);
+        }
+        return NULL;
+    }
+    int total_pages = poppler_document_get_n_pages(doc);
+    g_object_unref(doc);
 
-            if (status)
-            {
-                if (ksym == XK_Escape)
-                {
-                    st.status = false;
-                    st.searching = false;
-                    XClearArea(st.display, st.main,
-                        st.status_pos.x, st.status_pos.y,
-                        st.status_pos.width, st.status_pos.height, True);
+    return parse_page_list(args->pages, total_pages, count);
+}
 
-                    if (st.magnifying)
-                    {
-                        st.magnifying = false;
-                        st.next_pos_y = st.pre_mag_y;
-                        force_render_page(&st, true);
-                    }
-                }
+typedef struct {
+    const Args *args;
+    const int *pages;
+    int count;
+    gint next;      // index into pages of the next page to render
+    gint failed;
+} ExportJob;
+
+static bool write_ppm(cairo_surface_t *image, const char *path)
+{
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+        return false;
 
-                if (ksym == XK_BackSpace)
-                {
-                    if (strlen(st.value) > 0)
-                    {
-                        st.value[strlen(st.value) - 1] = '\0';
-                        XClearArea(st.display, st.main,
-                            st.status_pos.x, st.status_pos.y,
-                            st.status_pos.width, st.status_pos.height, True);
-                    }
-                }
+    int width = cairo_image_surface_get_width(image);
+    int height = cairo_image_surface_get_height(image);
+    int stride = cairo_image_surface_get_stride(image);
+    const unsigned char *data = cairo_image_surface_get_data(image);
+    unsigned char *row = malloc(width * 3);
 
-                if (ksym == XK_Return)
-                {
-                    if (strncmp(st.prompt, "goto", 4) == 0)
-                    {
-                        int page = atoi(st.value);
-                        if (page >= 1 && page <= st.total_pages)
-                        {
-                            st.status = false;
-                            st.page_num = page;
-
-                            XClearArea(st.display, st.main,
-                                st.status_pos.x, st.status_pos.y,
-                                st.status_pos.width, st.status_pos.height, True);
-                            render_page_lambda(&st);
-                        }
-                    }
+    fprintf(f, "P6\n%d %d\n255\n", width, height);
+    for (int y = 0; y < height; ++y)
+    {
+        const uint32_t *px = (const uint32_t *)(data + y * stride);
+        for (int x = 0; x < width; ++x)
+        {
+            row[3 * x]     = px[x] >> 16;
+            row[3 * x + 1] = px[x] >> 8;
+            row[3 * x + 2] = px[x];
+        }
+        fwrite(row, 3, width, f);
+    }
 
-                    if (strncmp(st.prompt, "search", 6) == 0)
-                    {
-                        Rectangle normalized = rectangle_normalize(&st.selection);
-                        send_expose(&st, &normalized);
-                        search_text(&st);
-                        normalized = rectangle_normalize(&st.selection);
-                        send_expose(&st, &normalized);
-                    }
-                }
+    free(row);
+    bool ok = !ferror(f);
+    return fclose(f) == 0 && ok;
+}
 
-                if (st.input)
-                {
-                    if (strlen(buf) > 0 && !iscntrl((unsigned char)buf[0]))
-                    {
-                        strcat(st.value, buf);
-                        send_expose(&st, &st.status_pos);
-                    }
-                }
-            }
+// Each worker renders through its own document, one page at a time, and
+// writes it out before taking the next: at most one image per thread is
+// ever in memory.
+static gpointer export_thread(gpointer data)
+{
+    ExportJob *job = data;
+    const Args *args = job->args;
+    PopplerDocument *doc = doc_load(args->fname, NULL);
+    if (doc == NULL)
+    {
+        g_atomic_int_set(&job->failed, 1);
+        return NULL;
+    }
+
+    AppState st = {0};
+    st.rotation = args->rotation;
+    st.dark_mode = args->dark_mode;
+    bool ppm = g_str_has_suffix(args->export_pattern, ".ppm");
+
+    int i, rendered = 0;
+    while ((i = g_atomic_int_add(&job->next, 1)) < job->count)
+    {
+        int page_num = job->pages[i];
+        st.page = poppler_document_get_page(doc, page_num - 1);
+        if (st.page == NULL)
+        {
+            fprintf(stderr, "Cannot create page: %d.\n", page_num);
+            g_atomic_int_set(&job->failed, 1);
+            continue;
         }
 
-        if (event.type == ButtonPress)
+        // The render conf of a page as wide as it is at the requested dpi,
+        // then zoomed as in the viewer.
+        double width, height;
+        poppler_page_get_size(st.page, &width, &height);
+        if (st.rotation % 180 != 0) {
+            double temp = width;
+            width = height;
+            height = temp;
+        }
+        Rectangle area = {0, 0, (int)lround(width * args->dpi / 72.0),
+            (int)lround(height * args->dpi / 72.0)};
+        PdfRenderConf prc = get_pdf_render_conf(false, false, 0, area, st.page,
+            false, (Rectangle){0, 0, 0, 0}, st.rotation, args->zoom);
+        cairo_surface_t *image = render_pdf_page_to_image(&st, &prc);
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), args->export_pattern, page_num);
+        bool ok = ppm ? write_ppm(image, path)
+                      : cairo_surface_write_to_png(image, path) == CAIRO_STATUS_SUCCESS;
+        if (!ok)
         {
-            int button = event.xbutton.button;
-            unsigned int state = event.xbutton.state;
+            fprintf(stderr, "Cannot write %s.\n", path);
+            g_atomic_int_set(&job->failed, 1);
+        }
 
-            if ((state & ControlMask) && (button == Button4 || button == Button5))
-            {
-                double zoom_factor = (button == Button4) ? zoom_step : 1.0 / zoom_step;
-                double old_zoom = st.zoom_level;
-                st.zoom_level *= zoom_factor;
-                st.zoom_level = fmax(min_zoom, fmin(max_zoom, st.zoom_level));
-                st.fit_page = false;
-
-                // Calculate the mouse position relative to the PDF
-                double mouse_x = (event.xbutton.x - st.pdf_pos.x) / (double)st.pdf_pos.width;
-                double mouse_y = (event.xbutton.y - st.pdf_pos.y) / (double)st.pdf_pos.height;
-
-                // Calculate new PDF dimensions
-                double new_width = st.pdf_pos.width * (st.zoom_level / old_zoom);
-                double new_height = st.pdf_pos.height * (st.zoom_level / old_zoom);
-
-                // Calculate new PDF position to keep the mouse point stationary
-                st.pdf_pos.x = event.xbutton.x - mouse_x * new_width;
-                st.pdf_pos.y = event.xbutton.y - mouse_y * new_height;
-
-                // Ensure the PDF doesn't move out of bounds
-                st.pdf_pos.x = fmin(st.pdf_pos.x, 0);
-                st.pdf_pos.y = fmin(st.pdf_pos.y, 0);
-                st.pdf_pos.x = fmax(st.pdf_pos.x, st.main_pos.width - new_width);
-                st.pdf_pos.y = fmax(st.pdf_pos.y, st.main_pos.height - new_height);
-
-                force_render_page(&st, true);
-            }
-            else if (button == Button4 && st.fit_page && !st.magnifying)
-            {
-                if (st.page_num > 1)
-                {
-                    st.scrolling_up = true;
-                    --st.page_num;
-                    render_page_lambda(&st);
-                }
-            }
-            else if (button == Button5 && st.fit_page && !st.magnifying)
-            {
-                if (st.page_num < st.total_pages)
-                {
-                    ++st.page_num;
-                    render_page_lambda(&st);
-                }
-            }
-            else if (button == Button4 && !st.fit_page)
-            {
-                int diff = get_pdf_scroll_diff(&st, mouse_scroll);
-                if (diff != 0)
-                {
-                    st.pdf_pos.y += diff;
-                    force_render_page(&st, false);
-                }
-                else {
-                    if (st.page_num > 1 && !st.magnifying)
-                    {
-                        st.scrolling_up = true;
-                        --st.page_num;
-                        render_page_lambda(&st);
-                    }
-                }
-            }
-            else if (button == Button5 && !st.fit_page)
-            {
-                int diff = get_pdf_scroll_diff(&st, -mouse_scroll);
-                if (diff != 0)
-                {
-                    st.pdf_pos.y += diff;
-                    force_render_page(&st, false);
-                }
-                else {
-                    if (st.page_num < st.total_pages && !st.magnifying)
-                    {
-                        ++st.page_num;
-                        render_page_lambda(&st);
-                    }
-                }
-            }
-            else if (button == Button1 && !st.magnifying)
+        cairo_surface_destroy(image);
+        g_object_unref(st.page);
+        if (++rendered % 16 == 0)
+            doc_trim(doc);
+    }
+
+    g_object_unref(doc);
+    return NULL;
+}
+
+// --export: renders the selected pages to image files on all cores, without
+// an X display, and reports the throughput.
+static int export_pages(const Args *args)
+{
+    if (!valid_export_pattern(args->export_pattern)) {
+        fprintf(stderr, "The --export pattern needs one page number conversion like %%04d.\n");
+        return 1;
+    }
+
+    ExportJob job = {args, NULL, 0, 0, 0};
+    int *pages = selected_pages(args, &job.count);
+    if (pages == NULL)
+        return 1;
+    job.pages = pages;
+
+    int nthreads = export_threads > 0 ? export_threads : (int)g_get_num_processors();
+    if (nthreads > job.count)
+        nthreads = job.count;
+
+    gint64 start = g_get_monotonic_time();
+    GThread **threads = calloc(nthreads, sizeof(GThread *));
+    for (int i = 0; i < nthreads; ++i)
+        threads[i] = g_thread_new("export", export_thread, &job);
+    for (int i = 0; i < nthreads; ++i)
+        g_thread_join(threads[i]);
+    double seconds = (g_get_monotonic_time() - start) / 1e6;
+
+    fprintf(stderr, "Exported %d pages in %.2f s, %.1f pages/s on %d threads.\n",
+        job.count, seconds, seconds > 0 ? job.count / seconds : 0.0, nthreads);
+
+    free(threads);
+    free(pages);
+    return job.failed ? 1 : 0;
+}
+
+// --dump-text: writes the text of the selected pages to stdout, in order.
+static int dump_text(const Args *args)
+{
+    int count;
+    int *pages = selected_pages(args, &count);
+    if (pages == NULL)
+        return 1;
+
+    static char buf[1 << 20];
+    setvbuf(stdout, buf, _IOFBF, sizeof(buf));
+    int ret = text_dump(args->fname, pages, count, args->json ? TEXT_DUMP_JSON : TEXT_DUMP_PLAIN,
+        args->form_feed, dump_text_threads, stdout);
+    if (ret != 0)
+        fprintf(stderr, "Error extracting text from %s.\n", args->fname);
+
+    free(pages);
+    return ret;
+}
+
+static bool is_page_nav(Action a)
+{
+    return a == NEXT || a == PREV || a == PG_DOWN || a == PG_UP;
+}
+
+static bool is_scroll_nav(Action a)
+{
+    return a == DOWN || a == UP;
+}
+
+static int nav_direction(Action a)
+{
+    return (a == NEXT || a == PG_DOWN || a == DOWN) ? 1 : -1;
+}
+
+// Folds auto-repeated navigation keys waiting at the head of the X queue into
+// one net step count, so a slow page is rendered once instead of once per
+// repeat.  For page navigation st->page_num follows the keys and the status
+// bar is redrawn so the counter keeps moving; the caller does the render.
+static int coalesce_nav_keys(AppState *st, Action action)
+{
+    bool page_nav = is_page_nav(action);
+    int steps = nav_direction(action);
+
+    // Only the keys at the head of the queue: whatever came in between, a
+    // click, an exposure or another window's event, must still be handled
+    // in the order it arrived, so the first of those ends the run.
+    XEvent next;
+    while (XPending(st->display))
+    {
+        XPeekEvent(st->display, &next);
+        if ((next.type != KeyPress && next.type != KeyRelease) ||
+            next.xkey.window != st->main)
+            break;
+
+        KeySym ksym;
+        XLookupString(&next.xkey, NULL, 0, &ksym, NULL);
+        const Shortcut *sc = find_shortcut(next.xkey.state, ksym);
+        if (sc == NULL || (page_nav ? !is_page_nav(sc->action) : !is_scroll_nav(sc->action)))
+            break;
+
+        XNextEvent(st->display, &next);
+        // Auto-repeat sends a release before each press, should the window
+        // ever select releases.
+        if (next.type == KeyRelease)
+            continue;
+
+        steps += nav_direction(sc->action);
+        if (page_nav)
+        {
+            int page = st->page_num + nav_direction(sc->action);
+            if (page >= 1 && page <= st->total_pages)
+                st->page_num = page;
+            if (st->show_status_bar)
             {
-                if (event.xbutton.x >= st.pdf_pos.x &&
-                    event.xbutton.y >= st.pdf_pos.y &&
-                    event.xbutton.x <= st.pdf_pos.x + st.pdf_pos.width &&
-                    event.xbutton.y <= st.pdf_pos.y + st.pdf_pos.height)
-                {
-                    if (find_page_link(&st, &event.xbutton))
-                    {
-                        render_page_lambda(&st);
-                    }
-                    else {
-                        CoordConv cc = coord_conv_create(st.page, &st.pdf_pos, false, st.rotation);
-                        st.selection = coord_conv_to_screen(&cc, &st.pdf_selection);
-
-                        Rectangle padded = rectangle_normalize(&st.selection);
-                        padded.x -= 5;
-                        padded.y -= 5;
-                        padded.width += 10;
-                        padded.height += 10;
-                        send_expose(&st, &padded);
-
-                        st.selection = (Rectangle){event.xbutton.x, event.xbutton.y, 0, 0};
-                        st.selecting = true;
-                    }
-                }
+                draw_status_bar(st);
+                XFlush(st->display);
             }
         }
+    }
 
-        if (event.type == ButtonRelease && event.xbutton.button == Button1)
-        {
-            if (st.selecting)
-            {
-                st.selection.width = event.xbutton.x - st.selection.x;
-                st.selection.height = event.xbutton.y - st.selection.y;
+    return steps;
+}
+
+static void render_page_lambda(AppState *st) {
+    if (st->page) {
+        g_object_unref(st->page);
+    }
+    st->page = poppler_document_get_page(st->doc, st->page_num - 1);
+    if (!st->page) {
+        char error_msg[100];
+        snprintf(error_msg, sizeof(error_msg), "Cannot create page: %d.", st->page_num);
+        print_error(error_msg);
+    }
+    
+    if (st->two_page_view && st->page_num < st->total_pages) {
+        if (st->second_page) {
+            g_object_unref(st->second_page);
+        }
+        st->second_page = poppler_document_get_page(st->doc, st->page_num);
+    } else {
+        if (st->second_page) {
+            g_object_unref(st->second_page);
+            st->second_page = NULL;
+        }
+    }
+    
+    force_render_page(st, true);
+    st->selection = (Rectangle){0, 0, 0, 0};
+    st->pdf_selection = (Rectangle){0, 0, 0, 0};
+    st->sel_rects.size = 0;
+    st->selecting = false;
+}
 
-                CoordConv cc = coord_conv_create(st.page, &st.pdf_pos, false, st.rotation);
-                Rectangle normalized = rectangle_normalize(&st.selection);
-                st.pdf_selection = coord_conv_to_pdf(&cc, &normalized);
-                st.selecting = false;
+#define OVERVIEW_GAP 12
 
-                copy_text(&st, true);
-            }
+typedef struct {
+    int cols;
+    int cell_w, cell_h;
+    int rows;       // of the whole document
+    int max_y;      // largest scroll offset
+} OverviewLayout;
+
+// Grid cells fit a portrait page; taller pages are scaled down into them.
+static OverviewLayout overview_layout(const AppState *st)
+{
+    OverviewLayout l;
+    l.cell_w = thumbnail_width + OVERVIEW_GAP;
+    l.cell_h = thumbnail_width * 3 / 2 + OVERVIEW_GAP;
+    l.cols = (st->main_pos.width - OVERVIEW_GAP) / l.cell_w;
+    if (l.cols < 1)
+        l.cols = 1;
+    l.rows = (st->total_pages + l.cols - 1) / l.cols;
+    int height = st->main_pos.height - (st->show_status_bar ? st->status_pos.height : 0);
+    l.max_y = l.rows * l.cell_h + OVERVIEW_GAP - height;
+    if (l.max_y < 0)
+        l.max_y = 0;
+    return l;
+}
+
+static void overview_scroll_to(AppState *st, int y)
+{
+    OverviewLayout l = overview_layout(st);
+    st->overview_y = y < 0 ? 0 : y > l.max_y ? l.max_y : y;
+    send_expose(st, &(Rectangle){0, 0, st->main_pos.width, st->main_pos.height});
+}
+
+// Scrolls just enough to bring the current page into view.
+static void overview_show_current(AppState *st)
+{
+    OverviewLayout l = overview_layout(st);
+    int height = st->main_pos.height - (st->show_status_bar ? st->status_pos.height : 0);
+    int top = (st->page_num - 1) / l.cols * l.cell_h;
+    int y = st->overview_y;
+    if (top < y)
+        y = top;
+    else if (top + l.cell_h + OVERVIEW_GAP > y + height)
+        y = top + l.cell_h + OVERVIEW_GAP - height;
+    overview_scroll_to(st, y);
+}
+
+static void draw_overview(AppState *st)
+{
+    OverviewLayout l = overview_layout(st);
+    int width = st->main_pos.width, height = st->main_pos.height;
+    if (width <= 0 || height <= 0)
+        return;
+    if (st->overview_y > l.max_y)
+        st->overview_y = l.max_y;
+
+    int first = st->overview_y / l.cell_h * l.cols + 1;
+    int last = ((st->overview_y + height) / l.cell_h + 1) * l.cols;
+    if (last > st->total_pages)
+        last = st->total_pages;
+    // A screenful ahead and behind, for scrolling.
+    if (st->thumbs == NULL)
+        st->thumbs = new_thumb_cache(st);  // given up while the window was hidden
+    thumb_cache_request(st->thumbs, first, last, last - first + 1);
+
+    Pixmap back = XCreatePixmap(st->display, st->main, width, height,
+        DefaultDepth(st->display, DefaultScreen(st->display)));
+    XColor bg;
+    XAllocNamedColor(st->display, DefaultColormap(st->display, DefaultScreen(st->display)),
+        bg_color, &bg, &bg);
+    XSetForeground(st->display, st->status_gc, bg.pixel);
+    XFillRectangle(st->display, back, st->status_gc, 0, 0, width, height);
+
+    cairo_surface_t *surface = cairo_xlib_surface_create(st->display, back,
+        DefaultVisual(st->display, DefaultScreen(st->display)), width, height);
+    cairo_t *cr = cairo_create(surface);
+    int x0 = (width - l.cols * l.cell_w + OVERVIEW_GAP) / 2;
+    for (int p = first; p <= last; ++p)
+    {
+        int x = x0 + (p - 1) % l.cols * l.cell_w;
+        int y = OVERVIEW_GAP + (p - 1) / l.cols * l.cell_h - st->overview_y;
+        int w = thumbnail_width, h = l.cell_h - OVERVIEW_GAP;
+
+        cairo_surface_t *thumb = thumb_cache_get(st->thumbs, p);
+        if (thumb)
+        {
+            int tw = cairo_image_surface_get_width(thumb);
+            int th = cairo_image_surface_get_height(thumb);
+            double scale = th > h ? (double)h / th : 1.0;
+            w = tw * scale;
+            h = th * scale;
+            x += (thumbnail_width - w) / 2;
+            cairo_save(cr);
+            cairo_translate(cr, x, y);
+            cairo_scale(cr, scale, scale);
+            cairo_set_source_surface(cr, thumb, 0, 0);
+            cairo_paint(cr);
+            cairo_restore(cr);
+        }
+        else
+        {
+            // Not rendered yet.
+            cairo_set_source_rgb(cr, 0.5, 0.5, 0.5);
+            cairo_rectangle(cr, x, y, w, h);
+            cairo_fill(cr);
         }
 
-        if (event.type == MotionNotify && st.selecting)
+        if (p == st->page_num)
         {
-            Rectangle pr = rectangle_normalize(&st.selection);
+            cairo_set_source_rgb(cr, (selection_color >> 16 & 0xff) / 255.0,
+                (selection_color >> 8 & 0xff) / 255.0, (selection_color & 0xff) / 255.0);
+            cairo_set_line_width(cr, 3);
+            cairo_rectangle(cr, x - 3, y - 3, w + 6, h + 6);
+            cairo_stroke(cr);
+        }
+    }
+    cairo_destroy(cr);
+    cairo_surface_destroy(surface);
 
-            st.selection.width = event.xbutton.x - st.selection.x;
-            st.selection.height = event.xbutton.y - st.selection.y;
+    XCopyArea(st->display, back, st->main, st->status_gc, 0, 0, width, height, 0, 0);
+    XFreePixmap(st->display, back);
+    if (st->show_status_bar)
+        draw_status_bar(st);
+}
 
-            Rectangle nr = rectangle_normalize(&st.selection);
+static void toggle_overview(AppState *st, bool pick)
+{
+    st->overview = !st->overview;
+    if (st->overview)
+    {
+        if (st->thumbs == NULL)
+            st->thumbs = new_thumb_cache(st);
+        st->overview_page = st->page_num;
+        overview_show_current(st);
+        return;
+    }
 
-            RectangleArray diff1 = rectangle_subtract(&pr, &nr);
-            RectangleArray diff2 = rectangle_subtract(&nr, &pr);
+    if (!pick)
+        st->page_num = st->overview_page;
+    XClearWindow(st->display, st->main);
+    if (st->page_num != st->overview_page)
+        render_page_lambda(st);
+    else
+        force_render_page(st, false);
+}
 
-            for (int i = 0; i < diff1.size; i++)
-                send_expose(&st, &diff1.rectangles[i]);
-            for (int i = 0; i < diff2.size; i++)
-                send_expose(&st, &diff2.rectangles[i]);
+// Events while the overview is up; returns false for those left to the
+// normal handling (resizes, the clipboard, quitting).
+static bool handle_overview_event(AppState *st, XEvent *e)
+{
+    OverviewLayout l = overview_layout(st);
+    int height = st->main_pos.height - (st->show_status_bar ? st->status_pos.height : 0);
 
-            free(diff1.rectangles);
-            free(diff2.rectangles);
+    switch (e->type)
+    {
+        case Expose:
+        {
+            XEvent next;
+            while (XCheckTypedWindowEvent(st->display, st->main, Expose, &next))
+                ;
+            draw_overview(st);
+            return true;
         }
-
-        if (event.type == SelectionRequest)
+        case KeyPress:
         {
-            Atom targets_atom = XInternAtom(st.display, "TARGETS", False);
-            Atom utf8_string_atom = XInternAtom(st.display, "UTF8_STRING", False);
-            Atom clipboard_atom = XInternAtom(st.display, "CLIPBOARD", False);
+            if (st->status)
+                return false;
+            KeySym ksym;
+            XLookupString(&e->xkey, NULL, 0, &ksym, NULL);
+            int rows = height / l.cell_h > 1 ? height / l.cell_h : 1;
+            int page = st->page_num;
+            switch (ksym)
+            {
+                case XK_Escape:
+                case XK_o:
+                    toggle_overview(st, false);
+                    return true;
+                case XK_Return:
+                    toggle_overview(st, true);
+                    return true;
+                case XK_Left:      page -= 1; break;
+                case XK_Right:     page += 1; break;
+                case XK_Up:        page -= l.cols; break;
+                case XK_Down:      page += l.cols; break;
+                case XK_Page_Up:   page -= rows * l.cols; break;
+                case XK_Page_Down: page += rows * l.cols; break;
+                case XK_Home:      page = 1; break;
+                case XK_End:       page = st->total_pages; break;
+                default:
+                {
+                    const Shortcut *sc = find_shortcut(e->xkey.state, ksym);
+                    return sc != NULL && sc->action != QUIT;
+                }
+            }
+            st->page_num = page < 1 ? 1 : page > st->total_pages ? st->total_pages : page;
+            overview_show_current(st);
+            return true;
+        }
+        case ButtonPress:
+            if (e->xbutton.button == Button4 || e->xbutton.button == Button5)
+            {
+                int step = e->xbutton.button == Button4 ? -l.cell_h / 2 : l.cell_h / 2;
+                overview_scroll_to(st, st->overview_y + step);
+            }
+            else if (e->xbutton.button == Button1)
+            {
+                int x0 = (st->main_pos.width - l.cols * l.cell_w + OVERVIEW_GAP) / 2;
+                int col = (e->xbutton.x - x0) / l.cell_w;
+                int row = (e->xbutton.y + st->overview_y - OVERVIEW_GAP) / l.cell_h;
+                int page = row * l.cols + col + 1;
+                if (e->xbutton.x >= x0 && col < l.cols && page >= 1 && page <= st->total_pages)
+                {
+                    st->page_num = page;
+                    toggle_overview(st, true);
+                }
+            }
+            return true;
+        case ButtonRelease:
+        case MotionNotify:
+            return true;
+    }
+    return false;
+}
+
+// Shows the first outline entry from index from on matching the outline
+// prompt.  The view before the first jump goes on the page stack, for
+// Escape and back (b) to return to.
+static void jump_to_outline(AppState *st, int from)
+{
+    int i = doc_index_find_outline(st->structure, st->value, from);
+    const OutlineEntry *e = doc_index_outline(st->structure, i);
+    if (e == NULL || e->page < 1 || e->page > st->total_pages)
+        return;
+
+    if (st->outline_pos < 0)
+        push_page_stack(st, st->page_num);
+    st->outline_pos = i;
+    st->page_num = e->page;
+    if (e->top >= 0)
+        st->next_pos_y = -(int)lround(e->top * st->pdf_scale);
+    render_page_lambda(st);
+}
 
-            XSelectionRequestEvent xselreq = event.xselectionrequest;
+// Handles one X event for the window of st; false once the window is closed.
+static bool handle_event(AppState *st, XEvent *event)
+{
+    if (st->overview && handle_overview_event(st, event))
+        return true;
 
-            XEvent e;
-            e.type = SelectionNotify;
-            e.xselection.requestor = xselreq.requestor;
-            e.xselection.selection = xselreq.selection;
-            e.xselection.target = xselreq.target;
-            e.xselection.time = xselreq.time;
-            e.xselection.property = None;
+    if (event->type == KeyPress)
+        clear_confirm_link(st);
 
-            if (xselreq.target == targets_atom)
+    if (event->type == Expose)
+    {
+        Rectangle prev = st->pdf_pos;
+        if (st->pdf == None)
+        {
+            PdfRenderConf prc = get_pdf_render_conf(st->fit_page, st->scrolling_up,
+                st->next_pos_y, st->main_pos, st->page, st->magnifying, st->magnify,
+                st->rotation, st->zoom_level);
+            st->scrolling_up = false;
+            st->next_pos_y   = 0;
+
+            // A reload keeps the scroll position, within the new page.
+            if (st->keep_pdf_pos)
             {
-                XChangeProperty(xselreq.display, xselreq.requestor,
-                    xselreq.property, XA_ATOM, 32, PropModeReplace,
-                    (unsigned char*)&utf8_string_atom, 1);
-                e.xselection.property = xselreq.property;
+                if (prc.pos.width > st->main_pos.width)
+                    prc.pos.x = fmin(0, fmax(st->main_pos.width - prc.pos.width, prev.x));
+                if (prc.pos.height > st->main_pos.height)
+                    prc.pos.y = fmin(0, fmax(st->main_pos.height - prc.pos.height, prev.y));
+                st->keep_pdf_pos = false;
             }
 
-            if (xselreq.target == utf8_string_atom || xselreq.target == XA_STRING)
+            st->pdf = render_pdf_page_to_pixmap(st, &prc);
+            st->pdf_pos = prc.pos;
+            st->pdf_crop = prc.crop;
+            st->pdf_scale = prc.dpi / 72.0;
+            if (st->large_file)
+                doc_trim(st->doc);
+        }
+        copy_pixmap_on_expose_event(st, &prev, &event->xexpose);
+        
+        if (st->show_status_bar) {
+            draw_status_bar(st);
+        }
+
+        // Whole-document work starts once the first page is up.
+        if (!st->first_paint_done && st->pdf != None)
+        {
+            st->first_paint_done = true;
+            XFlush(st->display);
+            report_startup(st, "first page painted");
+
+            if (enable_text_index && !st->large_file)
+                st->index = text_index_new(st->file_name, st->total_pages, persist_text_index);
+            st->inc_search = inc_search_new(st->index, st->wake_pipe[1], incremental_search_delay_ms);
+            if (enable_structure_index)
+                st->structure = doc_index_new(st->file_name, st->wake_pipe[1]);
+        }
+    }
+
+    if (event->type == ConfigureNotify)
+    {
+        if (st->main_pos.width != event->xconfigure.width ||
+            st->main_pos.height != event->xconfigure.height)
+        {
+            st->main_pos = (Rectangle){
+                event->xconfigure.x,
+                event->xconfigure.y,
+                event->xconfigure.width,
+                event->xconfigure.height
+            };
+
+            XClearWindow(st->display, st->main);
+            if (st->pdf != None)
             {
-                char *ptr = NULL;
-                if (xselreq.selection == XA_PRIMARY)
-                    ptr = st.primary;
-                if (xselreq.selection == clipboard_atom)
-                    ptr = st.clipboard;
-
-                if (ptr) {
-                    XChangeProperty(xselreq.display, xselreq.requestor,
-                        xselreq.property, xselreq.target, 8, PropModeReplace,
-                        (const unsigned char*)ptr, strlen(ptr));
-                    e.xselection.property = xselreq.property;
-                }
+                XFreePixmap(st->display, st->pdf);
+                st->pdf = None;
             }
 
-            XSendEvent(xselreq.display, xselreq.requestor, True, 0, &e);
+            st->status_pos = get_status_pos(st);
         }
     }
-endloop:
-    cleanup_x(&st);
-    g_object_unref(st.doc);
-    free(st.page_stack);
-    free(st.primary);
-    free(st.clipboard);
-    free(st.file_name);
-    free(args.fname);
-    return 0;
+
+    if (event->type == ClientMessage)
+    {
+        Atom xembed_atom = XInternAtom(st->display, "_XEMBED", False);
+        Atom wmdel_atom  = XInternAtom(st->display, "WM_DELETE_WINDOW", False);
+
+        if (event->xclient.message_type == xembed_atom && event->xclient.format == 32)
+        {
+            if (!st->xembed_init)
+            {
+                force_render_page(st, true);
+                st->xembed_init = true;
+            }
+        }
+        else if (event->xclient.data.l[0] == (long)wmdel_atom)
+        {
+            return false;
+        }
+    }
+
+    if (event->type == KeyPress)
+    {
+        KeySym ksym;
+        char buf[32];
+        XLookupString(&event->xkey, buf, sizeof buf, &ksym, NULL);
+
+        bool status = st->status;
+        if (!status)
+        {
+            for (size_t i = 0; i < sizeof(shortcuts)/sizeof(shortcuts[0]); ++i)
+            {
+                const Shortcut *sc = &shortcuts[i];
+                if ((sc->mask == AnyMask || sc->mask == event->xkey.state) &&
+                    sc->ksym == ksym)
+                {
+                    switch (sc->action)
+                    {
+                        case QUIT:
+                            return false;
+                        case FIT_PAGE:
+                            if (!st->fit_page) {
+                                st->fit_page = true;
+                                force_render_page(st, true);
+                            }
+                            break;
+                        case FIT_WIDTH:
+                            if (st->fit_page) {
+                                st->fit_page = false;
+                                force_render_page(st, true);
+                            }
+                            break;
+                        case NEXT:
+                        case PG_DOWN:
+                        case PREV:
+                        case PG_UP: {
+                            int prev_page = st->page_num;
+                            int page = st->page_num + nav_direction(sc->action);
+                            if (page >= 1 && page <= st->total_pages)
+                                st->page_num = page;
+                            coalesce_nav_keys(st, sc->action);
+                            if (st->page_num != prev_page) {
+                                render_page_lambda(st);
+                            }
+                            break;
+                        }
+                        case FIRST:
+                            st->page_num = 1;
+                            render_page_lambda(st);
+                            break;
+                        case LAST:
+                            st->page_num = st->total_pages;
+                            render_page_lambda(st);
+                            break;
+                        case DOWN:
+                        case UP: {
+                            int steps = coalesce_nav_keys(st, sc->action);
+                            if (!st->fit_page) {
+                                int diff = get_pdf_scroll_diff(st, -arrow_scroll * steps);
+                                if (diff != 0) {
+                                    st->pdf_pos.y += diff;
+                                    force_render_page(st, false);
+                                }
+                            }
+                            break;
+                        }
+                        case BACK:
+                            if (st->page_stack_size > 0) {
+                                PageAndOffset elem = st->page_stack[--st->page_stack_size];
+                                st->page_num = elem.page;
+                                st->next_pos_y = elem.offset;
+                                render_page_lambda(st);
+                            }
+                            break;
+                        case RELOAD:
+                            // The old render stays up while the file is parsed.
+                            start_reload(st);
+                            break;
+                        case COPY:
+                            if (st->pdf_selection.width > 0 && st->pdf_selection.height > 0) {
+                                copy_text(st, false);
+                            }
+                            break;
+                        case COPY_PAGE:
+                            start_text_copy(st, st->page_num, st->page_num);
+                            break;
+                        case COPY_DOCUMENT:
+                            start_text_copy(st, 1, st->total_pages);
+                            break;
+                        case GOTO_PAGE:
+                            st->status = true;
+                            st->input = true;
+                            snprintf(st->prompt, sizeof(st->prompt), "goto page [1, %d]: ", st->total_pages);
+                            st->value[0] = '\0';
+                            send_expose(st, &st->status_pos);
+                            break;
+                        case OUTLINE:
+                            if (doc_index_outline_size(st->structure) == 0) {
+                                print_error(doc_index_ready(st->structure) ?
+                                    "The document has no outline." : "The outline is not read yet.");
+                                break;
+                            }
+                            st->status = true;
+                            st->input = true;
+                            strcpy(st->prompt, "outline: ");
+                            st->value[0] = '\0';
+                            st->outline_pos = -1;
+                            send_expose(st, &st->status_pos);
+                            break;
+                        case SEARCH:
+                            st->status = true;
+                            st->input = true;
+                            strcpy(st->prompt, "search: ");
+                            st->value[0] = '\0';
+                            st->search_origin = st->page_num;
+                            send_expose(st, &st->status_pos);
+                            break;
+                        case PAGE:
+                            st->status = true;
+                            st->input = false;
+                            snprintf(st->prompt, sizeof(st->prompt), "page %d/%d", st->page_num, st->total_pages);
+                            st->value[0] = '\0';
+                            send_expose(st, &st->status_pos);
+                            break;
+                        case MAGNIFY:
+                            if (st->pdf_selection.width > 0 && st->pdf_selection.height > 0) {
+                                st->magnifying = true;
+                                st->magnify = st->pdf_selection;
+                                clear_glyph_selection(st);
+                                st->selection = (Rectangle){0, 0, 0, 0};
+                                st->pdf_selection = (Rectangle){0, 0, 0, 0};
+                                st->status = true;
+                                st->input = false;
+                                strcpy(st->prompt, "magnify");
+                                st->value[0] = '\0';
+                                st->pre_mag_y = st->pdf_pos.y;
+                                st->pdf_pos.y = 0;
+                                force_render_page(st, true);
+                            }
+                            break;
+                        case ROTATE_CW:
+                            st->rotation = (st->rotation + 90) % 360;
+                            force_render_page(st, true);
+                            break;
+                        case ROTATE_CCW:
+                            st->rotation = (st->rotation - 90 + 360) % 360;
+                            force_render_page(st, true);
+                            break;
+                        case ZOOM_IN:
+                            st->zoom_level *= zoom_step;
+                            st->fit_page = false;
+                            force_render_page(st, true);
+                            break;
+                        case ZOOM_OUT:
+                            st->zoom_level /= zoom_step;
+                            st->fit_page = false;
+                            force_render_page(st, true);
+                            break;
+                        case TOGGLE_TWO_PAGE_VIEW:
+                            st->two_page_view = !st->two_page_view;
+                            render_page_lambda(st);
+                            break;
+                        case TOGGLE_CONTINUOUS_MODE:
+                            st->continuous_mode = !st->continuous_mode;
+                            force_render_page(st, true);
+                            break;
+                        case TOGGLE_STATUS_BAR:
+                            st->show_status_bar = !st->show_status_bar;
+                            force_render_page(st, true);
+                            break;
+                        case NEXT_MATCH:
+                            step_match(st, true);
+                            break;
+                        case PREV_MATCH:
+                            step_match(st, false);
+                            break;
+                        case TOGGLE_DARK_MODE:
+                            st->dark_mode = !st->dark_mode;
+                            force_render_page(st, true);
+                            break;
+                        case OVERVIEW:
+                            toggle_overview(st, false);
+                            break;
+                    }
+                }
+            }
+        }
+
+        if (status)
+        {
+            if (ksym == XK_Escape)
+            {
+                st->status = false;
+                st->searching = false;
+                if (st->inc_search)
+                    inc_search_cancel(st->inc_search);
+                if (strncmp(st->prompt, "outline", 7) == 0 && st->outline_pos >= 0)
+                {
+                    PageAndOffset elem = st->page_stack[--st->page_stack_size];
+                    st->page_num = elem.page;
+                    st->next_pos_y = elem.offset;
+                    render_page_lambda(st);
+                }
+                XClearArea(st->display, st->main,
+                    st->status_pos.x, st->status_pos.y,
+                    st->status_pos.width, st->status_pos.height, True);
+
+                if (st->magnifying)
+                {
+                    st->magnifying = false;
+                    st->next_pos_y = st->pre_mag_y;
+                    force_render_page(st, true);
+                }
+            }
+
+            if (ksym == XK_BackSpace)
+            {
+                if (strlen(st->value) > 0)
+                {
+                    st->value[strlen(st->value) - 1] = '\0';
+                    XClearArea(st->display, st->main,
+                        st->status_pos.x, st->status_pos.y,
+                        st->status_pos.width, st->status_pos.height, True);
+                    if (strncmp(st->prompt, "search", 6) == 0)
+                        update_incremental_search(st);
+                    if (strncmp(st->prompt, "outline", 7) == 0)
+                        jump_to_outline(st, 0);
+                }
+            }
+
+            // Tab moves on to the next outline entry matching the prefix.
+            if (ksym == XK_Tab && strncmp(st->prompt, "outline", 7) == 0)
+                jump_to_outline(st, st->outline_pos + 1);
+
+            if (ksym == XK_Return)
+            {
+                if (strncmp(st->prompt, "goto", 4) == 0)
+                {
+                    // Page labels ("xii", "A-3") first, then physical numbers.
+                    int page = doc_index_label_page(st->structure, st->value);
+                    if (page == 0)
+                        page = atoi(st->value);
+                    if (page >= 1 && page <= st->total_pages)
+                    {
+                        st->status = false;
+                        st->page_num = page;
+
+                        XClearArea(st->display, st->main,
+                            st->status_pos.x, st->status_pos.y,
+                            st->status_pos.width, st->status_pos.height, True);
+                        render_page_lambda(st);
+                    }
+                }
+
+                if (strncmp(st->prompt, "outline", 7) == 0)
+                {
+                    st->status = false;
+                    XClearArea(st->display, st->main,
+                        st->status_pos.x, st->status_pos.y,
+                        st->status_pos.width, st->status_pos.height, True);
+                }
+
+                if (strncmp(st->prompt, "search", 6) == 0)
+                {
+                    if (st->inc_search)
+                        inc_search_cancel(st->inc_search);
+                    Rectangle normalized = rectangle_normalize(&st->selection);
+                    send_expose(st, &normalized);
+                    search_text(st);
+                    normalized = rectangle_normalize(&st->selection);
+                    send_expose(st, &normalized);
+                }
+            }
+
+            if (st->input)
+            {
+                if (strlen(buf) > 0 && !iscntrl((unsigned char)buf[0]))
+                {
+                    strcat(st->value, buf);
+                    send_expose(st, &st->status_pos);
+                    if (strncmp(st->prompt, "search", 6) == 0)
+                        update_incremental_search(st);
+                    if (strncmp(st->prompt, "outline", 7) == 0)
+                        jump_to_outline(st, 0);
+                }
+            }
+        }
+    }
+
+    if (event->type == ButtonPress)
+    {
+        int button = event->xbutton.button;
+        unsigned int state = event->xbutton.state;
+
+        if ((state & ControlMask) && (button == Button4 || button == Button5))
+        {
+            double zoom_factor = (button == Button4) ? zoom_step : 1.0 / zoom_step;
+            double old_zoom = st->zoom_level;
+            st->zoom_level *= zoom_factor;
+            st->zoom_level = fmax(min_zoom, fmin(max_zoom, st->zoom_level));
+            st->fit_page = false;
+
+            // Calculate the mouse position relative to the PDF
+            double mouse_x = (event->xbutton.x - st->pdf_pos.x) / (double)st->pdf_pos.width;
+            double mouse_y = (event->xbutton.y - st->pdf_pos.y) / (double)st->pdf_pos.height;
+
+            // Calculate new PDF dimensions
+            double new_width = st->pdf_pos.width * (st->zoom_level / old_zoom);
+            double new_height = st->pdf_pos.height * (st->zoom_level / old_zoom);
+
+            // Calculate new PDF position to keep the mouse point stationary
+            st->pdf_pos.x = event->xbutton.x - mouse_x * new_width;
+            st->pdf_pos.y = event->xbutton.y - mouse_y * new_height;
+
+            // Ensure the PDF doesn't move out of bounds
+            st->pdf_pos.x = fmin(st->pdf_pos.x, 0);
+            st->pdf_pos.y = fmin(st->pdf_pos.y, 0);
+            st->pdf_pos.x = fmax(st->pdf_pos.x, st->main_pos.width - new_width);
+            st->pdf_pos.y = fmax(st->pdf_pos.y, st->main_pos.height - new_height);
+
+            force_render_page(st, true);
+        }
+        else if (button == Button4 && st->fit_page && !st->magnifying)
+        {
+            if (st->page_num > 1)
+            {
+                st->scrolling_up = true;
+                --st->page_num;
+                render_page_lambda(st);
+            }
+        }
+        else if (button == Button5 && st->fit_page && !st->magnifying)
+        {
+            if (st->page_num < st->total_pages)
+            {
+                ++st->page_num;
+                render_page_lambda(st);
+            }
+        }
+        else if (button == Button4 && !st->fit_page)
+        {
+            int diff = get_pdf_scroll_diff(st, mouse_scroll);
+            if (diff != 0)
+            {
+                st->pdf_pos.y += diff;
+                force_render_page(st, false);
+            }
+            else {
+                if (st->page_num > 1 && !st->magnifying)
+                {
+                    st->scrolling_up = true;
+                    --st->page_num;
+                    render_page_lambda(st);
+                }
+            }
+        }
+        else if (button == Button5 && !st->fit_page)
+        {
+            int diff = get_pdf_scroll_diff(st, -mouse_scroll);
+            if (diff != 0)
+            {
+                st->pdf_pos.y += diff;
+                force_render_page(st, false);
+            }
+            else {
+                if (st->page_num < st->total_pages && !st->magnifying)
+                {
+                    ++st->page_num;
+                    render_page_lambda(st);
+                }
+            }
+        }
+        else if (button == Button1 && !st->magnifying)
+        {
+            if (event->xbutton.x >= st->pdf_pos.x &&
+                event->xbutton.y >= st->pdf_pos.y &&
+                event->xbutton.x <= st->pdf_pos.x + st->pdf_pos.width &&
+                event->xbutton.y <= st->pdf_pos.y + st->pdf_pos.height)
+            {
+                bool moved;
+                if (follow_link(st, event->xbutton.x, event->xbutton.y, &moved))
+                {
+                    if (moved)
+                        render_page_lambda(st);
+                }
+                else {
+                    clear_glyph_selection(st);
+                    CoordConv cc = page_coord_conv(st, false);
+                    st->selection = coord_conv_to_screen(&cc, &st->pdf_selection);
+
+                    Rectangle padded = rectangle_normalize(&st->selection);
+                    padded.x -= 5;
+                    padded.y -= 5;
+                    padded.width += 10;
+                    padded.height += 10;
+                    send_expose(st, &padded);
+
+                    st->selection = (Rectangle){event->xbutton.x, event->xbutton.y, 0, 0};
+                    st->selecting = true;
+                }
+            }
+        }
+    }
+
+    if (event->type == ButtonRelease && event->xbutton.button == Button1)
+    {
+        if (st->selecting)
+        {
+            st->selection.width = event->xbutton.x - st->selection.x;
+            st->selection.height = event->xbutton.y - st->selection.y;
+            update_glyph_selection(st);
+
+            CoordConv cc = page_coord_conv(st, false);
+            Rectangle normalized = rectangle_normalize(&st->selection);
+            st->pdf_selection = coord_conv_to_pdf(&cc, &normalized);
+            st->selecting = false;
+
+            copy_text(st, true);
+        }
+    }
+
+    if (event->type == MotionNotify && !st->selecting)
+    {
+        bool hover = get_link_at(st, event->xmotion.x, event->xmotion.y) != NULL;
+        if (hover != st->link_hover)
+        {
+            XDefineCursor(st->display, st->main, hover ? st->link_cursor : None);
+            st->link_hover = hover;
+        }
+    }
+
+    if (event->type == MotionNotify && st->selecting)
+    {
+        st->selection.width = event->xbutton.x - st->selection.x;
+        st->selection.height = event->xbutton.y - st->selection.y;
+        update_glyph_selection(st);
+    }
+
+    if (event->type == SelectionRequest)
+        selection_request(st->sel, &event->xselectionrequest);
+
+    if (event->type == SelectionClear)
+        selection_clear(st->sel, &event->xselectionclear);
+
+    return true;
+}
+
+static void close_window(AppState *st)
+{
+    text_layout_free(st->layout);
+    free(st->sel_rects.rects);
+    free(st->prev_sel_rects.rects);
+    clear_link_maps(st);
+    free(st->confirm_link);
+    if (st->loader) {
+        PopplerDocument *doc = doc_loader_finish(st->loader, NULL);
+        if (doc)
+            g_object_unref(doc);
+        if (st->reload_check.new_image)
+            cairo_surface_destroy(st->reload_check.new_image);
+    }
+    file_watch_free(st->watch);
+    thumb_cache_free(st->thumbs);
+    if (st->text_copy) {
+        size_t len;
+        text_copy_finish(st->text_copy, true, &len);
+    }
+    selection_free(st->sel);
+    disk_cache_free(st->disk_cache);
+    match_table_free(st->matches);
+    inc_search_free(st->inc_search);
+    page_scanner_forget(st->scanner, st->file_name);
+    text_index_free(st->index);
+    doc_index_free(st->structure);
+    cleanup_x(st);
+    if (st->page)
+        g_object_unref(st->page);
+    if (st->second_page)
+        g_object_unref(st->second_page);
+    if (st->doc)
+        g_object_unref(st->doc);
+    free(st->page_stack);
+    free(st->file_name);
+    close(st->wake_pipe[0]);
+    close(st->wake_pipe[1]);
+    free(st);
+}
+
+// A document the resident server keeps parsed for the next window on the
+// same file, for as long as the file is unchanged.
+typedef struct {
+    char *file_name;
+    PopplerDocument *doc;
+    struct timespec mtime;
+    off_t size;
+    gint64 last_used;
+} SharedDoc;
+
+// The windows of the process, on one display.
+typedef struct {
+    XConn x;
+    AppState **windows;
+    int nwindows;
+    int capacity;
+    int listen_fd;          // resident server socket, -1 otherwise
+    int control_fd;         // --control socket, -1 otherwise
+    ServerClient **clients; // connections to either, until their request is in
+    int nclients;
+    AppState *active;       // last window used, the target of commands
+    SharedDoc *docs;
+    int ndocs;
+    PageScanner *scanner;   // search workers of all windows
+    gint64 budget_checked;  // last enforce_memory_budget() run
+    bool closed_while_loading;  // open_window() failed because it was quit
+    Arena arena;            // temporaries of one event loop iteration
+} Session;
+
+static bool same_file_version(const struct stat *sb, const SharedDoc *d)
+{
+    return sb->st_size == d->size && sb->st_mtim.tv_sec == d->mtime.tv_sec &&
+        sb->st_mtim.tv_nsec == d->mtime.tv_nsec;
+}
+
+static void drop_shared_doc(Session *s, int i)
+{
+    g_object_unref(s->docs[i].doc);
+    free(s->docs[i].file_name);
+    s->docs[i] = s->docs[--s->ndocs];
+}
+
+// A new reference to the parsed document of file_name, if it is unchanged
+// on disk since.
+static PopplerDocument *find_shared_doc(Session *s, const char *file_name)
+{
+    struct stat sb;
+    for (int i = 0; i < s->ndocs; ++i)
+    {
+        if (strcmp(s->docs[i].file_name, file_name) != 0)
+            continue;
+        if (stat(file_name, &sb) != 0 || !same_file_version(&sb, &s->docs[i]))
+        {
+            drop_shared_doc(s, i);
+            return NULL;
+        }
+        s->docs[i].last_used = g_get_monotonic_time();
+        return g_object_ref(s->docs[i].doc);
+    }
+    return NULL;
+}
+
+static void add_shared_doc(Session *s, const char *file_name, PopplerDocument *doc,
+    const struct stat *sb)
+{
+    s->docs = realloc(s->docs, (s->ndocs + 1) * sizeof(SharedDoc));
+    s->docs[s->ndocs++] = (SharedDoc){strdup(file_name), g_object_ref(doc),
+        sb->st_mtim, sb->st_size, g_get_monotonic_time()};
+}
+
+// Whether a window of s, before window number end, shows doc.
+static bool doc_shown(const Session *s, const PopplerDocument *doc, int end)
+{
+    for (int w = 0; w < end; ++w)
+        if (s->windows[w]->doc == doc)
+            return true;
+    return false;
+}
+
+// The least recently opened document that no window shows, or -1; *idle
+// is set to the number of those.
+static int oldest_idle_doc(const Session *s, int *idle)
+{
+    int oldest = -1;
+    *idle = 0;
+    for (int i = 0; i < s->ndocs; ++i)
+    {
+        if (doc_shown(s, s->docs[i].doc, s->nwindows))
+            continue;
+        ++*idle;
+        if (oldest < 0 || s->docs[i].last_used < s->docs[oldest].last_used)
+            oldest = i;
+    }
+    return oldest;
+}
+
+// Keeps at most server_cached_docs documents that no window shows, dropping
+// the least recently opened first.
+static void trim_shared_docs(Session *s)
+{
+    int idle, oldest;
+    while ((oldest = oldest_idle_doc(s, &idle)) >= 0 && idle > server_cached_docs)
+        drop_shared_doc(s, oldest);
+}
+
+// Parsed documents, reckoned at their file size: poppler keeps the file
+// mapped or copied and the objects it has read are mostly smaller.  Each
+// is counted once, however many windows show it.
+static size_t document_memory(const Session *s)
+{
+    size_t bytes = 0;
+    for (int i = 0; i < s->nwindows; ++i)
+        if (!doc_shown(s, s->windows[i]->doc, i))
+            bytes += s->windows[i]->file_size;
+    for (int i = 0; i < s->ndocs; ++i)
+        if (!doc_shown(s, s->docs[i].doc, s->nwindows))
+            bytes += s->docs[i].size;
+    return bytes;
+}
+
+// Memory of the caches st can rebuild: the rendered page, thumbnails and
+// the text index.
+static size_t window_cache_memory(AppState *st)
+{
+    size_t bytes = thumb_cache_memory(st->thumbs) + text_index_memory(st->index);
+    if (st->pdf != None)
+        bytes += (size_t)st->pdf_pos.width * st->pdf_pos.height * 4;
+    return bytes;
+}
+
+// An index rebuilt after the budget took it stays for index_keep_s, or
+// switching between windows would rebuild one every time.
+static bool index_pinned(const AppState *st)
+{
+    return st->index_restored != 0 &&
+        g_get_monotonic_time() - st->index_restored < (gint64)index_keep_s * G_USEC_PER_SEC;
+}
+
+// The part of window_cache_memory() that shed_window_caches(st, true)
+// leaves in place.
+static size_t unsheddable_memory(AppState *st)
+{
+    size_t bytes = 0;
+    if (st->mapped && st->pdf != None)
+        bytes += (size_t)st->pdf_pos.width * st->pdf_pos.height * 4;
+    if (st->overview && st->mapped)
+        bytes += thumb_cache_memory(st->thumbs);
+    if (index_pinned(st))
+        bytes += text_index_memory(st->index);
+    return bytes;
+}
+
+// Gives up what st can rebuild when it is needed again.  Hidden windows lose
+// the rendered page too, which is drawn again at the same scroll position
+// once they are exposed, and background windows lose their text index until
+// they are used again.
+static void shed_window_caches(AppState *st, bool background)
+{
+    if (!st->overview || !st->mapped)
+    {
+        thumb_cache_free(st->thumbs);
+        st->thumbs = NULL;
+    }
+    clear_link_maps(st);
+    text_layout_free(st->layout);
+    st->layout = NULL;
+
+    if (!st->mapped && st->pdf != None)
+    {
+        XFreePixmap(st->display, st->pdf);
+        st->pdf = None;
+        st->keep_pdf_pos = true;
+    }
+    if (background && st->index && !index_pinned(st))
+    {
+        inc_search_free(st->inc_search);
+        text_index_free(st->index);
+        st->index = NULL;
+        st->inc_search = inc_search_new(NULL, st->wake_pipe[1], incremental_search_delay_ms);
+        st->index_dropped = true;
+    }
+    doc_trim(st->doc);
+}
+
+// Rebuilds a text index given up by shed_window_caches(), from the index
+// file when persist_text_index keeps one.
+static void restore_text_index(AppState *st)
+{
+    if (!st->index_dropped)
+        return;
+    inc_search_free(st->inc_search);
+    st->index = text_index_new(st->file_name, st->total_pages, persist_text_index);
+    st->inc_search = inc_search_new(st->index, st->wake_pipe[1], incremental_search_delay_ms);
+    st->index_dropped = false;
+    st->index_restored = g_get_monotonic_time();
+}
+
+static int compare_eviction_order(const void *a, const void *b)
+{
+    const AppState *x = *(AppState *const *)a, *y = *(AppState *const *)b;
+    if (x->mapped != y->mapped)
+        return x->mapped ? 1 : -1;
+    return (x->last_used > y->last_used) - (x->last_used < y->last_used);
+}
+
+// Keeps the documents and caches of all windows within memory_budget_mb
+// together: hidden windows give up their caches first, then the least
+// recently used ones, then the documents no window shows.  The window in
+// use keeps its own, and windows with nothing left to give are skipped.
+// The budget only frees memory; it does not order rendering.  Pages are
+// rendered on the main thread when a window draws them, and thumbnails by
+// each window's own ThumbCache workers, not by a pool shared across windows.
+static void enforce_memory_budget(Session *s)
+{
+    gint64 now = g_get_monotonic_time();
+    if (memory_budget_mb <= 0 || now - s->budget_checked < 250000)
+        return;
+    s->budget_checked = now;
+
+    size_t budget = (size_t)memory_budget_mb << 20;
+    size_t total = document_memory(s);
+    for (int i = 0; i < s->nwindows; ++i)
+        total += window_cache_memory(s->windows[i]);
+    if (total <= budget)
+        return;
+
+    AppState **order = arena_alloc(&s->arena, s->nwindows * sizeof(AppState *));
+    memcpy(order, s->windows, s->nwindows * sizeof(AppState *));
+    qsort(order, s->nwindows, sizeof(AppState *), compare_eviction_order);
+    for (int i = 0; i < s->nwindows && total > budget; ++i)
+    {
+        AppState *st = order[i];
+        size_t bytes = window_cache_memory(st);
+        if (st == s->active || bytes <= unsheddable_memory(st))
+            continue;
+        shed_window_caches(st, true);
+        total = total - bytes + window_cache_memory(st);
+    }
+
+    int idle, oldest;
+    while (total > budget && (oldest = oldest_idle_doc(s, &idle)) >= 0)
+    {
+        total -= s->docs[oldest].size;
+        drop_shared_doc(s, oldest);
+    }
+}
+
+// Maps a window for args->fname and shows its first page.  The document is
+// parsed in the background while the window is mapped and painted, from the
+// disk cache when it has seen this file before, unless the resident server
+// has it parsed already.
+static AppState *open_window(Session *s, const Args *args)
+{
+    const char *file_name = args->fname;
+    GError *error = NULL;
+
+    s->closed_while_loading = false;
+    AppState *st = calloc(1, sizeof(AppState));
+    if (args->startup_stats)
+    {
+        st->start_time = g_get_monotonic_time();
+        report_startup(st, "process start");
+    }
+    st->page_stack_capacity = 10;
+    st->page_stack = malloc(st->page_stack_capacity * sizeof(PageAndOffset));
+    st->rotation = 0;
+    st->zoom_level = 1.0;
+    st->two_page_view = false;
+    st->continuous_mode = false;
+    st->show_status_bar = true;
+    st->dark_mode = false;
+    st->file_name = strdup(file_name);
+
+    if (pipe(st->wake_pipe) != 0) {
+        fprintf(stderr, "Error: Cannot create wakeup pipe.\n");
+        free(st->page_stack);
+        free(st->file_name);
+        free(st);
+        return NULL;
+    }
+    fcntl(st->wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(st->wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+    struct stat sb;
+    bool shared = s->listen_fd >= 0 && stat(file_name, &sb) == 0;
+    if (shared)
+        st->doc = find_shared_doc(s, file_name);
+    DocLoader *loader = st->doc ? NULL : doc_loader_new(file_name, st->wake_pipe[1], NULL, NULL);
+
+    // The first window opens the display while its document is parsed.
+    if (s->x.display == NULL)
+        s->x = open_display();
+    if (s->x.display == NULL) {
+        fprintf(stderr, "Error: Failed to set up X window.\n");
+        if (loader) {
+            PopplerDocument *doc = doc_loader_finish(loader, NULL);
+            if (doc)
+                g_object_unref(doc);
+        }
+        close(st->wake_pipe[0]);
+        close(st->wake_pipe[1]);
+        free(st->page_stack);
+        free(st->file_name);
+        free(st);
+        return NULL;
+    }
+
+    SetupXRet xret = setup_x(s->x.display, startup_window_width, startup_window_height,
+        file_name, args->root);
+    st->display = s->x.display;
+    st->main    = xret.main;
+    st->sel     = selection_new(st->display, st->main);
+    st->mapped  = true;
+    st->last_used = g_get_monotonic_time();
+
+    st->fit_page     = true;
+    st->scrolling_up = false;
+
+    st->selection_gc = xret.selection;
+    st->match_gc     = xret.match;
+    st->link_cursor  = xret.link_cursor;
+    st->status_gc    = xret.status;
+    st->text_gc      = xret.text;
+
+    st->fset    = s->x.fset;
+    st->fheight = s->x.fheight;
+    st->fbase   = s->x.fbase;
+
+    XFlush(st->display);
+    report_startup(st, "window mapped");
+
+    if (enable_disk_cache)
+        st->disk_cache = disk_cache_new(file_name, (long)disk_cache_mb << 20);
+    if (loader)
+    {
+        DiskCacheKey preview_key = {1, 0, st->rotation, theme_key(st)};
+        cairo_surface_t *preview = disk_cache_load_any(st->disk_cache, &preview_key);
+        draw_startup_preview(st, preview);
+
+        bool closed = false;
+        st->doc = wait_for_document(st, loader, preview, &closed, &error);
+        if (preview)
+            cairo_surface_destroy(preview);
+
+        if (closed) {
+            s->closed_while_loading = true;
+            goto fail;
+        }
+        if (!st->doc) {
+            fprintf(stderr, "Error loading PDF file: %s\n", file_name);
+            if (error) {
+                fprintf(stderr, "Poppler error: %s\n", error->message);
+                g_error_free(error);
+            }
+            goto fail;
+        }
+        if (shared)
+            add_shared_doc(s, file_name, st->doc, &sb);
+    }
+
+    st->total_pages = poppler_document_get_n_pages(st->doc);
+    if (st->total_pages <= 0) {
+        fprintf(stderr, "Error: The document has no pages or failed to load properly.\n");
+        goto fail;
+    }
+    report_startup(st, "document parsed");
+
+    st->file_size = stat(file_name, &sb) == 0 ? sb.st_size : 0;
+    st->large_file = st->file_size >= (off_t)large_file_mb << 20;
+
+    if (s->scanner == NULL)
+    {
+        int most = search_threads > large_file_search_threads ? search_threads : large_file_search_threads;
+        s->scanner = page_scanner_new(search_threads > 0 && large_file_search_threads > 0 ? most : 0);
+    }
+    st->scanner = s->scanner;
+    if (auto_reload)
+        st->watch = file_watch_new(file_name, auto_reload_delay_ms);
+
+    st->page_num = 1;
+    st->page = poppler_document_get_page(st->doc, st->page_num - 1);
+    if (!st->page) {
+        fprintf(stderr, "Error: Failed to load the first page of the document.\n");
+        goto fail;
+    }
+
+    // Size a stand-alone window to the page, as when it was created from it.
+    double width, height;
+    poppler_page_get_size(st->page, &width, &height);
+    if (args->root == None &&
+        ((unsigned)width != startup_window_width || (unsigned)height != startup_window_height))
+        XResizeWindow(st->display, st->main, (unsigned)width, (unsigned)height);
+    force_render_page(st, true);
+    return st;
+
+fail:
+    close_window(st);
+    return NULL;
+}
+
+static void add_window(Session *s, AppState *st)
+{
+    if (s->nwindows == s->capacity)
+    {
+        s->capacity = s->capacity ? s->capacity * 2 : 4;
+        s->windows = realloc(s->windows, s->capacity * sizeof(AppState *));
+    }
+    s->windows[s->nwindows++] = st;
+}
+
+static void remove_window(Session *s, AppState *st)
+{
+    for (int i = 0; i < s->nwindows; ++i)
+    {
+        if (s->windows[i] == st)
+        {
+            s->windows[i] = s->windows[--s->nwindows];
+            break;
+        }
+    }
+    if (s->active == st)
+        s->active = NULL;
+    close_window(st);
+    trim_shared_docs(s);
+    XFlush(s->x.display);
+}
+
+static AppState *find_window(const Session *s, Window w)
+{
+    for (int i = 0; i < s->nwindows; ++i)
+        if (s->windows[i]->main == w)
+            return s->windows[i];
+    return NULL;
+}
+
+// What a batch of control commands did to a window, to be rendered once at
+// its end.
+typedef struct {
+    bool page;      // the page or the scroll position within it changed
+    bool view;      // zoom or fit changed
+    bool reload;
+} ControlBatch;
+
+static void finish_control_batch(AppState *st, ControlBatch *b)
+{
+    if (st == NULL)
+        return;
+
+    if (b->reload)
+    {
+        // The render waits for the new document, so it comes once.
+        st->reload_render = st->reload_render || b->page || b->view;
+        start_reload(st);
+    }
+    else if (b->page)
+        render_page_lambda(st);
+    else if (b->view)
+        force_render_page(st, true);
+    *b = (ControlBatch){false, false, false};
+}
+
+static void format_state(const AppState *st, char *buf, size_t size)
+{
+    char zoom[G_ASCII_DTOSTR_BUF_SIZE];
+    g_ascii_formatd(zoom, sizeof(zoom), "%.3f", st->zoom_level);
+    snprintf(buf, size, "state page=%d pages=%d zoom=%s fit=%s rotation=%d file=%s\n",
+        st->page_num, st->total_pages, zoom, st->fit_page ? "page" : "width",
+        st->rotation, st->file_name);
+}
+
+// Applies one control command to st.  Writes an error or the answer to a
+// query to reply, else leaves it empty.
+static void apply_control_command(AppState *st, const char *cmd, ControlBatch *b,
+    char *reply, size_t size)
+{
+    reply[0] = '\0';
+    char *end;
+
+    if (strncmp(cmd, "goto ", 5) == 0)
+    {
+        // goto <page> [<points from the top of the page>], where a page
+        // that is not a number is taken as a page label.
+        long page = strtol(cmd + 5, &end, 10);
+        if (end == cmd + 5 || (*end && *end != ' '))
+        {
+            char label[128];
+            end = (char *)cmd + 5 + strcspn(cmd + 5, " ");
+            snprintf(label, sizeof(label), "%.*s", (int)(end - cmd - 5), cmd + 5);
+            page = doc_index_label_page(st->structure, label);
+        }
+        if (page < 1 || page > st->total_pages) {
+            snprintf(reply, size, "error no page: %s\n", cmd + 5);
+            return;
+        }
+        char *offset_end;
+        double offset = g_ascii_strtod(end, &offset_end);
+        if (page != st->page_num)
+            push_page_stack(st, st->page_num);
+        st->page_num = page;
+        if (offset_end != end)
+            st->next_pos_y = -(int)lround(offset * st->pdf_scale);
+        b->page = true;
+    }
+    else if (strncmp(cmd, "search ", 7) == 0)
+    {
+        // Searched right away: where it lands depends on the page before.
+        finish_control_batch(st, b);
+        snprintf(st->value, sizeof(st->value), "%s", cmd + 7);
+        Rectangle normalized = rectangle_normalize(&st->selection);
+        send_expose(st, &normalized);
+        search_text(st);
+        normalized = rectangle_normalize(&st->selection);
+        send_expose(st, &normalized);
+        if (!st->searching)
+            snprintf(reply, size, "error not found: %s\n", cmd + 7);
+    }
+    else if (strcmp(cmd, "reload") == 0)
+        b->reload = true;
+    else if (strcmp(cmd, "zoom fit-page") == 0)
+    {
+        st->fit_page = true;
+        b->view = true;
+    }
+    else if (strcmp(cmd, "zoom fit-width") == 0)
+    {
+        st->fit_page = false;
+        st->zoom_level = 1.0;
+        b->view = true;
+    }
+    else if (strncmp(cmd, "zoom ", 5) == 0)
+    {
+        double zoom = g_ascii_strtod(cmd + 5, &end);
+        if (end == cmd + 5 || zoom <= 0) {
+            snprintf(reply, size, "error bad zoom: %s\n", cmd + 5);
+            return;
+        }
+        st->zoom_level = fmax(min_zoom, fmin(max_zoom, zoom));
+        st->fit_page = false;
+        b->view = true;
+    }
+    else if (strcmp(cmd, "state") == 0)
+        format_state(st, reply, size);
+    else
+        snprintf(reply, size, "error unknown command: %s\n", cmd);
+}
+
+// The window showing file_name, the most recently used one if several do.
+static AppState *find_window_by_file(const Session *s, const char *file_name)
+{
+    char *wanted = realpath(file_name, NULL);
+    AppState *found = NULL;
+    for (int i = 0; i < s->nwindows && found != s->active; ++i)
+    {
+        char *name = realpath(s->windows[i]->file_name, NULL);
+        if (wanted && name && strcmp(wanted, name) == 0)
+            found = s->windows[i];
+        free(name);
+    }
+    free(wanted);
+    return found;
+}
+
+// Runs a request from a socket client, one command per line:
+//   open <root window> <file>   maps a new window on the file
+//   file <file>                 directs the next commands to its window
+//   goto <page> [<y>]           y in points from the top of the page;
+//                               a page that is not a number is a label
+//   search <text>
+//   reload
+//   zoom <factor> | zoom fit-page | zoom fit-width
+//   state                       answers "state page=... file=..."
+// Commands go to the last window used by default.  Each window is rendered
+// once, after its commands in the batch.  The reply is a line per error or
+// query, then "ok".
+static void handle_request(Session *s, ServerClient *c)
+{
+    AppState *st = s->active ? s->active : s->nwindows ? s->windows[s->nwindows - 1] : NULL;
+    ControlBatch b = {false, false, false};
+    char *save;
+
+    for (char *line = strtok_r(server_client_request(c), "\n", &save); line;
+         line = strtok_r(NULL, "\n", &save))
+    {
+        char reply[PATH_MAX + 128];
+        unsigned long root;
+        int offset;
+        reply[0] = '\0';
+
+        if (sscanf(line, "open %lu %n", &root, &offset) == 1)
+        {
+            finish_control_batch(st, &b);
+            Args args = {0};
+            args.fname = line + offset;
+            args.root = root;
+            AppState *opened = open_window(s, &args);
+            if (opened) {
+                add_window(s, opened);
+                st = s->active = opened;
+            }
+            else if (!s->closed_while_loading)
+                snprintf(reply, sizeof(reply), "error cannot open %s\n", line + offset);
+        }
+        else if (strncmp(line, "file ", 5) == 0)
+        {
+            finish_control_batch(st, &b);
+            st = find_window_by_file(s, line + 5);
+            if (st == NULL)
+                snprintf(reply, sizeof(reply), "error no window on %s\n", line + 5);
+        }
+        else if (st == NULL)
+            snprintf(reply, sizeof(reply), "error no window\n");
+        else
+            apply_control_command(st, line, &b, reply, sizeof(reply));
+
+        if (reply[0])
+            server_client_reply(c, reply);
+    }
+
+    finish_control_batch(st, &b);
+    server_client_reply(c, "ok\n");
+}
+
+static void accept_client(Session *s, int listen_fd)
+{
+    ServerClient *c = server_client_accept(listen_fd);
+    if (c == NULL)
+        return;
+    s->clients = realloc(s->clients, (s->nclients + 1) * sizeof(ServerClient *));
+    s->clients[s->nclients++] = c;
+}
+
+// Reads what client i sent; runs its request once complete.
+static void serve_client(Session *s, int i)
+{
+    ServerClient *c = s->clients[i];
+    int ret = server_client_read(c);
+    if (ret == 0)
+        return;
+
+    s->clients[i] = s->clients[--s->nclients];
+    if (ret > 0)
+        handle_request(s, c);
+    server_client_free(c);
+}
+
+// Blocks until an X event is queued, meanwhile handling the wakeups and
+// file changes of every window and the socket clients.
+static void wait_for_x_event(Session *s)
+{
+    while (!XPending(s->x.display))
+    {
+        int nclients = s->nclients;
+        int nfds = 3 + 2 * s->nwindows + nclients;
+        // A new iteration each time round: nothing from the last one is live.
+        arena_reset(&s->arena);
+        struct pollfd *fds = arena_alloc(&s->arena, nfds * sizeof(struct pollfd));
+        fds[0] = (struct pollfd){ConnectionNumber(s->x.display), POLLIN, 0};
+        fds[1] = (struct pollfd){s->listen_fd, POLLIN, 0};
+        fds[2] = (struct pollfd){s->control_fd, POLLIN, 0};
+
+        // Indexes grow without any event; a session of several windows
+        // looks at its memory budget every second regardless.
+        int timeout = s->nwindows > 1 && memory_budget_mb > 0 ? 1000 : -1;
+        for (int i = 0; i < s->nwindows; ++i)
+        {
+            AppState *st = s->windows[i];
+            fds[3 + 2 * i] = (struct pollfd){st->wake_pipe[0], POLLIN, 0};
+            fds[4 + 2 * i] = (struct pollfd){st->watch ? file_watch_fd(st->watch) : -1, POLLIN, 0};
+            int t = st->watch ? file_watch_timeout(st->watch) : -1;
+            if (t >= 0 && (timeout < 0 || t < timeout))
+                timeout = t;
+        }
+        struct pollfd *client_fds = fds + 3 + 2 * s->nwindows;
+        for (int i = 0; i < nclients; ++i)
+            client_fds[i] = (struct pollfd){server_client_fd(s->clients[i]), POLLIN, 0};
+
+        if (poll(fds, nfds, timeout) >= 0)
+        {
+            for (int i = 0; i < s->nwindows; ++i)
+                handle_window_wakeups(s->windows[i], &fds[3 + 2 * i]);
+
+            // Backwards, as serving a client moves the last one into its slot.
+            for (int i = nclients - 1; i >= 0; --i)
+                if (client_fds[i].revents)
+                    serve_client(s, i);
+            if (fds[1].revents & POLLIN)
+                accept_client(s, s->listen_fd);
+            if (fds[2].revents & POLLIN)
+                accept_client(s, s->control_fd);
+        }
+        if (s->nwindows > 1)
+            enforce_memory_budget(s);
+    }
+}
+
+static void print_alloc_stats(const ArenaStats *st)
+{
+    fprintf(stderr, "alloc-stats: %lu iterations, %lu arena allocations (%lu bytes, peak %zu per iteration)\n",
+        st->resets, st->allocs, st->bytes, st->peak);
+    fprintf(stderr, "alloc-stats: %lu arena blocks from the heap, %lu iterations outgrew the arena\n",
+        st->heap_allocs, st->heap_resets);
+}
+
+// Runs until the last window is closed, or for ever as the resident server.
+static void run_session(Session *s)
+{
+    XEvent event;
+    while (s->nwindows > 0 || s->listen_fd >= 0)
+    {
+        arena_reset(&s->arena);
+        wait_for_x_event(s);
+        XNextEvent(s->x.display, &event);
+
+        // Selection transfers watch the properties of the requestor's window.
+        if (event.type == PropertyNotify)
+            for (int i = 0; i < s->nwindows; ++i)
+                if (selection_property(s->windows[i]->sel, &event.xproperty))
+                    break;
+
+        AppState *st = find_window(s, event.xany.window);
+        if (st && (event.type == KeyPress || event.type == ButtonPress))
+        {
+            s->active = st;
+            st->last_used = g_get_monotonic_time();
+            restore_text_index(st);
+        }
+        if (st && (event.type == MapNotify || event.type == UnmapNotify))
+        {
+            // Iconified or on another desktop: the cheap caches go at once.
+            st->mapped = event.type == MapNotify;
+            if (!st->mapped)
+                shed_window_caches(st, false);
+        }
+        if (st && !handle_event(st, &event))
+            remove_window(s, st);
+        else if (s->nwindows > 1)
+            enforce_memory_budget(s);
+    }
+}
+
+// A bad window id from a client must not take the whole server down.
+static int server_x_error(Display *display, XErrorEvent *e)
+{
+    char msg[128];
+    XGetErrorText(display, e->error_code, msg, sizeof(msg));
+    fprintf(stderr, "X error: %s\n", msg);
+    return 0;
+}
+
+// Runs the resident server at path; ready_fd, if not -1, is told once it
+// listens.
+static int run_server(const char *path, int ready_fd)
+{
+    Session s = {0};
+    arena_init(&s.arena, 16384);
+    s.control_fd = -1;
+    s.listen_fd = server_listen(path);
+    if (s.listen_fd < 0) {
+        fprintf(stderr, "Error: Cannot listen on %s.\n", path);
+        return 1;
+    }
+    s.x = open_display();
+    if (s.x.display == NULL) {
+        close(s.listen_fd);
+        unlink(path);
+        return 1;
+    }
+    XSetErrorHandler(server_x_error);
+
+    if (ready_fd >= 0)
+    {
+        char c = 0;
+        ssize_t r = write(ready_fd, &c, 1);
+        (void)r;
+        close(ready_fd);
+    }
+
+    run_session(&s);
+    return 0;
+}
+
+// Starts the resident server in the background; true once it listens.
+static bool spawn_server(const char *path)
+{
+    int ready[2];
+    if (pipe(ready) != 0)
+        return false;
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(ready[0]);
+        close(ready[1]);
+        return false;
+    }
+    if (pid == 0)
+    {
+        close(ready[0]);
+        setsid();
+        int null_fd = open("/dev/null", O_RDWR);
+        if (null_fd >= 0)
+        {
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+        _exit(run_server(path, ready[1]));
+    }
+
+    close(ready[1]);
+    char c;
+    bool ok = read(ready[0], &c, 1) == 1;
+    close(ready[0]);
+    return ok;
+}
+
+// Sends request (lines ending in '\n') to the viewer listening at path and
+// prints the replies: answers to stdout, errors to stderr.  Returns 0 on
+// success, 1 if anything failed and -1 when nothing listens there.
+static int send_request(const char *path, const char *request)
+{
+    int fd = server_connect(path);
+    if (fd < 0)
+        return -1;
+
+    int ret = -1;
+    char reply[PATH_MAX + 128];
+    if (server_write(fd, request) && server_write(fd, "\n"))
+    {
+        while (server_read_line(fd, reply, sizeof(reply)))
+        {
+            if (strcmp(reply, "ok") == 0) {
+                ret = ret < 0 ? 0 : ret;
+                break;
+            }
+            if (strncmp(reply, "error ", 6) == 0) {
+                fprintf(stderr, "Error: %s\n", reply + 6);
+                ret = 1;
+            }
+            else
+                printf("%s\n", reply);
+        }
+    }
+    close(fd);
+    return ret;
+}
+
+// Asks the resident server at path for a window on args->fname.
+static int request_window(const char *path, const Args *args)
+{
+    char *abs_name = realpath(args->fname, NULL);
+    char line[PATH_MAX + 64];
+    snprintf(line, sizeof(line), "open %lu %s\n", (unsigned long)args->root,
+        abs_name ? abs_name : args->fname);
+    free(abs_name);
+    return send_request(path, line);
+}
+
+// --send: one request of the ';'-separated commands, to the --control socket
+// or else the resident server.
+static int send_commands(const Args *args, const char *server_path)
+{
+    const char *path = args->control ? args->control : server_path;
+    if (path == NULL) {
+        fprintf(stderr, "Error: No --control socket or X display to send to.\n");
+        return 1;
+    }
+
+    char *request = malloc(strlen(args->send) + 2);
+    char *out = request;
+    for (const char *c = args->send; *c; ++c)
+    {
+        if (*c != ';')
+            *out++ = *c;
+        else if (out > request && out[-1] != '\n')
+            *out++ = '\n';
+    }
+    if (out > request && out[-1] != '\n')
+        *out++ = '\n';
+    *out = '\0';
+
+    int ret = send_request(path, request);
+    if (ret < 0)
+        fprintf(stderr, "Error: No breathe listens on %s.\n", path);
+    free(request);
+    return ret < 0 ? 1 : ret;
+}
+
+int main(int argc, char **argv)
+{
+    setlocale(LC_ALL, "");
+    signal(SIGCHLD, SIG_IGN);  // uri handlers are never waited for
+
+    if (argc < 2) {
+        fputs("Missing pdf file, " USAGE, stderr);
+        return 1;
+    }
+
+    Args args = parse_args(argc, argv);
+    if (args.export_pattern)
+        return export_pages(&args);
+    if (args.dump_text)
+        return dump_text(&args);
+
+    // A running server opens the window; with resident_server one is
+    // started for that.  Without, the window is our own.
+    char path[PATH_MAX];
+    bool have_path = server_socket_path(path, sizeof(path));
+    if (args.send)
+        return send_commands(&args, have_path ? path : NULL);
+    if (!have_path) {
+        if (args.server) {
+            fprintf(stderr, "Error: No X display to serve.\n");
+            return 1;
+        }
+    }
+    else if (args.server)
+        return run_server(path, -1);
+    else
+    {
+        gint64 start = g_get_monotonic_time();
+        int ret = request_window(path, &args);
+        if (ret < 0 && resident_server && spawn_server(path))
+            ret = request_window(path, &args);
+        if (ret >= 0)
+        {
+            // The server reports nothing to us; all there is to time is its reply.
+            if (args.startup_stats)
+                fprintf(stderr, "startup: %-20s %8.1f ms (opened by the resident server,"
+                    " no other stages are timed)\n", "server replied",
+                    (g_get_monotonic_time() - start) / 1000.0);
+            return ret;
+        }
+    }
+
+    Session s = {0};
+    arena_init(&s.arena, 16384);
+    s.listen_fd = -1;
+    s.control_fd = -1;
+    if (args.control && (s.control_fd = server_listen(args.control)) < 0)
+        fprintf(stderr, "Error: Cannot listen on %s.\n", args.control);
+
+    int ret = 1;
+    AppState *st = open_window(&s, &args);
+    if (st) {
+        add_window(&s, st);
+        run_session(&s);
+        ret = 0;
+    }
+    else if (s.closed_while_loading)
+        ret = 0;
+
+    for (int i = 0; i < s.nclients; ++i)
+        server_client_free(s.clients[i]);
+    free(s.clients);
+    if (s.control_fd >= 0) {
+        close(s.control_fd);
+        unlink(args.control);
+    }
+    page_scanner_free(s.scanner);
+    if (args.alloc_stats)
+        print_alloc_stats(&s.arena.stats);
+    arena_release(&s.arena);
+    if (s.x.display)
+        close_display(&s.x);
+    free(s.windows);
+    return ret;
 }
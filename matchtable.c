@@ -0,0 +1,126 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <poppler.h>
+#include "matchtable.h"
+
+// All matches of one query, computed at most once per page: from the text
+// index when it covers the page, otherwise with a single poppler scan.
+
+MatchTable *match_table_new(const char *query, PopplerFindFlags flags, int total_pages)
+{
+    MatchTable *mt = calloc(1, sizeof(MatchTable));
+    mt->query = strdup(query);
+    mt->flags = flags & ~POPPLER_FIND_BACKWARDS;
+    mt->total_pages = total_pages;
+    mt->pages = malloc(total_pages * sizeof(PageMatches));
+    for (int i = 0; i < total_pages; ++i)
+        mt->pages[i] = (PageMatches){NULL, -1};
+    return mt;
+}
+
+void match_table_free(MatchTable *mt)
+{
+    if (mt == NULL)
+        return;
+
+    for (int i = 0; i < mt->total_pages; ++i)
+        free(mt->pages[i].rects);
+    free(mt->pages);
+    free(mt->screen);
+    free(mt->query);
+    free(mt);
+}
+
+static Rectangle to_rectangle(const PopplerRectangle *r)
+{
+    return (Rectangle){(int)r->x1, (int)r->y1, (int)ceil(r->x2 - r->x1), (int)ceil(r->y2 - r->y1)};
+}
+
+// p must be page (1-based); it is only used when the index can't answer.
+const PageMatches *match_table_get(MatchTable *mt, int page, PopplerPage *p, TextIndex *ti)
+{
+    if (page < 1 || page > mt->total_pages)
+        return NULL;
+
+    PageMatches *pm = &mt->pages[page - 1];
+    if (pm->count >= 0)
+        return pm;
+
+    PopplerRectangle *rects = NULL;
+    int count = ti ? text_index_page_matches(ti, page, mt->query, mt->flags, &rects) : -1;
+    if (count >= 0)
+    {
+        pm->rects = malloc((count ? count : 1) * sizeof(Rectangle));
+        for (int i = 0; i < count; ++i)
+            pm->rects[i] = to_rectangle(&rects[i]);
+        free(rects);
+        pm->count = count;
+        return pm;
+    }
+
+    if (p == NULL)
+        return NULL;
+
+    // poppler reports a bottom-left origin.
+    double width, height;
+    poppler_page_get_size(p, &width, &height);
+
+    GList *matches = poppler_page_find_text_with_options(p, mt->query, mt->flags);
+    pm->count = 0;
+    pm->rects = malloc((g_list_length(matches) + 1) * sizeof(Rectangle));
+    for (GList *l = matches; l != NULL; l = l->next)
+    {
+        PopplerRectangle *r = l->data;
+        PopplerRectangle tl = {r->x1, height - r->y2, r->x2, height - r->y1};
+        pm->rects[pm->count++] = to_rectangle(&tl);
+    }
+    g_list_free_full(matches, (GDestroyNotify)poppler_rectangle_free);
+    return pm;
+}
+
+// Index of the match closest to r, e.g. a hit reported by a search.
+int match_table_nearest(const PageMatches *pm, const Rectangle *r)
+{
+    int best = -1;
+    long best_dist = 0;
+    for (int i = 0; pm && i < pm->count; ++i)
+    {
+        long dx = pm->rects[i].x - r->x, dy = pm->rects[i].y - r->y;
+        long dist = dx * dx + dy * dy;
+        if (best < 0 || dist < best_dist)
+        {
+            best = i;
+            best_dist = dist;
+        }
+    }
+    return best;
+}
+
+// Screen rectangles of page's matches under cc, converted in one batch and
+// kept until the page or the conversion changes.
+const Rectangle *match_table_screen_rects(MatchTable *mt, int page, PopplerPage *p,
+    TextIndex *ti, const CoordConv *cc, int *n)
+{
+    const PageMatches *pm = match_table_get(mt, page, p, ti);
+    *n = pm ? pm->count : 0;
+    if (*n <= 0)
+        return NULL;
+
+    if (mt->screen_page != page ||
+        memcmp(&mt->screen_matrix, &cc->to_screen, sizeof(CoordMatrix)) != 0)
+    {
+        // Scrolling changes the conversion on every step; the buffer only
+        // ever grows, so that stays off the heap.
+        if (pm->count > mt->screen_capacity)
+        {
+            mt->screen_capacity = pm->count;
+            mt->screen = realloc(mt->screen, mt->screen_capacity * sizeof(Rectangle));
+        }
+        coord_conv_rects_to_screen(cc, pm->rects, mt->screen, pm->count);
+        mt->screen_page = page;
+        mt->screen_matrix = cc->to_screen;
+    }
+    return mt->screen;
+}
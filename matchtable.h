@@ -0,0 +1,38 @@
+#ifndef MATCHTABLE_H
+#define MATCHTABLE_H
+
+#include <stdbool.h>
+#include <poppler.h>
+#include "coordconv.h"
+#include "rectangle.h"
+#include "textindex.h"
+
+typedef struct {
+    Rectangle *rects;   // top-left origin, reading order
+    int count;          // -1 until computed
+} PageMatches;
+
+typedef struct {
+    char *query;
+    PopplerFindFlags flags;   // never includes POPPLER_FIND_BACKWARDS
+    int total_pages;
+    PageMatches *pages;
+
+    int current_page;         // selected match, 0 when none
+    int current;
+
+    // Screen rectangles of one page, valid for screen_matrix
+    Rectangle *screen;
+    int screen_capacity;
+    int screen_page;          // 0 when screen holds nothing
+    CoordMatrix screen_matrix;
+} MatchTable;
+
+MatchTable *match_table_new(const char *query, PopplerFindFlags flags, int total_pages);
+void match_table_free(MatchTable *mt);
+const PageMatches *match_table_get(MatchTable *mt, int page, PopplerPage *p, TextIndex *ti);
+int match_table_nearest(const PageMatches *pm, const Rectangle *r);
+const Rectangle *match_table_screen_rects(MatchTable *mt, int page, PopplerPage *p,
+    TextIndex *ti, const CoordConv *cc, int *n);
+
+#endif // MATCHTABLE_H
@@ -0,0 +1,221 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poppler.h>
+#include "docload.h"
+#include "pagescan.h"
+
+// Worker threads claim pages in search order from a shared counter, each on
+// its own PopplerDocument (kept open between searches).  The lowest order
+// index with a match wins; pages after it are never started, and pages
+// before it are always finished, so the result equals a sequential scan.
+// One scanner serves every window of the process: it keeps the documents of
+// the file searched last, and reopens them when a search is on another file.
+
+typedef struct {
+    PageScanner *ps;
+    int slot;
+} ScanWorker;
+
+struct PageScanner {
+    char *file_name;        // of the open documents, NULL for none
+    int max_threads;
+    int nthreads;           // of the current search
+    PopplerDocument **docs;
+    GThread **threads;
+    ScanWorker *workers;
+    int running;
+    bool low_memory;
+
+    char *query;
+    PopplerFindFlags flags;
+    int from, step, count;
+
+    gint next;
+    gint best;
+    gint cancel;
+    PopplerRectangle best_rect;
+
+    GMutex lock;
+    GCond cond;
+};
+
+static gpointer scan_thread(gpointer data)
+{
+    ScanWorker *w = data;
+    PageScanner *ps = w->ps;
+
+    if (ps->docs[w->slot] == NULL)
+        ps->docs[w->slot] = doc_load(ps->file_name, NULL);
+    PopplerDocument *doc = ps->docs[w->slot];
+
+    while (doc != NULL && !g_atomic_int_get(&ps->cancel))
+    {
+        int i = g_atomic_int_add(&ps->next, 1);
+        if (i >= ps->count || i >= g_atomic_int_get(&ps->best))
+            break;
+
+        PopplerPage *page = poppler_document_get_page(doc, ps->from + i * ps->step - 1);
+        if (page == NULL)
+            continue;
+
+        GList *matches = poppler_page_find_text_with_options(page, ps->query, ps->flags);
+        g_object_unref(page);
+        if (ps->low_memory && i % 16 == 0)
+            doc_trim(doc);
+
+        if (matches != NULL)
+        {
+            g_mutex_lock(&ps->lock);
+            if (i < ps->best)
+            {
+                ps->best_rect = *(PopplerRectangle *)matches->data;
+                g_atomic_int_set(&ps->best, i);
+            }
+            g_mutex_unlock(&ps->lock);
+            g_list_free_full(matches, (GDestroyNotify)poppler_rectangle_free);
+        }
+    }
+
+    g_mutex_lock(&ps->lock);
+    --ps->running;
+    g_cond_signal(&ps->cond);
+    g_mutex_unlock(&ps->lock);
+    return NULL;
+}
+
+static void close_documents(PageScanner *ps)
+{
+    for (int i = 0; i < ps->max_threads; ++i)
+    {
+        if (ps->docs[i] != NULL)
+        {
+            g_object_unref(ps->docs[i]);
+            ps->docs[i] = NULL;
+        }
+    }
+}
+
+// At most max_threads workers; max_threads <= 0 allows one per core.
+PageScanner *page_scanner_new(int max_threads)
+{
+    if (max_threads <= 0)
+        max_threads = g_get_num_processors();
+
+    PageScanner *ps = calloc(1, sizeof(PageScanner));
+    ps->max_threads = max_threads;
+    ps->nthreads = max_threads;
+    ps->docs = calloc(max_threads, sizeof(PopplerDocument *));
+    ps->threads = calloc(max_threads, sizeof(GThread *));
+    ps->workers = calloc(max_threads, sizeof(ScanWorker));
+    g_mutex_init(&ps->lock);
+    g_cond_init(&ps->cond);
+    return ps;
+}
+
+void page_scanner_free(PageScanner *ps)
+{
+    if (ps == NULL)
+        return;
+
+    page_scanner_cancel(ps);
+    page_scanner_finish(ps, NULL);
+    close_documents(ps);
+
+    g_mutex_clear(&ps->lock);
+    g_cond_clear(&ps->cond);
+    free(ps->workers);
+    free(ps->threads);
+    free(ps->docs);
+    free(ps->file_name);
+    free(ps);
+}
+
+// Points the next searches at file_name with nthreads workers (<= 0 for
+// all of them).  In low memory mode workers keep only a few pages of the
+// file resident and close their documents after each search.
+void page_scanner_use(PageScanner *ps, const char *file_name, int nthreads, bool low_memory)
+{
+    if (ps->file_name == NULL || strcmp(ps->file_name, file_name) != 0)
+    {
+        close_documents(ps);
+        free(ps->file_name);
+        ps->file_name = strdup(file_name);
+    }
+    ps->nthreads = nthreads > 0 && nthreads < ps->max_threads ? nthreads : ps->max_threads;
+    ps->low_memory = low_memory;
+}
+
+// Closes the documents of file_name, which changed or is no longer shown.
+void page_scanner_forget(PageScanner *ps, const char *file_name)
+{
+    if (ps->file_name && strcmp(ps->file_name, file_name) == 0)
+        close_documents(ps);
+}
+
+// Scans pages from..to inclusive; from > to scans backwards.
+void page_scanner_start(PageScanner *ps, const char *query, PopplerFindFlags flags,
+    int from, int to)
+{
+    ps->query = strdup(query);
+    ps->flags = flags;
+    ps->from = from;
+    ps->step = (from <= to) ? 1 : -1;
+    ps->count = abs(to - from) + 1;
+    ps->next = 0;
+    ps->best = ps->count;
+    ps->cancel = 0;
+
+    int n = ps->nthreads < ps->count ? ps->nthreads : ps->count;
+    ps->running = n;
+    for (int i = 0; i < n; ++i)
+    {
+        ps->workers[i] = (ScanWorker){ps, i};
+        ps->threads[i] = g_thread_new("page-scan", scan_thread, &ps->workers[i]);
+    }
+}
+
+// Returns true once every worker has stopped.
+bool page_scanner_wait(PageScanner *ps, int timeout_ms)
+{
+    gint64 end = g_get_monotonic_time() + (gint64)timeout_ms * 1000;
+
+    g_mutex_lock(&ps->lock);
+    while (ps->running > 0)
+        if (!g_cond_wait_until(&ps->cond, &ps->lock, end))
+            break;
+    bool done = (ps->running == 0);
+    g_mutex_unlock(&ps->lock);
+    return done;
+}
+
+void page_scanner_cancel(PageScanner *ps)
+{
+    g_atomic_int_set(&ps->cancel, 1);
+}
+
+// Joins the workers and returns the matching page, or 0.
+int page_scanner_finish(PageScanner *ps, PopplerRectangle *rect)
+{
+    for (int i = 0; i < ps->max_threads; ++i)
+    {
+        if (ps->threads[i] != NULL)
+        {
+            g_thread_join(ps->threads[i]);
+            ps->threads[i] = NULL;
+        }
+    }
+
+    free(ps->query);
+    ps->query = NULL;
+
+    if (ps->low_memory)
+        close_documents(ps);
+
+    if (g_atomic_int_get(&ps->cancel) || ps->best >= ps->count)
+        return 0;
+
+    if (rect)
+        *rect = ps->best_rect;
+    return ps->from + ps->best * ps->step;
+}
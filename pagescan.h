@@ -0,0 +1,19 @@
+#ifndef PAGESCAN_H
+#define PAGESCAN_H
+
+#include <stdbool.h>
+#include <poppler.h>
+
+typedef struct PageScanner PageScanner;
+
+PageScanner *page_scanner_new(int max_threads);
+void page_scanner_free(PageScanner *ps);
+void page_scanner_use(PageScanner *ps, const char *file_name, int nthreads, bool low_memory);
+void page_scanner_forget(PageScanner *ps, const char *file_name);
+void page_scanner_start(PageScanner *ps, const char *query, PopplerFindFlags flags,
+    int from, int to);
+bool page_scanner_wait(PageScanner *ps, int timeout_ms);
+void page_scanner_cancel(PageScanner *ps);
+int page_scanner_finish(PageScanner *ps, PopplerRectangle *rect);
+
+#endif // PAGESCAN_H
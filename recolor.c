@@ -0,0 +1,201 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <glib.h>
+#include "recolor.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RECOLOR_X86 1
+#endif
+
+// Pixels are cairo RGB24/ARGB32 words (0xAARRGGBB).  Every pixel is reduced
+// to its luminance and placed on the ink..paper gradient, so black text
+// takes the ink color and the white page takes the paper color exactly.
+
+typedef void (*RecolorSpanFn)(uint32_t *px, int n, const RecolorPalette *p);
+
+static inline unsigned div255(unsigned x)
+{
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+static void recolor_span_scalar(uint32_t *px, int n, const RecolorPalette *p)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        uint32_t v = px[i];
+        unsigned lum = (((v >> 16) & 0xff) * 77 + ((v >> 8) & 0xff) * 150 + (v & 0xff) * 29) >> 8;
+        unsigned inv = 255 - lum;
+        unsigned r = div255(p->ink[0] * inv + p->paper[0] * lum);
+        unsigned g = div255(p->ink[1] * inv + p->paper[1] * lum);
+        unsigned b = div255(p->ink[2] * inv + p->paper[2] * lum);
+        px[i] = (v & 0xff000000) | (r << 16) | (g << 8) | b;
+    }
+}
+
+#ifdef RECOLOR_X86
+// All products below are at most 255 * 255 and the upper half of every
+// 32-bit lane is zero, so 16-bit multiplies give exact 32-bit results.
+
+static void recolor_span_sse2(uint32_t *px, int n, const RecolorPalette *p)
+{
+    const __m128i mask  = _mm_set1_epi32(0xff);
+    const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+    const __m128i c255  = _mm_set1_epi32(255);
+    const __m128i c128  = _mm_set1_epi32(128);
+    const __m128i kr = _mm_set1_epi32(77), kg = _mm_set1_epi32(150), kb = _mm_set1_epi32(29);
+    const __m128i ir = _mm_set1_epi32(p->ink[0]),   ig = _mm_set1_epi32(p->ink[1]),   ib = _mm_set1_epi32(p->ink[2]);
+    const __m128i pr = _mm_set1_epi32(p->paper[0]), pg = _mm_set1_epi32(p->paper[1]), pb = _mm_set1_epi32(p->paper[2]);
+
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(px + i));
+        __m128i r = _mm_and_si128(_mm_srli_epi32(v, 16), mask);
+        __m128i g = _mm_and_si128(_mm_srli_epi32(v, 8), mask);
+        __m128i b = _mm_and_si128(v, mask);
+
+        __m128i lum = _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi16(r, kr), _mm_mullo_epi16(g, kg)),
+            _mm_mullo_epi16(b, kb));
+        lum = _mm_srli_epi32(lum, 8);
+        __m128i inv = _mm_sub_epi32(c255, lum);
+
+#define RECOLOR_CHANNEL_SSE2(ink, paper) ({ \
+            __m128i t = _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi16(ink, inv), \
+                _mm_mullo_epi16(paper, lum)), c128); \
+            _mm_srli_epi32(_mm_add_epi32(t, _mm_srli_epi32(t, 8)), 8); })
+
+        r = RECOLOR_CHANNEL_SSE2(ir, pr);
+        g = RECOLOR_CHANNEL_SSE2(ig, pg);
+        b = RECOLOR_CHANNEL_SSE2(ib, pb);
+#undef RECOLOR_CHANNEL_SSE2
+
+        v = _mm_or_si128(_mm_and_si128(v, alpha),
+            _mm_or_si128(_mm_slli_epi32(r, 16), _mm_or_si128(_mm_slli_epi32(g, 8), b)));
+        _mm_storeu_si128((__m128i *)(px + i), v);
+    }
+
+    recolor_span_scalar(px + i, n - i, p);
+}
+
+__attribute__((target("avx2")))
+static void recolor_span_avx2(uint32_t *px, int n, const RecolorPalette *p)
+{
+    const __m256i mask  = _mm256_set1_epi32(0xff);
+    const __m256i alpha = _mm256_set1_epi32((int)0xff000000);
+    const __m256i c255  = _mm256_set1_epi32(255);
+    const __m256i c128  = _mm256_set1_epi32(128);
+    const __m256i kr = _mm256_set1_epi32(77), kg = _mm256_set1_epi32(150), kb = _mm256_set1_epi32(29);
+    const __m256i ir = _mm256_set1_epi32(p->ink[0]),   ig = _mm256_set1_epi32(p->ink[1]),   ib = _mm256_set1_epi32(p->ink[2]);
+    const __m256i pr = _mm256_set1_epi32(p->paper[0]), pg = _mm256_set1_epi32(p->paper[1]), pb = _mm256_set1_epi32(p->paper[2]);
+
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(px + i));
+        __m256i r = _mm256_and_si256(_mm256_srli_epi32(v, 16), mask);
+        __m256i g = _mm256_and_si256(_mm256_srli_epi32(v, 8), mask);
+        __m256i b = _mm256_and_si256(v, mask);
+
+        __m256i lum = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi16(r, kr), _mm256_mullo_epi16(g, kg)),
+            _mm256_mullo_epi16(b, kb));
+        lum = _mm256_srli_epi32(lum, 8);
+        __m256i inv = _mm256_sub_epi32(c255, lum);
+
+#define RECOLOR_CHANNEL_AVX2(ink, paper) ({ \
+            __m256i t = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi16(ink, inv), \
+                _mm256_mullo_epi16(paper, lum)), c128); \
+            _mm256_srli_epi32(_mm256_add_epi32(t, _mm256_srli_epi32(t, 8)), 8); })
+
+        r = RECOLOR_CHANNEL_AVX2(ir, pr);
+        g = RECOLOR_CHANNEL_AVX2(ig, pg);
+        b = RECOLOR_CHANNEL_AVX2(ib, pb);
+#undef RECOLOR_CHANNEL_AVX2
+
+        v = _mm256_or_si256(_mm256_and_si256(v, alpha),
+            _mm256_or_si256(_mm256_slli_epi32(r, 16), _mm256_or_si256(_mm256_slli_epi32(g, 8), b)));
+        _mm256_storeu_si256((__m256i *)(px + i), v);
+    }
+
+    recolor_span_sse2(px + i, n - i, p);
+}
+#endif
+
+// Picked once, however many export or loader threads ask first.
+static RecolorSpanFn get_span_fn(void)
+{
+    static gsize fn = 0;
+    if (g_once_init_enter(&fn))
+    {
+        RecolorSpanFn best;
+#ifdef RECOLOR_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            best = recolor_span_avx2;
+        else if (__builtin_cpu_supports("sse2"))
+            best = recolor_span_sse2;
+        else
+            best = recolor_span_scalar;
+#else
+        best = recolor_span_scalar;
+#endif
+        g_once_init_leave(&fn, (gsize)best);
+    }
+    return (RecolorSpanFn)fn;
+}
+
+static bool parse_hex_color(const char *s, uint8_t out[3])
+{
+    unsigned r, g, b;
+    if (s == NULL || s[0] != '#' || sscanf(s + 1, "%02x%02x%02x", &r, &g, &b) != 3)
+        return false;
+    out[0] = r;
+    out[1] = g;
+    out[2] = b;
+    return true;
+}
+
+bool recolor_parse_palette(RecolorPalette *p, const char *ink, const char *paper)
+{
+    return parse_hex_color(ink, p->ink) && parse_hex_color(paper, p->paper);
+}
+
+void recolor_image(unsigned char *data, int width, int height, int stride,
+    const RecolorPalette *p, const Rectangle *keep, int nkeep)
+{
+    RecolorSpanFn span = get_span_fn();
+
+    for (int y = 0; y < height; ++y)
+    {
+        uint32_t *row = (uint32_t *)(data + (size_t)y * stride);
+        int x = 0;
+
+        // Recolor the gaps between the kept rectangles crossing this row.
+        while (x < width)
+        {
+            int stop = width;
+            bool inside = false;
+            for (int k = 0; k < nkeep; ++k)
+            {
+                const Rectangle *r = &keep[k];
+                if (y < r->y || y >= r->y + r->height)
+                    continue;
+                if (r->x <= x && r->x + r->width > x)
+                {
+                    x = r->x + r->width;
+                    inside = true;
+                    break;
+                }
+                if (r->x > x && r->x < stop)
+                    stop = r->x;
+            }
+            if (inside)
+                continue;
+
+            span(row + x, stop - x, p);
+            x = stop;
+        }
+    }
+}
@@ -0,0 +1,17 @@
+#ifndef RECOLOR_H
+#define RECOLOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "rectangle.h"
+
+typedef struct {
+    uint8_t ink[3];    // r, g, b used where the page is black
+    uint8_t paper[3];  // r, g, b used where the page is white
+} RecolorPalette;
+
+bool recolor_parse_palette(RecolorPalette *p, const char *ink, const char *paper);
+void recolor_image(unsigned char *data, int width, int height, int stride,
+    const RecolorPalette *p, const Rectangle *keep, int nkeep);
+
+#endif // RECOLOR_H
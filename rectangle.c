@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include "rectangle.h"
 
 Rectangle rectangle_intersect(const Rectangle *a, const Rectangle *b)
@@ -13,75 +14,310 @@ Rectangle rectangle_intersect(const Rectangle *a, const Rectangle *b)
     return (Rectangle){x1, y1, x2 - x1, y2 - y1};
 }
 
-RectangleArray rectangle_subtract(const Rectangle *a, const Rectangle *b)
+bool rectangle_is_invalid(const Rectangle *p)
 {
-    RectangleArray result = {NULL, 0};
-    Rectangle intersection = rectangle_intersect(a, b);
+    return p->x < 0 || p->y < 0 || p->width < 0 || p->height < 0;
+}
+
+bool rectangle_equals(const Rectangle *a, const Rectangle *b)
+{
+    return a->x == b->x && a->y == b->y && a->width == b->width && a->height == b->height;
+}
+
+Rectangle rectangle_normalize(const Rectangle *r)
+{
+    Rectangle result = *r;
+
+    if (result.width < 0)
+    {
+        result.width *= -1;
+        result.x -= result.width;
+    }
 
-    if (rectangle_is_invalid(&intersection))
+    if (result.height < 0)
     {
-        result.rectangles = malloc(sizeof(Rectangle));
-        result.rectangles[0] = *a;
-        result.size = 1;
-        return result;
+        result.height *= -1;
+        result.y -= result.height;
     }
 
-    result.rectangles = malloc(4 * sizeof(Rectangle));
-    result.size = 0;
+    return result;
+}
 
-    if (a->y < b->y)
+Rectangle rectangle_pad(const Rectangle *r, int p)
+{
+    return (Rectangle){r->x - p, r->y - p, r->width + 2 * p, r->height + 2 * p};
+}
+
+typedef enum {
+    REGION_UNION,
+    REGION_SUBTRACT,
+    REGION_INTERSECT,
+    REGION_XOR,
+} RegionOp;
+
+// Worst case number of distinct edges on one axis of an operation.
+#define REGION_MAX_EDGES (4 * REGION_MAX_RECTS)
+
+static bool rect_is_empty(const Rectangle *r)
+{
+    return r->width <= 0 || r->height <= 0;
+}
+
+static void sort_ints(int *v, int n)
+{
+    for (int i = 1; i < n; ++i)
     {
-        result.rectangles[result.size++] = (Rectangle){a->x, a->y, a->width, b->y - a->y};
+        int x = v[i], j = i;
+        for (; j > 0 && v[j - 1] > x; --j)
+            v[j] = v[j - 1];
+        v[j] = x;
     }
+}
+
+static int unique_ints(int *v, int n)
+{
+    int m = 0;
+    for (int i = 0; i < n; ++i)
+        if (m == 0 || v[m - 1] != v[i])
+            v[m++] = v[i];
+    return m;
+}
 
-    if (a->y + a->height > b->y + b->height)
+static bool op_keeps(RegionOp op, bool in_a, bool in_b)
+{
+    switch (op)
     {
-        result.rectangles[result.size++] = (Rectangle){a->x, b->y + b->height, a->width, a->y + a->height - (b->y + b->height)};
+        case REGION_UNION:     return in_a || in_b;
+        case REGION_SUBTRACT:  return in_a && !in_b;
+        case REGION_INTERSECT: return in_a && in_b;
+        case REGION_XOR:       return in_a != in_b;
     }
+    return false;
+}
 
-    if (a->x < b->x)
+// Collects the x extents of the rectangles of r covering the band starting
+// at y, as sorted [start, end) pairs.
+static int band_spans(const RectRegion *r, int y, int *spans)
+{
+    int n = 0;
+    for (int i = 0; i < r->size; ++i)
     {
-        result.rectangles[result.size++] = (Rectangle){a->x, b->y, b->x - a->x, b->height};
+        const Rectangle *p = &r->rects[i];
+        if (p->y > y)
+            break;
+        if (y < p->y + p->height)
+        {
+            int j = n;
+            for (; j > 0 && spans[2 * (j - 1)] > p->x; --j)
+            {
+                spans[2 * j] = spans[2 * (j - 1)];
+                spans[2 * j + 1] = spans[2 * (j - 1) + 1];
+            }
+            spans[2 * j] = p->x;
+            spans[2 * j + 1] = p->x + p->width;
+            ++n;
+        }
     }
+    return n;
+}
+
+static bool span_contains(const int *spans, int n, int *cursor, int x)
+{
+    while (*cursor < n && spans[2 * *cursor + 1] <= x)
+        ++*cursor;
+    return *cursor < n && spans[2 * *cursor] <= x;
+}
 
-    if (a->x + a->width > b->x + b->width)
+// Sweeps both regions band by band: every distinct top/bottom edge starts a
+// band, within which the spans of a and b are combined by op.  A band whose
+// spans match the band right above it extends those rectangles downwards
+// instead of adding new ones.
+static void region_op(RectRegion *dst, const RectRegion *a, const RectRegion *b, RegionOp op)
+{
+    int ys[REGION_MAX_EDGES];
+    int ny = 0;
+    for (int i = 0; i < a->size; ++i)
+    {
+        ys[ny++] = a->rects[i].y;
+        ys[ny++] = a->rects[i].y + a->rects[i].height;
+    }
+    for (int i = 0; i < b->size; ++i)
     {
-        result.rectangles[result.size++] = (Rectangle){b->x + b->width, b->y, a->x + a->width - (b->x + b->width), b->height};
+        ys[ny++] = b->rects[i].y;
+        ys[ny++] = b->rects[i].y + b->rects[i].height;
     }
+    sort_ints(ys, ny);
+    ny = unique_ints(ys, ny);
 
-    return result;
+    RectRegion out;
+    out.size = 0;
+    int prev_start = 0, prev_count = 0, prev_bottom = 0;
+    bool overflow = false;
+
+    for (int band = 0; band + 1 < ny && !overflow; ++band)
+    {
+        int y0 = ys[band], y1 = ys[band + 1];
+        int sa[2 * REGION_MAX_RECTS], sb[2 * REGION_MAX_RECTS];
+        int na = band_spans(a, y0, sa);
+        int nb = band_spans(b, y0, sb);
+
+        int xs[REGION_MAX_EDGES];
+        int nx = 0;
+        for (int i = 0; i < 2 * na; ++i)
+            xs[nx++] = sa[i];
+        for (int i = 0; i < 2 * nb; ++i)
+            xs[nx++] = sb[i];
+        sort_ints(xs, nx);
+        nx = unique_ints(xs, nx);
+
+        int start = out.size;
+        int ca = 0, cb = 0;
+        for (int i = 0; i + 1 < nx; ++i)
+        {
+            bool in_a = span_contains(sa, na, &ca, xs[i]);
+            bool in_b = span_contains(sb, nb, &cb, xs[i]);
+            if (!op_keeps(op, in_a, in_b))
+                continue;
+
+            Rectangle *last = out.size > start ? &out.rects[out.size - 1] : NULL;
+            if (last && last->x + last->width == xs[i])
+            {
+                last->width = xs[i + 1] - last->x;
+                continue;
+            }
+            if (out.size == REGION_MAX_RECTS)
+            {
+                overflow = true;
+                break;
+            }
+            out.rects[out.size++] = (Rectangle){xs[i], y0, xs[i + 1] - xs[i], y1 - y0};
+        }
+
+        int count = out.size - start;
+        if (count == 0 || overflow)
+            continue;
+
+        bool same = (count == prev_count && prev_bottom == y0);
+        for (int i = 0; same && i < count; ++i)
+            same = out.rects[prev_start + i].x == out.rects[start + i].x
+                && out.rects[prev_start + i].width == out.rects[start + i].width;
+
+        if (same)
+        {
+            for (int i = 0; i < count; ++i)
+                out.rects[prev_start + i].height += y1 - y0;
+            out.size = start;
+        }
+        else
+        {
+            prev_start = start;
+            prev_count = count;
+        }
+        prev_bottom = y1;
+    }
+
+    if (overflow)
+    {
+        // Subtracting or intersecting never leaves a's bounds.
+        Rectangle r = region_bounds(a);
+        if ((op == REGION_UNION || op == REGION_XOR) && b->size > 0)
+        {
+            Rectangle rb = region_bounds(b);
+            int x2 = r.x + r.width > rb.x + rb.width ? r.x + r.width : rb.x + rb.width;
+            int y2 = r.y + r.height > rb.y + rb.height ? r.y + r.height : rb.y + rb.height;
+            r.x = r.x < rb.x ? r.x : rb.x;
+            r.y = r.y < rb.y ? r.y : rb.y;
+            r.width = x2 - r.x;
+            r.height = y2 - r.y;
+        }
+        out.rects[0] = r;
+        out.size = 1;
+    }
+
+    memcpy(dst->rects, out.rects, out.size * sizeof(Rectangle));
+    dst->size = out.size;
 }
 
-bool rectangle_is_invalid(const Rectangle *p)
+void region_init(RectRegion *r)
 {
-    return p->x < 0 || p->y < 0 || p->width < 0 || p->height < 0;
+    r->size = 0;
 }
 
-bool rectangle_equals(const Rectangle *a, const Rectangle *b)
+void region_init_rect(RectRegion *r, const Rectangle *rect)
 {
-    return a->x == b->x && a->y == b->y && a->width == b->width && a->height == b->height;
+    Rectangle n = rectangle_normalize(rect);
+    r->size = 0;
+    if (!rect_is_empty(&n))
+        r->rects[r->size++] = n;
 }
 
-Rectangle rectangle_normalize(const Rectangle *r)
+void region_init_rects(RectRegion *r, const Rectangle *rects, int n)
 {
-    Rectangle result = *r;
+    region_init(r);
+    for (int i = 0; i < n; ++i)
+        region_union_rect(r, &rects[i]);
+}
 
-    if (result.width < 0)
-    {
-        result.width *= -1;
-        result.x -= result.width;
-    }
+bool region_is_empty(const RectRegion *r)
+{
+    return r->size == 0;
+}
 
-    if (result.height < 0)
+Rectangle region_bounds(const RectRegion *r)
+{
+    if (r->size == 0)
+        return (Rectangle){0, 0, 0, 0};
+
+    int x1 = r->rects[0].x, y1 = r->rects[0].y;
+    int x2 = x1 + r->rects[0].width, y2 = y1 + r->rects[0].height;
+    for (int i = 1; i < r->size; ++i)
     {
-        result.height *= -1;
-        result.y -= result.height;
+        const Rectangle *p = &r->rects[i];
+        if (p->x < x1) x1 = p->x;
+        if (p->y < y1) y1 = p->y;
+        if (p->x + p->width > x2) x2 = p->x + p->width;
+        if (p->y + p->height > y2) y2 = p->y + p->height;
     }
+    return (Rectangle){x1, y1, x2 - x1, y2 - y1};
+}
 
-    return result;
+void region_union(RectRegion *dst, const RectRegion *a, const RectRegion *b)
+{
+    region_op(dst, a, b, REGION_UNION);
 }
 
-Rectangle rectangle_pad(const Rectangle *r, int p)
+void region_subtract(RectRegion *dst, const RectRegion *a, const RectRegion *b)
 {
-    return (Rectangle){r->x - p, r->y - p, r->width + 2 * p, r->height + 2 * p};
+    region_op(dst, a, b, REGION_SUBTRACT);
+}
+
+void region_intersect(RectRegion *dst, const RectRegion *a, const RectRegion *b)
+{
+    region_op(dst, a, b, REGION_INTERSECT);
+}
+
+void region_xor(RectRegion *dst, const RectRegion *a, const RectRegion *b)
+{
+    region_op(dst, a, b, REGION_XOR);
+}
+
+void region_union_rect(RectRegion *r, const Rectangle *rect)
+{
+    RectRegion b;
+    region_init_rect(&b, rect);
+    region_op(r, r, &b, REGION_UNION);
+}
+
+void region_subtract_rect(RectRegion *r, const Rectangle *rect)
+{
+    RectRegion b;
+    region_init_rect(&b, rect);
+    region_op(r, r, &b, REGION_SUBTRACT);
+}
+
+void region_intersect_rect(RectRegion *r, const Rectangle *rect)
+{
+    RectRegion b;
+    region_init_rect(&b, rect);
+    region_op(r, r, &b, REGION_INTERSECT);
 }
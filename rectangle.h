@@ -7,16 +7,36 @@ typedef struct {
     int x, y, width, height;
 } Rectangle;
 
+// Most rectangles a region holds.  An operation whose exact result would
+// need more collapses the region to its bounding box, which is still a
+// correct (if coarser) area to redraw.
+#define REGION_MAX_RECTS 32
+
+// A set of non-overlapping rectangles in y-x banded order: sorted by top
+// edge, then by left edge, with vertically adjacent identical bands merged.
+// Storage is inline, so regions live on the stack and never allocate.
 typedef struct {
-    Rectangle *rectangles;
+    Rectangle rects[REGION_MAX_RECTS];
     int size;
-} RectangleArray;
+} RectRegion;
 
 Rectangle rectangle_intersect(const Rectangle *a, const Rectangle *b);
-RectangleArray rectangle_subtract(const Rectangle *a, const Rectangle *b);
 bool rectangle_is_invalid(const Rectangle *p);
 bool rectangle_equals(const Rectangle *a, const Rectangle *b);
 Rectangle rectangle_normalize(const Rectangle *r);
 Rectangle rectangle_pad(const Rectangle *r, int p);
 
+void region_init(RectRegion *r);
+void region_init_rect(RectRegion *r, const Rectangle *rect);
+void region_init_rects(RectRegion *r, const Rectangle *rects, int n);
+bool region_is_empty(const RectRegion *r);
+Rectangle region_bounds(const RectRegion *r);
+void region_union(RectRegion *dst, const RectRegion *a, const RectRegion *b);
+void region_subtract(RectRegion *dst, const RectRegion *a, const RectRegion *b);
+void region_intersect(RectRegion *dst, const RectRegion *a, const RectRegion *b);
+void region_xor(RectRegion *dst, const RectRegion *a, const RectRegion *b);
+void region_union_rect(RectRegion *r, const Rectangle *rect);
+void region_subtract_rect(RectRegion *r, const Rectangle *rect);
+void region_intersect_rect(RectRegion *r, const Rectangle *rect);
+
 #endif // RECTANGLE_H
@@ -0,0 +1,315 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+#include "selection.h"
+
+// Serves PRIMARY and CLIPBOARD to other clients, as UTF-8 or, for the
+// STRING target, Latin-1.  Text that does not fit in one request goes out
+// with the ICCCM INCR protocol: the requestor gets an INCR property with the
+// size, and each time it deletes the property the next chunk is written from
+// the event loop, ending with an empty one.  A transfer keeps its text alive
+// when the selection changes meanwhile, and is dropped when the requestor
+// goes quiet or away.
+
+#define TRANSFER_TIMEOUT_S 10
+
+typedef struct {
+    int refs;
+    char *data;
+    size_t len;
+} SelText;
+
+typedef struct {
+    Window requestor;
+    Atom property;
+    Atom type;
+    SelText *text;
+    size_t offset;
+    time_t last;
+} Transfer;
+
+struct Selection {
+    Display *display;
+    Window owner;
+    size_t chunk;
+    SelText *primary;
+    SelText *clipboard;
+    Transfer *transfers;
+    int ntransfers;
+
+    Atom clipboard_atom;
+    Atom targets_atom;
+    Atom incr_atom;
+    Atom utf8_atom;
+    Atom text_atom;
+    Atom plain_utf8_atom;
+    Atom plain_atom;
+};
+
+static time_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static void unref_text(SelText *t)
+{
+    if (t && --t->refs == 0) {
+        free(t->data);
+        free(t);
+    }
+}
+
+// The requestor may be gone by the time we write to it, which must not take
+// the viewer down with the default error handler.
+static bool x_failed;
+
+static int trap_error(Display *display, XErrorEvent *e)
+{
+    (void)display;
+    (void)e;
+    x_failed = true;
+    return 0;
+}
+
+static int (*trap_errors(void))(Display *, XErrorEvent *)
+{
+    x_failed = false;
+    return XSetErrorHandler(trap_error);
+}
+
+static bool untrap_errors(Display *display, int (*old)(Display *, XErrorEvent *))
+{
+    XSync(display, False);
+    XSetErrorHandler(old);
+    return !x_failed;
+}
+
+Selection *selection_new(Display *display, Window owner)
+{
+    Selection *sel = calloc(1, sizeof(Selection));
+    sel->display = display;
+    sel->owner = owner;
+
+    // Room for the ChangeProperty request header; at most 256 KiB at a time
+    // keeps every step short for the event loop.
+    long max = XMaxRequestSize(display) * 4 - 64;
+    sel->chunk = max < 256 * 1024 ? (size_t)max : 256 * 1024;
+
+    sel->clipboard_atom = XInternAtom(display, "CLIPBOARD", False);
+    sel->targets_atom = XInternAtom(display, "TARGETS", False);
+    sel->incr_atom = XInternAtom(display, "INCR", False);
+    sel->utf8_atom = XInternAtom(display, "UTF8_STRING", False);
+    sel->text_atom = XInternAtom(display, "TEXT", False);
+    sel->plain_utf8_atom = XInternAtom(display, "text/plain;charset=utf-8", False);
+    sel->plain_atom = XInternAtom(display, "text/plain", False);
+    return sel;
+}
+
+static void end_transfer(Selection *sel, int i)
+{
+    Window requestor = sel->transfers[i].requestor;
+    unref_text(sel->transfers[i].text);
+    sel->transfers[i] = sel->transfers[--sel->ntransfers];
+
+    for (int j = 0; j < sel->ntransfers; ++j)
+        if (sel->transfers[j].requestor == requestor)
+            return;
+    int (*old)(Display *, XErrorEvent *) = trap_errors();
+    XSelectInput(sel->display, requestor, NoEventMask);
+    untrap_errors(sel->display, old);
+}
+
+void selection_free(Selection *sel)
+{
+    if (sel == NULL)
+        return;
+    while (sel->ntransfers > 0)
+        end_transfer(sel, 0);
+    free(sel->transfers);
+    unref_text(sel->primary);
+    unref_text(sel->clipboard);
+    free(sel);
+}
+
+static SelText **slot(Selection *sel, Atom selection)
+{
+    if (selection == XA_PRIMARY)
+        return &sel->primary;
+    if (selection == sel->clipboard_atom)
+        return &sel->clipboard;
+    return NULL;
+}
+
+// Takes text (malloc'ed, len bytes) as the new content of selection.
+void selection_own(Selection *sel, Atom selection, char *text, size_t len)
+{
+    SelText **s = slot(sel, selection);
+    if (s == NULL) {
+        free(text);
+        return;
+    }
+
+    unref_text(*s);
+    *s = malloc(sizeof(SelText));
+    **s = (SelText){1, text, len};
+    XSetSelectionOwner(sel->display, selection, sel->owner, CurrentTime);
+}
+
+void selection_clear(Selection *sel, const XSelectionClearEvent *e)
+{
+    SelText **s = slot(sel, e->selection);
+    if (s) {
+        unref_text(*s);
+        *s = NULL;
+    }
+}
+
+static void drop_stale_transfers(Selection *sel)
+{
+    time_t t = now();
+    for (int i = sel->ntransfers - 1; i >= 0; --i)
+        if (t - sel->transfers[i].last > TRANSFER_TIMEOUT_S)
+            end_transfer(sel, i);
+}
+
+// The text as the ICCCM STRING target wants it, in Latin-1: characters
+// beyond that and malformed UTF-8 become a '?' each.
+static SelText *latin1_text(const SelText *utf8)
+{
+    SelText *t = malloc(sizeof(SelText));
+    t->refs = 1;
+    t->data = malloc(utf8->len + 1);
+    t->len = 0;
+
+    const unsigned char *p = (const unsigned char *)utf8->data;
+    const unsigned char *end = p + utf8->len;
+    while (p < end)
+    {
+        unsigned c = *p++;
+        int more = c >= 0xf8 ? -1 : c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : c >= 0x80 ? -1 : 0;
+        if (more < 0) {
+            t->data[t->len++] = '?';
+            continue;
+        }
+
+        unsigned code = more ? c & (0x3f >> more) : c;
+        int i;
+        for (i = 0; i < more && p < end && (*p & 0xc0) == 0x80; ++i)
+            code = code << 6 | (*p++ & 0x3f);
+        // Truncated and overlong sequences are malformed too.
+        bool ok = i == more && (more != 1 || code >= 0x80);
+        t->data[t->len++] = ok && code < 0x100 ? (char)code : '?';
+    }
+    return t;
+}
+
+// Answers req with the property it should read, or None to refuse.
+static Atom convert(Selection *sel, const XSelectionRequestEvent *req, Atom property)
+{
+    if (req->target == sel->targets_atom)
+    {
+        Atom targets[] = {sel->targets_atom, sel->utf8_atom, XA_STRING, sel->text_atom,
+            sel->plain_utf8_atom, sel->plain_atom};
+        XChangeProperty(sel->display, req->requestor, property, XA_ATOM, 32,
+            PropModeReplace, (unsigned char *)targets, sizeof(targets) / sizeof(*targets));
+        return property;
+    }
+
+    if (req->target != sel->utf8_atom && req->target != XA_STRING &&
+        req->target != sel->text_atom && req->target != sel->plain_utf8_atom &&
+        req->target != sel->plain_atom)
+        return None;
+
+    SelText **s = slot(sel, req->selection);
+    if (s == NULL || *s == NULL)
+        return None;
+
+    Atom type = req->target == sel->text_atom ? sel->utf8_atom : req->target;
+    SelText *text = *s;
+    if (req->target == XA_STRING)
+        text = latin1_text(text);
+    else
+        ++text->refs;
+
+    if (text->len <= sel->chunk)
+    {
+        XChangeProperty(sel->display, req->requestor, property, type, 8,
+            PropModeReplace, (const unsigned char *)text->data, text->len);
+        unref_text(text);
+        return property;
+    }
+
+    // Announce an INCR transfer; the chunks follow as the requestor deletes
+    // the property.
+    long size = text->len;
+    XSelectInput(sel->display, req->requestor, PropertyChangeMask);
+    XChangeProperty(sel->display, req->requestor, property, sel->incr_atom, 32,
+        PropModeReplace, (unsigned char *)&size, 1);
+
+    sel->transfers = realloc(sel->transfers, (sel->ntransfers + 1) * sizeof(Transfer));
+    sel->transfers[sel->ntransfers++] = (Transfer){req->requestor, property, type, text, 0, now()};
+    return property;
+}
+
+void selection_request(Selection *sel, const XSelectionRequestEvent *req)
+{
+    drop_stale_transfers(sel);
+
+    // Obsolete clients leave the property to us.
+    Atom property = req->property != None ? req->property : req->target;
+
+    int (*old)(Display *, XErrorEvent *) = trap_errors();
+    XEvent e = {0};
+    e.xselection.type = SelectionNotify;
+    e.xselection.display = req->display;
+    e.xselection.requestor = req->requestor;
+    e.xselection.selection = req->selection;
+    e.xselection.target = req->target;
+    e.xselection.time = req->time;
+    e.xselection.property = convert(sel, req, property);
+    XSendEvent(sel->display, req->requestor, False, NoEventMask, &e);
+
+    if (!untrap_errors(sel->display, old))
+    {
+        for (int i = sel->ntransfers - 1; i >= 0; --i)
+            if (sel->transfers[i].requestor == req->requestor &&
+                sel->transfers[i].property == property)
+                end_transfer(sel, i);
+    }
+}
+
+// Writes the next chunk of an INCR transfer once the requestor has taken
+// the last one.  Returns whether e belonged to a transfer.
+bool selection_property(Selection *sel, const XPropertyEvent *e)
+{
+    if (e->state != PropertyDelete)
+        return false;
+
+    for (int i = 0; i < sel->ntransfers; ++i)
+    {
+        Transfer *t = &sel->transfers[i];
+        if (t->requestor != e->window || t->property != e->atom)
+            continue;
+
+        size_t n = t->text->len - t->offset;
+        if (n > sel->chunk)
+            n = sel->chunk;
+
+        int (*old)(Display *, XErrorEvent *) = trap_errors();
+        XChangeProperty(sel->display, t->requestor, t->property, t->type, 8,
+            PropModeReplace, (const unsigned char *)t->text->data + t->offset, n);
+        bool ok = untrap_errors(sel->display, old);
+
+        t->offset += n;
+        t->last = now();
+        // The empty chunk ends the transfer.
+        if (!ok || n == 0)
+            end_transfer(sel, i);
+        return true;
+    }
+    return false;
+}
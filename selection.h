@@ -0,0 +1,17 @@
+#ifndef SELECTION_H
+#define SELECTION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <X11/Xlib.h>
+
+typedef struct Selection Selection;
+
+Selection *selection_new(Display *display, Window owner);
+void selection_free(Selection *sel);
+void selection_own(Selection *sel, Atom selection, char *text, size_t len);
+void selection_request(Selection *sel, const XSelectionRequestEvent *req);
+void selection_clear(Selection *sel, const XSelectionClearEvent *e);
+bool selection_property(Selection *sel, const XPropertyEvent *e);
+
+#endif // SELECTION_H
@@ -0,0 +1,231 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "server.h"
+
+// The Unix sockets of the viewer (the resident server's, one per X display,
+// and --control ones) and the line protocol spoken over them: a client
+// writes a request of one or more lines, ended by an empty line or by
+// closing its end, and reads the reply lines.  The viewer collects requests
+// without blocking, as its event loop finds the sockets readable.  Either
+// end hangs up on a peer of another user, since the socket may be in /tmp.
+
+#define REQUEST_TIMEOUT_MS 1000
+#define REQUEST_MAX 65536
+
+struct ServerClient {
+    int fd;
+    char *buf;
+    size_t len;
+};
+
+// $XDG_RUNTIME_DIR/breathe-<display>, or /tmp/breathe-<uid>-<display>.
+bool server_socket_path(char *path, size_t size)
+{
+    const char *display = getenv("DISPLAY");
+    if (display == NULL || *display == '\0')
+        return false;
+
+    char name[64];
+    size_t i;
+    for (i = 0; display[i] && i < sizeof(name) - 1; ++i)
+        name[i] = display[i] == '/' ? '_' : display[i];
+    name[i] = '\0';
+
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    int len = dir && *dir
+        ? snprintf(path, size, "%s/breathe-%s", dir, name)
+        : snprintf(path, size, "/tmp/breathe-%d-%s", (int)getuid(), name);
+    return len > 0 && (size_t)len < size && (size_t)len < sizeof(((struct sockaddr_un *)0)->sun_path);
+}
+
+static bool peer_is_us(int fd)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+}
+
+static struct sockaddr_un socket_address(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    return addr;
+}
+
+// A connected socket, or -1 when no server of ours listens at path.
+int server_connect(const char *path)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    struct sockaddr_un addr = socket_address(path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || !peer_is_us(fd))
+    {
+        close(fd);
+        return -1;
+    }
+
+    struct timeval tv = {REQUEST_TIMEOUT_MS / 1000, REQUEST_TIMEOUT_MS % 1000 * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+// A non-blocking listening socket at path, replacing a stale one left by a
+// server that died; -1 if another server is already listening there.
+int server_listen(const char *path)
+{
+    int other = server_connect(path);
+    if (other >= 0)
+    {
+        close(other);
+        return -1;
+    }
+    unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+        return -1;
+
+    struct sockaddr_un addr = socket_address(path);
+    mode_t mask = umask(077);
+    int ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (ret != 0 || listen(fd, 16) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// The next waiting client, or NULL.  Replies to it are written with a
+// timeout.
+ServerClient *server_client_accept(int listen_fd)
+{
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0)
+        return NULL;
+    if (!peer_is_us(fd))
+    {
+        close(fd);
+        return NULL;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    // Accepted sockets inherit O_NONBLOCK on some systems.
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+    struct timeval tv = {REQUEST_TIMEOUT_MS / 1000, REQUEST_TIMEOUT_MS % 1000 * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    ServerClient *c = calloc(1, sizeof(ServerClient));
+    c->fd = fd;
+    c->buf = malloc(1);
+    c->buf[0] = '\0';
+    return c;
+}
+
+void server_client_free(ServerClient *c)
+{
+    if (c == NULL)
+        return;
+    close(c->fd);
+    free(c->buf);
+    free(c);
+}
+
+int server_client_fd(const ServerClient *c)
+{
+    return c->fd;
+}
+
+static bool request_complete(const ServerClient *c)
+{
+    return (c->len > 0 && c->buf[0] == '\n') || strstr(c->buf, "\n\n") != NULL;
+}
+
+// Takes in what the client has sent so far: 1 once the request is complete,
+// 0 while more is to come, -1 on errors and oversized requests.
+int server_client_read(ServerClient *c)
+{
+    char chunk[4096];
+    while (true)
+    {
+        ssize_t n = recv(c->fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        if (n == 0)
+            return c->len > 0 ? 1 : -1;
+        if (c->len + n > REQUEST_MAX)
+            return -1;
+
+        c->buf = realloc(c->buf, c->len + n + 1);
+        memcpy(c->buf + c->len, chunk, n);
+        c->len += n;
+        c->buf[c->len] = '\0';
+        if (request_complete(c))
+            return 1;
+    }
+}
+
+// The request, one command per line.
+char *server_client_request(ServerClient *c)
+{
+    return c->buf;
+}
+
+bool server_client_reply(ServerClient *c, const char *str)
+{
+    return server_write(c->fd, str);
+}
+
+// Reads up to a newline, which is dropped; false on end of file, timeout or
+// a line too long for size.
+bool server_read_line(int fd, char *line, size_t size)
+{
+    size_t len = 0;
+    while (len < size - 1)
+    {
+        ssize_t n = read(fd, line + len, 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        if (line[len] == '\n')
+        {
+            line[len] = '\0';
+            return true;
+        }
+        ++len;
+    }
+    return false;
+}
+
+bool server_write(int fd, const char *str)
+{
+    size_t len = strlen(str);
+    while (len > 0)
+    {
+        ssize_t n = send(fd, str, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        str += n;
+        len -= n;
+    }
+    return true;
+}
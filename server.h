@@ -0,0 +1,22 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct ServerClient ServerClient;
+
+bool server_socket_path(char *path, size_t size);
+int server_listen(const char *path);
+int server_connect(const char *path);
+bool server_read_line(int fd, char *line, size_t size);
+bool server_write(int fd, const char *str);
+
+ServerClient *server_client_accept(int listen_fd);
+void server_client_free(ServerClient *c);
+int server_client_fd(const ServerClient *c);
+int server_client_read(ServerClient *c);
+char *server_client_request(ServerClient *c);
+bool server_client_reply(ServerClient *c, const char *str);
+
+#endif // SERVER_H
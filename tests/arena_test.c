@@ -0,0 +1,102 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "arena.h"
+
+// Allocations are checked for alignment and overlap, and the counters for
+// what --alloc-stats reports: a workload that repeats itself stops taking
+// blocks from the heap once the arena has grown to fit it.
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        ++failures; \
+    } \
+} while (0)
+
+static void test_alignment(void)
+{
+    Arena a;
+    arena_init(&a, 256);
+    char *prev = NULL;
+    size_t prev_size = 0;
+    for (size_t size = 1; size < 100; size += 7)
+    {
+        char *p = arena_alloc(&a, size);
+        CHECK(p != NULL);
+        CHECK((uintptr_t)p % 16 == 0);
+        memset(p, 0xab, size);
+        // Within a block, each allocation starts past the previous one.
+        if (prev && p > prev)
+            CHECK(p >= prev + prev_size);
+        prev = p;
+        prev_size = size;
+    }
+    arena_release(&a);
+    CHECK(a.block == NULL);
+}
+
+static void test_stats(void)
+{
+    Arena a;
+    arena_init(&a, 64);
+    CHECK(a.stats.heap_allocs == 1);
+
+    arena_alloc(&a, 10);
+    arena_alloc(&a, 20);
+    CHECK(a.stats.allocs == 2);
+    CHECK(a.stats.bytes == 30);
+    CHECK(a.used == 48);
+
+    // Overflowing the block chains another one; the reset folds them.
+    arena_alloc(&a, 100);
+    CHECK(a.stats.heap_allocs == 2);
+    arena_reset(&a);
+    CHECK(a.stats.resets == 1);
+    CHECK(a.stats.heap_resets == 1);
+    CHECK(a.stats.heap_allocs == 3);
+    CHECK(a.stats.peak == 160);
+    CHECK(a.used == 0);
+
+    // The same iteration again fits in the folded block.
+    for (int i = 0; i < 10; ++i)
+    {
+        arena_alloc(&a, 10);
+        arena_alloc(&a, 20);
+        arena_alloc(&a, 100);
+        arena_reset(&a);
+    }
+    CHECK(a.stats.heap_allocs == 3);
+    CHECK(a.stats.heap_resets == 1);
+    CHECK(a.stats.resets == 11);
+    CHECK(a.stats.bytes == 30 + 100 + 10 * 130);
+    arena_release(&a);
+}
+
+static void test_large(void)
+{
+    Arena a;
+    arena_init(&a, 64);
+    char *p = arena_alloc(&a, 1 << 20);
+    CHECK(p != NULL);
+    memset(p, 1, 1 << 20);
+    arena_reset(&a);
+    CHECK(arena_alloc(&a, 1 << 20) != NULL);
+    CHECK(a.stats.heap_allocs == 3);
+    arena_release(&a);
+}
+
+int main(void)
+{
+    test_alignment();
+    test_stats();
+    test_large();
+
+    if (failures)
+        fprintf(stderr, "arena_test: %d failures\n", failures);
+    else
+        printf("arena_test: ok\n");
+    return failures != 0;
+}
@@ -0,0 +1,49 @@
+#!/bin/sh
+# Pages through the multi-GB corpus document in the viewer and checks that
+# its peak resident memory (VmHWM) stays under a limit, in MiB.  Needs an X
+# display, e.g. under xvfb-run, and no resident server running, so that the
+# window is this process's own.
+#
+#   tests/large_file_rss.sh [limit_mb] [step]
+
+set -eu
+
+limit_mb=${1:-512}
+step=${2:-25}
+pdf=corpus/huge.pdf
+
+[ -x ./breathe ] || make breathe
+[ -f "$pdf" ] || make corpus CORPUS=huge
+
+sock=$(mktemp -u "${TMPDIR:-/tmp}/breathe-rss-XXXXXX")
+log=$(mktemp "${TMPDIR:-/tmp}/breathe-rss-log-XXXXXX")
+/usr/bin/time -v ./breathe --control "$sock" "$pdf" 2>"$log" &
+time_pid=$!
+trap 'kill $time_pid 2>/dev/null; rm -f "$sock" "$log"' EXIT
+
+tries=0
+until [ -S "$sock" ]; do
+    tries=$((tries + 1))
+    [ $tries -lt 600 ] || { echo "large_file_rss: viewer did not start" >&2; exit 1; }
+    sleep 0.1
+done
+pid=$(pgrep -n -P "$time_pid" breathe)
+
+pages=$(./breathe --control "$sock" --send state | sed -n 's/.* pages=\([0-9]*\) .*/\1/p')
+peak=0
+page=1
+while [ "$page" -le "$pages" ]; do
+    ./breathe --control "$sock" --send "goto $page; state" >/dev/null
+    sleep 0.2
+    rss=$(sed -n 's/^VmHWM: *\([0-9]*\) kB/\1/p' "/proc/$pid/status")
+    echo "page $page: peak $((rss / 1024)) MiB"
+    peak=$rss
+    page=$((page + step))
+done
+
+kill "$pid"
+wait "$time_pid" 2>/dev/null || true
+grep "Maximum resident set size" "$log" || true
+
+echo "large_file_rss: $pages pages, peak $((peak / 1024)) MiB, limit $limit_mb MiB"
+[ $((peak / 1024)) -le "$limit_mb" ]
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "rectangle.h"
+
+// Times the region operations on the shapes the viewer feeds them: a glyph
+// selection (one rectangle per line, ragged first and last line) that grows
+// by a line per drag step, an expose rectangle around the status bar, and a
+// handful of scattered expose rectangles.  Each line is the mean time of
+// one call; run as tests/rectangle_bench [iterations].
+
+static volatile int sink;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Lines of text 14 pixels apart, as text_layout_selection() reports them:
+// the first starts mid-line, the last ends mid-line, the rest vary a little
+// in width.
+static int make_selection(Rectangle *rects, int lines)
+{
+    for (int i = 0; i < lines; ++i)
+    {
+        int x = 72, w = 450 + (i * 37) % 30;
+        if (i == 0)
+        {
+            x = 300;
+            w = 222;
+        }
+        else if (i == lines - 1)
+            w = 180;
+        rects[i] = (Rectangle){x, 100 + 14 * i, w, 13};
+    }
+    return lines;
+}
+
+static void report(const char *name, int iterations, double start)
+{
+    printf("%-40s %8.1f ns\n", name, (now_ns() - start) / iterations);
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 200000;
+    if (iterations <= 0)
+    {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    Rectangle sel[REGION_MAX_RECTS];
+    int nsel = make_selection(sel, 24);
+    Rectangle grown[REGION_MAX_RECTS];
+    int ngrown = make_selection(grown, 25);
+    Rectangle expose = {0, 0, 800, 1000};
+    Rectangle status = {0, 980, 800, 20};
+    Rectangle scattered[] = {
+        {10, 10, 200, 50}, {150, 40, 300, 80}, {600, 0, 100, 900},
+        {0, 500, 800, 30}, {400, 700, 120, 120}, {20, 950, 760, 50},
+    };
+    int nscattered = sizeof(scattered) / sizeof(scattered[0]);
+
+    RectRegion a, b, dst;
+    double start;
+
+    // Coalescing: per-line rectangles into a banded region.
+    start = now_ns();
+    for (int i = 0; i < iterations; ++i)
+    {
+        region_init_rects(&a, sel, nsel);
+        sink += a.size;
+    }
+    report("coalesce selection (24 lines)", iterations, start);
+
+    start = now_ns();
+    for (int i = 0; i < iterations; ++i)
+    {
+        region_init_rects(&a, scattered, nscattered);
+        sink += a.size;
+    }
+    report("coalesce scattered exposes (6)", iterations, start);
+
+    // A drag step: the damage is what changed between two selections.
+    region_init_rects(&a, sel, nsel);
+    region_init_rects(&b, grown, ngrown);
+    start = now_ns();
+    for (int i = 0; i < iterations; ++i)
+    {
+        region_xor(&dst, &a, &b);
+        sink += dst.size;
+    }
+    report("xor selection drag step", iterations, start);
+
+    start = now_ns();
+    for (int i = 0; i < iterations; ++i)
+    {
+        region_union(&dst, &a, &b);
+        sink += dst.size;
+    }
+    report("union selections", iterations, start);
+
+    start = now_ns();
+    for (int i = 0; i < iterations; ++i)
+    {
+        region_subtract(&dst, &b, &a);
+        sink += dst.size;
+    }
+    report("subtract selections", iterations, start);
+
+    RectRegion clip;
+    region_init_rect(&clip, &(Rectangle){200, 150, 300, 200});
+    start = now_ns();
+    for (int i = 0; i < iterations; ++i)
+    {
+        region_intersect(&dst, &b, &clip);
+        sink += dst.size;
+    }
+    report("intersect selection with expose", iterations, start);
+
+    // Expose handling: the exposed area minus the status bar.
+    start = now_ns();
+    for (int i = 0; i < iterations; ++i)
+    {
+        region_init_rect(&dst, &expose);
+        region_subtract_rect(&dst, &status);
+        sink += dst.size;
+    }
+    report("expose minus status bar", iterations, start);
+
+    start = now_ns();
+    for (int i = 0; i < iterations; ++i)
+    {
+        region_init(&dst);
+        for (int j = 0; j < nscattered; ++j)
+            region_union_rect(&dst, &scattered[j]);
+        sink += dst.size;
+    }
+    report("union scattered exposes one by one", iterations, start);
+
+    return 0;
+}
@@ -0,0 +1,263 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "rectangle.h"
+
+// Region results are checked pixel by pixel against the same operation on
+// a small grid, and for the invariants the expose code relies on: no empty
+// and no overlapping rectangles, in banded order.
+
+#define GRID 40
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        ++failures; \
+    } \
+} while (0)
+
+typedef bool Grid[GRID][GRID];
+
+static bool rect_has(const Rectangle *r, int x, int y)
+{
+    return x >= r->x && x < r->x + r->width && y >= r->y && y < r->y + r->height;
+}
+
+static bool region_has(const RectRegion *r, int x, int y)
+{
+    for (int i = 0; i < r->size; ++i)
+        if (rect_has(&r->rects[i], x, y))
+            return true;
+    return false;
+}
+
+static void region_to_grid(const RectRegion *r, Grid g)
+{
+    for (int y = 0; y < GRID; ++y)
+        for (int x = 0; x < GRID; ++x)
+            g[y][x] = region_has(r, x - GRID / 4, y - GRID / 4);
+}
+
+static bool well_formed(const RectRegion *r)
+{
+    for (int i = 0; i < r->size; ++i)
+    {
+        const Rectangle *p = &r->rects[i];
+        if (p->width <= 0 || p->height <= 0)
+            return false;
+        if (i > 0)
+        {
+            const Rectangle *q = &r->rects[i - 1];
+            if (p->y < q->y || (p->y == q->y && p->x < q->x))
+                return false;
+        }
+        for (int j = 0; j < i; ++j)
+        {
+            Rectangle o = rectangle_intersect(p, &r->rects[j]);
+            if (o.width > 0 && o.height > 0)
+                return false;
+        }
+    }
+    return true;
+}
+
+typedef enum { UNION, SUBTRACT, INTERSECT, XOR } Op;
+
+static bool op_keeps(Op op, bool a, bool b)
+{
+    switch (op)
+    {
+        case UNION:     return a || b;
+        case SUBTRACT:  return a && !b;
+        case INTERSECT: return a && b;
+        case XOR:       return a != b;
+    }
+    return false;
+}
+
+static void check_op(Op op, const RectRegion *a, const RectRegion *b, int line)
+{
+    RectRegion dst;
+    switch (op)
+    {
+        case UNION:     region_union(&dst, a, b); break;
+        case SUBTRACT:  region_subtract(&dst, a, b); break;
+        case INTERSECT: region_intersect(&dst, a, b); break;
+        case XOR:       region_xor(&dst, a, b); break;
+    }
+
+    static Grid ga, gb, gd;
+    region_to_grid(a, ga);
+    region_to_grid(b, gb);
+    region_to_grid(&dst, gd);
+    bool exact = true;
+    for (int y = 0; y < GRID; ++y)
+        for (int x = 0; x < GRID; ++x)
+            exact = exact && gd[y][x] == op_keeps(op, ga[y][x], gb[y][x]);
+
+    if (!exact || !well_formed(&dst))
+    {
+        fprintf(stderr, "%s:%d: region op %d gave a wrong result\n", __FILE__, line, op);
+        ++failures;
+    }
+}
+
+static void check_all_ops(const Rectangle *ra, int na, const Rectangle *rb, int nb, int line)
+{
+    RectRegion a, b;
+    region_init_rects(&a, ra, na);
+    region_init_rects(&b, rb, nb);
+    for (Op op = UNION; op <= XOR; ++op)
+        check_op(op, &a, &b, line);
+}
+
+static void test_rectangle_intersect(void)
+{
+    Rectangle a = {0, 0, 10, 10}, b = {5, 5, 10, 10};
+    Rectangle r = rectangle_intersect(&a, &b);
+    CHECK(rectangle_equals(&r, &(Rectangle){5, 5, 5, 5}));
+
+    // Touching edges share no area.
+    Rectangle c = {10, 0, 5, 10};
+    r = rectangle_intersect(&a, &c);
+    CHECK(r.width == 0 && r.height == 10);
+
+    // Disjoint rectangles come out with a negative extent.
+    Rectangle d = {20, 20, 5, 5};
+    r = rectangle_intersect(&a, &d);
+    CHECK(r.width < 0 && r.height < 0);
+
+    Rectangle e = {0, 0, 0, 0};
+    r = rectangle_intersect(&a, &e);
+    CHECK(r.width == 0 && r.height == 0);
+}
+
+static void test_rectangle_normalize(void)
+{
+    Rectangle r = rectangle_normalize(&(Rectangle){10, 20, -4, -6});
+    CHECK(rectangle_equals(&r, &(Rectangle){6, 14, 4, 6}));
+    r = rectangle_normalize(&(Rectangle){1, 2, 3, 4});
+    CHECK(rectangle_equals(&r, &(Rectangle){1, 2, 3, 4}));
+
+    CHECK(rectangle_is_invalid(&(Rectangle){-1, 0, 1, 1}));
+    CHECK(rectangle_is_invalid(&(Rectangle){0, 0, -1, 1}));
+    CHECK(!rectangle_is_invalid(&(Rectangle){0, 0, 0, 0}));
+
+    r = rectangle_pad(&(Rectangle){5, 5, 2, 2}, 3);
+    CHECK(rectangle_equals(&r, &(Rectangle){2, 2, 8, 8}));
+}
+
+static void test_region_init(void)
+{
+    RectRegion r;
+    region_init_rect(&r, &(Rectangle){3, 3, 0, 5});
+    CHECK(region_is_empty(&r));
+    region_init_rect(&r, &(Rectangle){3, 3, 5, 0});
+    CHECK(region_is_empty(&r));
+
+    // Negative sizes are normalized, as a drag up and left produces them.
+    region_init_rect(&r, &(Rectangle){10, 10, -4, -2});
+    CHECK(r.size == 1 && rectangle_equals(&r.rects[0], &(Rectangle){6, 8, 4, 2}));
+
+    region_init(&r);
+    Rectangle b = region_bounds(&r);
+    CHECK(b.width == 0 && b.height == 0);
+}
+
+static void test_region_edge_cases(void)
+{
+    Rectangle a = {0, 0, 10, 10};
+    Rectangle empty = {4, 4, 0, 0};
+    Rectangle negative = {14, 14, -6, -6};
+    Rectangle right = {10, 0, 10, 10};
+    Rectangle below = {0, 10, 10, 10};
+    Rectangle corner = {10, 10, 5, 5};
+    Rectangle inside = {2, 3, 4, 5};
+    Rectangle same = {0, 0, 10, 10};
+    Rectangle far = {-10, -10, 3, 3};
+
+    check_all_ops(&a, 1, &empty, 1, __LINE__);
+    check_all_ops(&empty, 1, &a, 1, __LINE__);
+    check_all_ops(&a, 1, &negative, 1, __LINE__);
+    check_all_ops(&a, 1, &right, 1, __LINE__);
+    check_all_ops(&a, 1, &below, 1, __LINE__);
+    check_all_ops(&a, 1, &corner, 1, __LINE__);
+    check_all_ops(&a, 1, &inside, 1, __LINE__);
+    check_all_ops(&inside, 1, &a, 1, __LINE__);
+    check_all_ops(&a, 1, &same, 1, __LINE__);
+    check_all_ops(&a, 1, &far, 1, __LINE__);
+    check_all_ops(NULL, 0, NULL, 0, __LINE__);
+}
+
+static void test_region_coalescing(void)
+{
+    // Touching halves merge into one rectangle, side by side or stacked.
+    RectRegion r;
+    Rectangle halves[] = {{0, 0, 5, 10}, {5, 0, 5, 10}};
+    region_init_rects(&r, halves, 2);
+    CHECK(r.size == 1 && rectangle_equals(&r.rects[0], &(Rectangle){0, 0, 10, 10}));
+
+    Rectangle stacked[] = {{0, 0, 10, 4}, {0, 4, 10, 6}};
+    region_init_rects(&r, stacked, 2);
+    CHECK(r.size == 1 && rectangle_equals(&r.rects[0], &(Rectangle){0, 0, 10, 10}));
+
+    // A hole punched out of the middle leaves four bands' worth.
+    region_init_rect(&r, &(Rectangle){0, 0, 10, 10});
+    region_subtract_rect(&r, &(Rectangle){3, 3, 4, 4});
+    CHECK(r.size == 4 && well_formed(&r));
+
+    region_intersect_rect(&r, &(Rectangle){0, 0, 10, 3});
+    CHECK(r.size == 1 && rectangle_equals(&r.rects[0], &(Rectangle){0, 0, 10, 3}));
+}
+
+static void test_region_random(void)
+{
+    srand(1);
+    for (int round = 0; round < 2000; ++round)
+    {
+        Rectangle ra[4], rb[4];
+        int na = rand() % 5, nb = rand() % 5;
+        for (int i = 0; i < na; ++i)
+            ra[i] = (Rectangle){rand() % 24 - 4, rand() % 24 - 4, rand() % 15 - 4, rand() % 15 - 4};
+        for (int i = 0; i < nb; ++i)
+            rb[i] = (Rectangle){rand() % 24 - 4, rand() % 24 - 4, rand() % 15 - 4, rand() % 15 - 4};
+        check_all_ops(ra, na, rb, nb, __LINE__);
+    }
+}
+
+static void test_region_overflow(void)
+{
+    // A checkerboard needs more rectangles than a region holds: the result
+    // collapses to a bounding box that still covers every square.
+    RectRegion r;
+    region_init(&r);
+    for (int y = 0; y < 12; ++y)
+        for (int x = 0; x < 12; ++x)
+            if ((x + y) % 2 == 0)
+                region_union_rect(&r, &(Rectangle){x * 2, y * 2, 2, 2});
+
+    CHECK(r.size >= 1 && r.size <= REGION_MAX_RECTS && well_formed(&r));
+    for (int y = 0; y < 12; ++y)
+        for (int x = 0; x < 12; ++x)
+            if ((x + y) % 2 == 0)
+                CHECK(region_has(&r, x * 2, y * 2));
+}
+
+int main(void)
+{
+    test_rectangle_intersect();
+    test_rectangle_normalize();
+    test_region_init();
+    test_region_edge_cases();
+    test_region_coalescing();
+    test_region_random();
+    test_region_overflow();
+
+    if (failures)
+        fprintf(stderr, "rectangle_test: %d failures\n", failures);
+    else
+        printf("rectangle_test: ok\n");
+    return failures != 0;
+}
@@ -0,0 +1,164 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "server.h"
+
+// Talks to a listening socket in a temporary directory the way the viewer
+// and `breathe --send` do: requests are collected without blocking until
+// their empty line or end of file, replies are read back line by line.
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        ++failures; \
+    } \
+} while (0)
+
+static char dir[] = "/tmp/breathe-test-XXXXXX";
+static char path[64];
+
+static void test_socket_path(void)
+{
+    char p[128], want[128];
+
+    unsetenv("DISPLAY");
+    CHECK(!server_socket_path(p, sizeof(p)));
+
+    setenv("DISPLAY", "host/unix:1.0", 1);
+    setenv("XDG_RUNTIME_DIR", "/run/user/1000", 1);
+    CHECK(server_socket_path(p, sizeof(p)) && strcmp(p, "/run/user/1000/breathe-host_unix:1.0") == 0);
+
+    unsetenv("XDG_RUNTIME_DIR");
+    snprintf(want, sizeof(want), "/tmp/breathe-%d-host_unix:1.0", (int)getuid());
+    CHECK(server_socket_path(p, sizeof(p)) && strcmp(p, want) == 0);
+    CHECK(!server_socket_path(p, 16));
+}
+
+// A client connected to listen_fd, with its accepted end in *c.
+static int connect_client(int listen_fd, ServerClient **c)
+{
+    int fd = server_connect(path);
+    CHECK(fd >= 0);
+    *c = server_client_accept(listen_fd);
+    CHECK(*c != NULL);
+    return fd;
+}
+
+static void test_listen(void)
+{
+    int fd = server_listen(path);
+    CHECK(fd >= 0);
+    CHECK(server_listen(path) == -1);
+
+    // A socket left behind by a server that died is replaced.
+    close(fd);
+    CHECK(access(path, F_OK) == 0);
+    CHECK(server_connect(path) == -1);
+    fd = server_listen(path);
+    CHECK(fd >= 0);
+    close(fd);
+    unlink(path);
+}
+
+static void test_request(int listen_fd)
+{
+    ServerClient *c;
+    int fd = connect_client(listen_fd, &c);
+    if (c == NULL)
+        return;
+
+    CHECK(server_client_read(c) == 0);
+    CHECK(server_write(fd, "goto 3\n"));
+    CHECK(server_client_read(c) == 0);
+    CHECK(server_write(fd, "state\n\n"));
+    CHECK(server_client_read(c) == 1);
+    CHECK(strcmp(server_client_request(c), "goto 3\nstate\n\n") == 0);
+
+    CHECK(server_client_reply(c, "page 3\nok\n"));
+    char line[16];
+    CHECK(server_read_line(fd, line, sizeof(line)) && strcmp(line, "page 3") == 0);
+    CHECK(server_read_line(fd, line, sizeof(line)) && strcmp(line, "ok") == 0);
+
+    // A line too long for the buffer is refused, its rest comes as the next
+    // line; end of file is refused too.
+    CHECK(server_client_reply(c, "0123456789abcdefghij\n"));
+    CHECK(!server_read_line(fd, line, sizeof(line)));
+    CHECK(server_read_line(fd, line, sizeof(line)) && strcmp(line, "fghij") == 0);
+    server_client_free(c);
+    CHECK(!server_read_line(fd, line, sizeof(line)));
+    close(fd);
+}
+
+static void test_end_of_file(int listen_fd)
+{
+    ServerClient *c;
+    int fd = connect_client(listen_fd, &c);
+    if (c == NULL)
+        return;
+    CHECK(server_write(fd, "quit"));
+    shutdown(fd, SHUT_WR);
+    CHECK(server_client_read(c) == 1);
+    CHECK(strcmp(server_client_request(c), "quit") == 0);
+    server_client_free(c);
+    close(fd);
+
+    // Hanging up without a request is an error.
+    fd = connect_client(listen_fd, &c);
+    if (c == NULL)
+        return;
+    close(fd);
+    CHECK(server_client_read(c) == -1);
+    server_client_free(c);
+}
+
+static void test_oversized(int listen_fd)
+{
+    ServerClient *c;
+    int fd = connect_client(listen_fd, &c);
+    if (c == NULL)
+        return;
+
+    char *big = malloc(70000 + 1);
+    memset(big, 'x', 70000);
+    big[70000] = '\0';
+    CHECK(server_write(fd, big));
+    CHECK(server_client_read(c) == -1);
+    free(big);
+    server_client_free(c);
+    close(fd);
+}
+
+int main(void)
+{
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/socket", dir);
+
+    test_socket_path();
+    test_listen();
+
+    int listen_fd = server_listen(path);
+    CHECK(listen_fd >= 0);
+    if (listen_fd >= 0)
+    {
+        test_request(listen_fd);
+        test_end_of_file(listen_fd);
+        test_oversized(listen_fd);
+        close(listen_fd);
+    }
+    unlink(path);
+    rmdir(dir);
+
+    if (failures)
+        fprintf(stderr, "server_test: %d failures\n", failures);
+    else
+        printf("server_test: ok\n");
+    return failures != 0;
+}
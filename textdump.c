@@ -0,0 +1,356 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poppler.h>
+#include "docload.h"
+#include "textdump.h"
+
+// Extracts page text on worker threads, each with its own document, and
+// writes it in page order from the calling thread.  Finished pages wait in
+// a ring of window slots; a worker takes a new page only while it is less
+// than window pages ahead of the writer, so memory stays bounded however
+// long the document is.
+
+typedef struct {
+    const char *file_name;
+    const int *pages;
+    int count;
+    TextDumpFormat format;
+    bool form_feed;
+    const gint *cancel;     // stops the workers when set, may be NULL
+
+    GMutex lock;
+    GCond cond;
+    GString **slots;    // page i waits in slots[i % window]
+    int window;
+    int next;           // next page index to extract
+    int written;        // next page index to write
+    bool failed;
+    bool page_failed;   // a page could not be read, the others are still written
+} TextDump;
+
+static void append_json_string(GString *s, const char *str, gssize len)
+{
+    g_string_append_c(s, '"');
+    for (const char *c = str; len < 0 ? *c != '\0' : c < str + len; ++c)
+    {
+        unsigned char ch = *c;
+        if (ch == '"' || ch == '\\')
+        {
+            g_string_append_c(s, '\\');
+            g_string_append_c(s, ch);
+        }
+        else if (ch < 0x20)
+            g_string_append_printf(s, "\\u%04x", ch);
+        else
+            g_string_append_c(s, ch);
+    }
+    g_string_append_c(s, '"');
+}
+
+// Numbers are formatted the same way whatever the locale.
+static void append_json_number(GString *s, double v)
+{
+    char buf[G_ASCII_DTOSTR_BUF_SIZE];
+    g_string_append(s, g_ascii_formatd(buf, sizeof(buf), "%.2f", v));
+}
+
+static void append_word(GString *s, bool first, const char *start, const char *end,
+    const PopplerRectangle *box)
+{
+    if (!first)
+        g_string_append_c(s, ',');
+    g_string_append(s, "{\"text\":");
+    append_json_string(s, start, end - start);
+    g_string_append(s, ",\"bbox\":[");
+    append_json_number(s, box->x1);
+    g_string_append_c(s, ',');
+    append_json_number(s, box->y1);
+    g_string_append_c(s, ',');
+    append_json_number(s, box->x2);
+    g_string_append_c(s, ',');
+    append_json_number(s, box->y2);
+    g_string_append(s, "]}");
+}
+
+// {"page":N,"width":W,"height":H,"words":[{"text":...,"bbox":[x1,y1,x2,y2]}]}
+// in page points, top-left origin.  Words are runs of non-space characters.
+static void append_json_page(GString *s, PopplerPage *page, int page_num, const char *text)
+{
+    double width, height;
+    poppler_page_get_size(page, &width, &height);
+    g_string_append_printf(s, "{\"page\":%d,\"width\":", page_num);
+    append_json_number(s, width);
+    g_string_append(s, ",\"height\":");
+    append_json_number(s, height);
+    g_string_append(s, ",\"words\":[");
+
+    PopplerRectangle *boxes = NULL;
+    guint nboxes = 0;
+    if (!poppler_page_get_text_layout(page, &boxes, &nboxes))
+        nboxes = 0;
+
+    // Character i of the text owns box i.
+    const char *word = NULL;
+    PopplerRectangle bbox = {0, 0, 0, 0};
+    bool first = true;
+    guint i = 0;
+    const char *c;
+    for (c = text; *c != '\0' && i < nboxes; c = g_utf8_next_char(c), ++i)
+    {
+        if (g_unichar_isspace(g_utf8_get_char(c)))
+        {
+            if (word)
+            {
+                append_word(s, first, word, c, &bbox);
+                first = false;
+                word = NULL;
+            }
+            continue;
+        }
+
+        const PopplerRectangle *b = &boxes[i];
+        if (word == NULL)
+        {
+            word = c;
+            bbox = *b;
+        }
+        else
+        {
+            bbox.x1 = fmin(bbox.x1, b->x1);
+            bbox.y1 = fmin(bbox.y1, b->y1);
+            bbox.x2 = fmax(bbox.x2, b->x2);
+            bbox.y2 = fmax(bbox.y2, b->y2);
+        }
+    }
+    if (word)
+        append_word(s, first, word, c, &bbox);
+
+    g_free(boxes);
+    g_string_append(s, "]}\n");
+}
+
+static GString *extract_page(TextDump *td, PopplerDocument *doc, int page_num)
+{
+    GString *s = g_string_new(NULL);
+    PopplerPage *page = poppler_document_get_page(doc, page_num - 1);
+    if (page == NULL)
+    {
+        fprintf(stderr, "Cannot create page: %d.\n", page_num);
+        g_mutex_lock(&td->lock);
+        td->page_failed = true;
+        g_mutex_unlock(&td->lock);
+        return s;
+    }
+
+    char *text = poppler_page_get_text(page);
+    if (td->format == TEXT_DUMP_JSON)
+        append_json_page(s, page, page_num, text ? text : "");
+    else
+    {
+        if (text && *text)
+        {
+            g_string_append(s, text);
+            if (s->str[s->len - 1] != '\n')
+                g_string_append_c(s, '\n');
+        }
+        if (td->form_feed)
+            g_string_append_c(s, '\f');
+    }
+
+    g_free(text);
+    g_object_unref(page);
+    return s;
+}
+
+static gpointer dump_thread(gpointer data)
+{
+    TextDump *td = data;
+    PopplerDocument *doc = doc_load(td->file_name, NULL);
+    int extracted = 0;
+
+    g_mutex_lock(&td->lock);
+    if (doc == NULL)
+        td->failed = true;
+    while (!td->failed)
+    {
+        while (!td->failed && td->next < td->count && td->next >= td->written + td->window)
+            g_cond_wait(&td->cond, &td->lock);
+        if (td->failed || td->next >= td->count)
+            break;
+        int i = td->next++;
+        g_mutex_unlock(&td->lock);
+
+        GString *s = extract_page(td, doc, td->pages[i]);
+        if (++extracted % 16 == 0)
+            doc_trim(doc);
+
+        g_mutex_lock(&td->lock);
+        td->slots[i % td->window] = s;
+        if (td->cancel && g_atomic_int_get(td->cancel))
+            td->failed = true;
+        g_cond_broadcast(&td->cond);
+    }
+    g_cond_broadcast(&td->cond);
+    g_mutex_unlock(&td->lock);
+
+    if (doc != NULL)
+        g_object_unref(doc);
+    return NULL;
+}
+
+static int run_dump(TextDump *td, int nthreads, FILE *out)
+{
+    int count = td->count;
+    if (nthreads <= 0)
+        nthreads = g_get_num_processors();
+    if (nthreads > count)
+        nthreads = count;
+
+    g_mutex_init(&td->lock);
+    g_cond_init(&td->cond);
+    td->window = nthreads * 4;
+    td->slots = calloc(td->window, sizeof(GString *));
+
+    GThread **threads = calloc(nthreads, sizeof(GThread *));
+    for (int i = 0; i < nthreads; ++i)
+        threads[i] = g_thread_new("dump-text", dump_thread, td);
+
+    g_mutex_lock(&td->lock);
+    while (td->written < count && !td->failed)
+    {
+        GString *s = td->slots[td->written % td->window];
+        if (s == NULL)
+        {
+            g_cond_wait(&td->cond, &td->lock);
+            continue;
+        }
+        td->slots[td->written % td->window] = NULL;
+        g_mutex_unlock(&td->lock);
+
+        bool ok = fwrite(s->str, 1, s->len, out) == s->len;
+        g_string_free(s, TRUE);
+
+        g_mutex_lock(&td->lock);
+        if (!ok)
+            td->failed = true;
+        ++td->written;
+        g_cond_broadcast(&td->cond);
+    }
+    g_mutex_unlock(&td->lock);
+
+    for (int i = 0; i < nthreads; ++i)
+        g_thread_join(threads[i]);
+    for (int i = 0; i < td->window; ++i)
+        if (td->slots[i])
+            g_string_free(td->slots[i], TRUE);
+
+    bool failed = td->failed || fflush(out) != 0;
+    free(threads);
+    free(td->slots);
+    g_cond_clear(&td->cond);
+    g_mutex_clear(&td->lock);
+    return failed ? 1 : 0;
+}
+
+// Writes the text of pages[0..count) to out; nthreads <= 0 uses one worker
+// per core.  Returns 0 on success, nonzero if anything failed, including a
+// single page that could not be read.
+int text_dump(const char *file_name, const int *pages, int count, TextDumpFormat format,
+    bool form_feed, int nthreads, FILE *out)
+{
+    TextDump td = {0};
+    td.file_name = file_name;
+    td.pages = pages;
+    td.count = count;
+    td.format = format;
+    td.form_feed = form_feed;
+    int ret = run_dump(&td, nthreads, out);
+    return ret != 0 || td.page_failed ? 1 : 0;
+}
+
+// The plain text of a page range, extracted into memory in the background
+// for copying to the clipboard.
+
+struct TextCopy {
+    char *file_name;
+    int *pages;
+    int count;
+    int nthreads;
+    int wake_fd;
+    GThread *thread;
+    gint done;
+    gint cancel;
+    char *text;
+    size_t len;
+    bool failed;
+};
+
+static gpointer copy_thread(gpointer data)
+{
+    TextCopy *tc = data;
+    FILE *out = open_memstream(&tc->text, &tc->len);
+    if (out == NULL)
+        tc->failed = true;
+    else
+    {
+        TextDump td = {0};
+        td.file_name = tc->file_name;
+        td.pages = tc->pages;
+        td.count = tc->count;
+        td.format = TEXT_DUMP_PLAIN;
+        td.cancel = &tc->cancel;
+        tc->failed = run_dump(&td, tc->nthreads, out) != 0;
+        if (fclose(out) != 0)
+            tc->failed = true;
+    }
+    g_atomic_int_set(&tc->done, 1);
+
+    char c = 0;
+    ssize_t r = write(tc->wake_fd, &c, 1);
+    (void)r;
+    return NULL;
+}
+
+// Extracts pages first..last of file_name; wake_fd gets a byte when done.
+TextCopy *text_copy_new(const char *file_name, int first, int last, int nthreads, int wake_fd)
+{
+    TextCopy *tc = calloc(1, sizeof(TextCopy));
+    tc->file_name = strdup(file_name);
+    tc->count = last - first + 1;
+    tc->pages = malloc(tc->count * sizeof(int));
+    for (int i = 0; i < tc->count; ++i)
+        tc->pages[i] = first + i;
+    tc->nthreads = nthreads;
+    tc->wake_fd = wake_fd;
+    tc->thread = g_thread_new("text-copy", copy_thread, tc);
+    return tc;
+}
+
+bool text_copy_done(TextCopy *tc)
+{
+    return g_atomic_int_get(&tc->done);
+}
+
+// Waits for the extraction and frees tc, returning the text (len bytes,
+// malloc'ed) or NULL on failure.  With cancel set the workers stop early
+// and NULL is returned.
+char *text_copy_finish(TextCopy *tc, bool cancel, size_t *len)
+{
+    if (cancel)
+        g_atomic_int_set(&tc->cancel, 1);
+    g_thread_join(tc->thread);
+
+    char *text = tc->text;
+    if (tc->failed || cancel) {
+        free(text);
+        text = NULL;
+    }
+    *len = text ? tc->len : 0;
+
+    free(tc->pages);
+    free(tc->file_name);
+    free(tc);
+    return text;
+}
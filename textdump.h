@@ -0,0 +1,21 @@
+#ifndef TEXTDUMP_H
+#define TEXTDUMP_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+typedef enum {
+    TEXT_DUMP_PLAIN,
+    TEXT_DUMP_JSON,     // one object per page and line, with word boxes
+} TextDumpFormat;
+
+int text_dump(const char *file_name, const int *pages, int count, TextDumpFormat format,
+    bool form_feed, int nthreads, FILE *out);
+
+typedef struct TextCopy TextCopy;
+
+TextCopy *text_copy_new(const char *file_name, int first, int last, int nthreads, int wake_fd);
+bool text_copy_done(TextCopy *tc);
+char *text_copy_finish(TextCopy *tc, bool cancel, size_t *len);
+
+#endif // TEXTDUMP_H
@@ -0,0 +1,742 @@
+#include <ctype.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <poppler.h>
+#include "docload.h"
+#include "textindex.h"
+
+// The index is built by a background thread holding its own PopplerDocument,
+// one page at a time in page order, so pages [1, done] are always searchable.
+// Each page keeps its text and one box per character of that text; a trigram
+// table maps every three byte sequence of the lowercased text to the sorted
+// list of pages containing it.  A query intersects the lists of its
+// trigrams and only verifies the surviving pages against their text.
+// Lowercasing is per Unicode character (g_unichar_tolower), so "Ä" finds
+// "ä" here just as it does in poppler's own search before the index is done.
+
+#define INDEX_MAGIC "BRTHIDX1"
+#define BOX_SCALE 4.0  // boxes are stored in quarter points
+#define MAX_QUERY_TRIGRAMS 64
+
+typedef struct {
+    char *text;
+    uint32_t len;
+    uint16_t *boxes;   // x1, y1, x2, y2 per character, top-left origin
+    uint32_t nchars;
+    float height;
+} IndexedPage;
+
+typedef struct {
+    uint32_t key;
+    uint32_t *pages;
+    int size;
+    int capacity;
+} Posting;
+
+struct TextIndex {
+    char *file_name;
+    char *index_path;
+    bool persist;
+    int total_pages;
+    IndexedPage *pages;
+
+    Posting *table;
+    uint32_t table_capacity;
+    uint32_t table_size;
+
+    GMutex lock;
+    int done;
+    size_t bytes;       // heap held by pages and postings
+    gint cancel;
+    GThread *thread;
+};
+
+static inline uint32_t trigram_key(const char *p)
+{
+    return ((uint32_t)(unsigned char)p[0] << 16) | ((uint32_t)(unsigned char)p[1] << 8) |
+           (uint32_t)(unsigned char)p[2];
+}
+
+// Decodes the character at p, n bytes left, and returns its length.  A
+// malformed byte stands for itself, as a code no character has.
+static int next_char(const char *p, size_t n, gunichar *c)
+{
+    gunichar u = g_utf8_get_char_validated(p, n);
+    if (u == (gunichar)-1 || u == (gunichar)-2)
+    {
+        *c = 0x80000000u | (unsigned char)*p;
+        return 1;
+    }
+    *c = u;
+    return g_utf8_next_char(p) - p;
+}
+
+static inline bool is_continuation(char c)
+{
+    return ((unsigned char)c & 0xc0) == 0x80;
+}
+
+// s with every character lowercased (malformed bytes kept), in a new buffer
+// of *folded_len bytes; trigrams are taken from this.
+static char *fold_text(const char *s, size_t len, size_t *folded_len)
+{
+    // A lowercase character takes at most half as many bytes again.
+    char *out = malloc(len + len / 2 + 4);
+    size_t n = 0;
+    for (size_t i = 0; i < len; )
+    {
+        gunichar c;
+        int clen = next_char(s + i, len - i, &c);
+        if (c & 0x80000000u)
+            out[n++] = s[i];
+        else
+            n += g_unichar_to_utf8(g_unichar_tolower(c), out + n);
+        i += clen;
+    }
+    out[n] = '\0';
+    *folded_len = n;
+    return out;
+}
+
+static inline uint32_t hash_key(uint32_t key)
+{
+    return key * 2654435761u;
+}
+
+static Posting *table_lookup(const TextIndex *ti, uint32_t key)
+{
+    if (ti->table_capacity == 0)
+        return NULL;
+
+    uint32_t mask = ti->table_capacity - 1;
+    for (uint32_t i = hash_key(key) & mask; ; i = (i + 1) & mask)
+    {
+        Posting *p = &ti->table[i];
+        if (p->pages == NULL)
+            return NULL;
+        if (p->key == key)
+            return p;
+    }
+}
+
+static Posting *table_insert(TextIndex *ti, uint32_t key)
+{
+    if (2 * (ti->table_size + 1) > ti->table_capacity)
+    {
+        uint32_t capacity = ti->table_capacity ? ti->table_capacity * 2 : 4096;
+        Posting *table = calloc(capacity, sizeof(Posting));
+        for (uint32_t i = 0; i < ti->table_capacity; ++i)
+        {
+            Posting *p = &ti->table[i];
+            if (p->pages == NULL)
+                continue;
+            uint32_t j = hash_key(p->key) & (capacity - 1);
+            while (table[j].pages != NULL)
+                j = (j + 1) & (capacity - 1);
+            table[j] = *p;
+        }
+        free(ti->table);
+        ti->bytes += (capacity - ti->table_capacity) * sizeof(Posting);
+        ti->table = table;
+        ti->table_capacity = capacity;
+    }
+
+    uint32_t mask = ti->table_capacity - 1;
+    uint32_t i = hash_key(key) & mask;
+    while (ti->table[i].pages != NULL && ti->table[i].key != key)
+        i = (i + 1) & mask;
+
+    Posting *p = &ti->table[i];
+    if (p->pages == NULL)
+    {
+        p->key = key;
+        p->capacity = 4;
+        p->size = 0;
+        p->pages = malloc(p->capacity * sizeof(uint32_t));
+        ++ti->table_size;
+        ti->bytes += p->capacity * sizeof(uint32_t);
+    }
+    return p;
+}
+
+static void index_page_trigrams(TextIndex *ti, uint32_t page, const char *folded, size_t len)
+{
+    for (size_t i = 0; i + 3 <= len; ++i)
+    {
+        Posting *p = table_insert(ti, trigram_key(folded + i));
+        if (p->size > 0 && p->pages[p->size - 1] == page)
+            continue;
+        if (p->size == p->capacity)
+        {
+            ti->bytes += p->capacity * sizeof(uint32_t);
+            p->capacity *= 2;
+            p->pages = realloc(p->pages, p->capacity * sizeof(uint32_t));
+        }
+        p->pages[p->size++] = page;
+    }
+}
+
+// Makes page n searchable.
+static void add_page(TextIndex *ti, int n, IndexedPage ip)
+{
+    size_t folded_len = 0;
+    char *folded = ip.text ? fold_text(ip.text, ip.len, &folded_len) : NULL;
+
+    g_mutex_lock(&ti->lock);
+    ti->pages[n] = ip;
+    ti->bytes += ip.len + 1 + 4 * (size_t)ip.nchars * sizeof(uint16_t);
+    index_page_trigrams(ti, n, folded, folded_len);
+    ti->done = n + 1;
+    g_mutex_unlock(&ti->lock);
+    free(folded);
+}
+
+static void extract_page(PopplerDocument *doc, int n, IndexedPage *ip)
+{
+    *ip = (IndexedPage){0};
+
+    PopplerPage *page = poppler_document_get_page(doc, n);
+    if (page == NULL)
+        return;
+
+    double width, height;
+    poppler_page_get_size(page, &width, &height);
+    ip->height = height;
+
+    char *text = poppler_page_get_text(page);
+    ip->text = strdup(text ? text : "");
+    ip->len = strlen(ip->text);
+    g_free(text);
+
+    PopplerRectangle *rects = NULL;
+    guint nrects = 0;
+    if (poppler_page_get_text_layout(page, &rects, &nrects))
+    {
+        ip->nchars = nrects;
+        ip->boxes = malloc(4 * (size_t)nrects * sizeof(uint16_t));
+        for (guint i = 0; i < nrects; ++i)
+        {
+            ip->boxes[4*i + 0] = (uint16_t)fmax(0, fmin(UINT16_MAX, rects[i].x1 * BOX_SCALE));
+            ip->boxes[4*i + 1] = (uint16_t)fmax(0, fmin(UINT16_MAX, rects[i].y1 * BOX_SCALE));
+            ip->boxes[4*i + 2] = (uint16_t)fmax(0, fmin(UINT16_MAX, rects[i].x2 * BOX_SCALE));
+            ip->boxes[4*i + 3] = (uint16_t)fmax(0, fmin(UINT16_MAX, rects[i].y2 * BOX_SCALE));
+        }
+        g_free(rects);
+    }
+
+    g_object_unref(page);
+}
+
+static bool get_file_stamp(const char *file_name, uint64_t *size, int64_t *mtime)
+{
+    struct stat sb;
+    if (stat(file_name, &sb) != 0)
+        return false;
+    *size = sb.st_size;
+    *mtime = sb.st_mtime;
+    return true;
+}
+
+static bool save_index(const TextIndex *ti)
+{
+    uint64_t size;
+    int64_t mtime;
+    if (!get_file_stamp(ti->file_name, &size, &mtime))
+        return false;
+
+    char *tmp_path = g_strdup_printf("%s.tmp", ti->index_path);
+    FILE *f = fopen(tmp_path, "wb");
+    if (f == NULL)
+    {
+        g_free(tmp_path);
+        return false;
+    }
+
+    uint32_t total = ti->total_pages;
+    bool ok = fwrite(INDEX_MAGIC, 8, 1, f) == 1 &&
+              fwrite(&size, sizeof(size), 1, f) == 1 &&
+              fwrite(&mtime, sizeof(mtime), 1, f) == 1 &&
+              fwrite(&total, sizeof(total), 1, f) == 1;
+
+    for (int i = 0; ok && i < ti->total_pages; ++i)
+    {
+        const IndexedPage *ip = &ti->pages[i];
+        ok = fwrite(&ip->height, sizeof(ip->height), 1, f) == 1 &&
+             fwrite(&ip->len, sizeof(ip->len), 1, f) == 1 &&
+             fwrite(ip->text ? ip->text : "", 1, ip->len, f) == ip->len &&
+             fwrite(&ip->nchars, sizeof(ip->nchars), 1, f) == 1 &&
+             fwrite(ip->boxes, 4 * sizeof(uint16_t), ip->nchars, f) == ip->nchars;
+    }
+
+    ok = (fclose(f) == 0) && ok;
+    if (ok)
+        ok = rename(tmp_path, ti->index_path) == 0;
+    if (!ok)
+        remove(tmp_path);
+
+    g_free(tmp_path);
+    return ok;
+}
+
+static bool load_index(TextIndex *ti)
+{
+    uint64_t size, saved_size;
+    int64_t mtime, saved_mtime;
+    uint32_t total;
+    char magic[8];
+
+    if (!get_file_stamp(ti->file_name, &size, &mtime))
+        return false;
+
+    FILE *f = fopen(ti->index_path, "rb");
+    if (f == NULL)
+        return false;
+
+    bool ok = fread(magic, 8, 1, f) == 1 && memcmp(magic, INDEX_MAGIC, 8) == 0 &&
+              fread(&saved_size, sizeof(saved_size), 1, f) == 1 && saved_size == size &&
+              fread(&saved_mtime, sizeof(saved_mtime), 1, f) == 1 && saved_mtime == mtime &&
+              fread(&total, sizeof(total), 1, f) == 1 && (int)total == ti->total_pages;
+
+    // Lengths come from the file: none may claim more than is left of it,
+    // and a page has no more characters than bytes of text.
+    struct stat sb;
+    ok = ok && fstat(fileno(f), &sb) == 0;
+
+    int n = 0;
+    for (; ok && n < ti->total_pages && !g_atomic_int_get(&ti->cancel); ++n)
+    {
+        IndexedPage ip = {0};
+        ok = fread(&ip.height, sizeof(ip.height), 1, f) == 1 &&
+             fread(&ip.len, sizeof(ip.len), 1, f) == 1 &&
+             ip.len <= sb.st_size - ftell(f);
+        if (ok)
+        {
+            ip.text = malloc((size_t)ip.len + 1);
+            ok = ip.text != NULL && fread(ip.text, 1, ip.len, f) == ip.len &&
+                 fread(&ip.nchars, sizeof(ip.nchars), 1, f) == 1 && ip.nchars <= ip.len &&
+                 4 * sizeof(uint16_t) * (uint64_t)ip.nchars <= (uint64_t)(sb.st_size - ftell(f));
+            if (ip.text)
+                ip.text[ip.len] = '\0';
+        }
+        if (ok)
+        {
+            ip.boxes = malloc(4 * (size_t)ip.nchars * sizeof(uint16_t) + 1);
+            ok = ip.boxes != NULL &&
+                 fread(ip.boxes, 4 * sizeof(uint16_t), ip.nchars, f) == ip.nchars;
+        }
+        if (!ok)
+        {
+            free(ip.text);
+            free(ip.boxes);
+            break;
+        }
+
+        add_page(ti, n, ip);
+    }
+
+    fclose(f);
+    return ok && n == ti->total_pages;
+}
+
+static gpointer index_thread(gpointer data)
+{
+    TextIndex *ti = data;
+
+    if (ti->persist && load_index(ti))
+        return NULL;
+
+    // A partially loaded index file is simply continued from the document.
+    PopplerDocument *doc = doc_load(ti->file_name, NULL);
+    if (doc == NULL)
+        return NULL;
+
+    for (int n = text_index_pages_done(ti); n < ti->total_pages; ++n)
+    {
+        if (g_atomic_int_get(&ti->cancel))
+            break;
+
+        IndexedPage ip;
+        extract_page(doc, n, &ip);
+
+        add_page(ti, n, ip);
+    }
+
+    g_object_unref(doc);
+
+    if (ti->persist && !g_atomic_int_get(&ti->cancel))
+        save_index(ti);
+
+    return NULL;
+}
+
+TextIndex *text_index_new(const char *file_name, int total_pages, bool persist)
+{
+    TextIndex *ti = calloc(1, sizeof(TextIndex));
+    ti->file_name = strdup(file_name);
+    ti->index_path = g_strdup_printf("%s.breathe-index", file_name);
+    ti->persist = persist;
+    ti->total_pages = total_pages;
+    ti->pages = calloc(total_pages, sizeof(IndexedPage));
+    g_mutex_init(&ti->lock);
+
+    ti->thread = g_thread_new("text-index", index_thread, ti);
+    return ti;
+}
+
+void text_index_free(TextIndex *ti)
+{
+    if (ti == NULL)
+        return;
+
+    g_atomic_int_set(&ti->cancel, 1);
+    g_thread_join(ti->thread);
+
+    for (int i = 0; i < ti->total_pages; ++i)
+    {
+        free(ti->pages[i].text);
+        free(ti->pages[i].boxes);
+    }
+    for (uint32_t i = 0; i < ti->table_capacity; ++i)
+        free(ti->table[i].pages);
+
+    free(ti->table);
+    free(ti->pages);
+    g_mutex_clear(&ti->lock);
+    g_free(ti->index_path);
+    free(ti->file_name);
+    free(ti);
+}
+
+// Memory held by the index so far, for the viewer's budget.
+size_t text_index_memory(TextIndex *ti)
+{
+    if (ti == NULL)
+        return 0;
+    g_mutex_lock(&ti->lock);
+    size_t bytes = ti->bytes;
+    g_mutex_unlock(&ti->lock);
+    return bytes;
+}
+
+int text_index_pages_done(TextIndex *ti)
+{
+    g_mutex_lock(&ti->lock);
+    int done = ti->done;
+    g_mutex_unlock(&ti->lock);
+    return done;
+}
+
+static bool posting_contains(const Posting *p, uint32_t page)
+{
+    int lo = 0, hi = p->size - 1;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (p->pages[mid] == page)
+            return true;
+        if (p->pages[mid] < page)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return false;
+}
+
+static bool is_word_byte(unsigned char c)
+{
+    return isalnum(c) || c >= 0x80;
+}
+
+// Whether query q (qlen bytes) matches the text at byte pos; *mlen gets the
+// bytes of text it covers, which folding case may make differ from qlen.
+static bool match_at(const IndexedPage *ip, uint32_t pos, const char *q, size_t qlen,
+    PopplerFindFlags flags, uint32_t *mlen)
+{
+    uint32_t end = pos;
+    if (flags & POPPLER_FIND_CASE_SENSITIVE)
+    {
+        if (qlen > ip->len - pos || memcmp(ip->text + pos, q, qlen) != 0)
+            return false;
+        end = pos + qlen;
+    }
+    else
+    {
+        for (size_t i = 0; i < qlen; )
+        {
+            if (end >= ip->len)
+                return false;
+            gunichar a, b;
+            end += next_char(ip->text + end, ip->len - end, &a);
+            i += next_char(q + i, qlen - i, &b);
+            if (a != b && g_unichar_tolower(a) != g_unichar_tolower(b))
+                return false;
+        }
+    }
+
+    if (flags & POPPLER_FIND_WHOLE_WORDS_ONLY)
+    {
+        if (pos > 0 && is_word_byte(ip->text[pos - 1]))
+            return false;
+        if (end < ip->len && is_word_byte(ip->text[end]))
+            return false;
+    }
+    *mlen = end - pos;
+    return true;
+}
+
+// Bounding box, top-left origin, of the text at byte pos..pos+mlen, whose
+// first character is character number first of the page.
+static PopplerRectangle get_match_box(const IndexedPage *ip, uint32_t first, uint32_t pos,
+    uint32_t mlen)
+{
+    uint32_t count = 0;
+    for (uint32_t i = pos; i < pos + mlen; ++i)
+        if (!is_continuation(ip->text[i]))
+            ++count;
+
+    double x1 = INFINITY, y1 = INFINITY, x2 = -INFINITY, y2 = -INFINITY;
+    for (uint32_t c = first; c < first + count && c < ip->nchars; ++c)
+    {
+        const uint16_t *b = &ip->boxes[4*c];
+        x1 = fmin(x1, b[0] / BOX_SCALE);
+        y1 = fmin(y1, b[1] / BOX_SCALE);
+        x2 = fmax(x2, b[2] / BOX_SCALE);
+        y2 = fmax(y2, b[3] / BOX_SCALE);
+    }
+    if (x1 > x2)
+        return (PopplerRectangle){0, 0, 0, 0};
+    return (PopplerRectangle){x1, y1, x2, y2};
+}
+
+// Returns the first (or with POPPLER_FIND_BACKWARDS the last) match on the
+// page as a rectangle in the coordinates poppler_page_find_text() uses.
+static bool find_on_page(const IndexedPage *ip, const char *q, size_t qlen,
+    PopplerFindFlags flags, PopplerRectangle *rect)
+{
+    if (ip->text == NULL || qlen == 0 || ip->len == 0)
+        return false;
+
+    bool backwards = flags & POPPLER_FIND_BACKWARDS;
+    int64_t pos = backwards ? (int64_t)ip->len - 1 : 0;
+    for (; pos >= 0 && pos < ip->len; pos += backwards ? -1 : 1)
+    {
+        uint32_t mlen;
+        if (is_continuation(ip->text[pos]) || !match_at(ip, pos, q, qlen, flags, &mlen))
+            continue;
+        if (rect == NULL)
+            return true;
+
+        // One match per call, so counting the characters before it is fine.
+        uint32_t first = 0;
+        for (int64_t i = 0; i < pos; ++i)
+            if (!is_continuation(ip->text[i]))
+                ++first;
+
+        // poppler_page_find_text() reports a bottom-left origin.
+        PopplerRectangle box = get_match_box(ip, first, pos, mlen);
+        *rect = (PopplerRectangle){box.x1, ip->height - box.y2, box.x2, ip->height - box.y1};
+        return true;
+    }
+
+    return false;
+}
+
+// Collects the posting lists of the query's trigrams with the shortest one
+// first, so it can drive a scan the others filter.  Returns -1 when some
+// trigram occurs nowhere and the query can't match.
+static int get_query_postings(const TextIndex *ti, const char *query, size_t qlen,
+    const Posting **lists)
+{
+    // Case-sensitive matches are among the case-folded ones too.
+    size_t len;
+    char *folded = fold_text(query, qlen, &len);
+    int nlists = 0;
+    for (size_t i = 0; i + 3 <= len && nlists < MAX_QUERY_TRIGRAMS; ++i)
+    {
+        const Posting *p = table_lookup(ti, trigram_key(folded + i));
+        if (p == NULL)
+        {
+            free(folded);
+            return -1;
+        }
+        lists[nlists++] = p;
+        if (p->size < lists[0]->size)
+        {
+            lists[nlists - 1] = lists[0];
+            lists[0] = p;
+        }
+    }
+    free(folded);
+    return nlists;
+}
+
+static bool has_postings(const Posting **lists, int nlists, uint32_t page)
+{
+    for (int l = 0; l < nlists; ++l)
+        if (!posting_contains(lists[l], page))
+            return false;
+    return true;
+}
+
+int text_index_find(TextIndex *ti, const char *query, PopplerFindFlags flags,
+    int from, int to, PopplerRectangle *rect)
+{
+    size_t qlen = strlen(query);
+    bool backwards = flags & POPPLER_FIND_BACKWARDS;
+    int found = 0;
+
+    g_mutex_lock(&ti->lock);
+
+    // Only pages [1, done] are searchable yet.
+    if (backwards && from > ti->done)
+        from = ti->done;
+    if (!backwards && to > ti->done)
+        to = ti->done;
+    bool empty = backwards ? (from < to || from < 1) : (from > to || to < 1);
+
+    const Posting *lists[MAX_QUERY_TRIGRAMS];
+    int nlists = get_query_postings(ti, query, qlen, lists);
+    bool missing = (nlists < 0);
+
+    if (!missing && !empty)
+    {
+        int step = backwards ? -1 : 1;
+        if (nlists == 0)
+        {
+            for (int page = from; page != to + step && !found; page += step)
+                if (find_on_page(&ti->pages[page - 1], query, qlen, flags, rect))
+                    found = page;
+        }
+        else
+        {
+            const Posting *drive = lists[0];
+            int lo = 0, hi = drive->size;
+            while (lo < hi)
+            {
+                int mid = (lo + hi) / 2;
+                if ((int)drive->pages[mid] + 1 < from)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            // lo is the first entry >= from; backwards starts at the last <= from.
+            int i = lo;
+            if (backwards && (i == drive->size || (int)drive->pages[i] + 1 > from))
+                --i;
+
+            for (; i >= 0 && i < drive->size && !found; i += step)
+            {
+                int page = drive->pages[i] + 1;
+                if (backwards ? page < to : page > to)
+                    break;
+
+                if (has_postings(lists + 1, nlists - 1, page - 1) &&
+                    find_on_page(&ti->pages[page - 1], query, qlen, flags, rect))
+                    found = page;
+            }
+        }
+    }
+
+    g_mutex_unlock(&ti->lock);
+    return found;
+}
+
+// Lists the indexed pages containing query, ignoring whole-word and direction
+// flags.  Only the given candidate pages and pages indexed after since are
+// checked: the result for a query is a valid candidate set for any query
+// extending it.  *done receives the index progress the result covers.
+int text_index_match_pages(TextIndex *ti, const char *query, PopplerFindFlags flags,
+    const int *candidates, int ncandidates, int since, int *done,
+    const gint *cancel, int **pages)
+{
+    size_t qlen = strlen(query);
+    flags &= POPPLER_FIND_CASE_SENSITIVE;
+    *pages = NULL;
+
+    g_mutex_lock(&ti->lock);
+
+    *done = ti->done;
+    const Posting *lists[MAX_QUERY_TRIGRAMS];
+    int nlists = get_query_postings(ti, query, qlen, lists);
+
+    int count = 0, capacity = 0;
+    int nnew = ti->done > since ? ti->done - since : 0;
+    for (int i = 0; nlists >= 0 && i < ncandidates + nnew; ++i)
+    {
+        if (g_atomic_int_get(cancel))
+        {
+            count = -1;
+            break;
+        }
+
+        int page = (i < ncandidates) ? candidates[i] : since + 1 + (i - ncandidates);
+        if (page < 1 || page > ti->done || !has_postings(lists, nlists, page - 1) ||
+            !find_on_page(&ti->pages[page - 1], query, qlen, flags, NULL))
+            continue;
+
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            *pages = realloc(*pages, capacity * sizeof(int));
+        }
+        (*pages)[count++] = page;
+    }
+
+    g_mutex_unlock(&ti->lock);
+
+    if (count < 0)
+    {
+        free(*pages);
+        *pages = NULL;
+    }
+    return count;
+}
+
+// Lists every match on page in reading order, as rectangles with a top-left
+// origin.  Returns -1 when the page isn't indexed yet.
+int text_index_page_matches(TextIndex *ti, int page, const char *query,
+    PopplerFindFlags flags, PopplerRectangle **rects)
+{
+    size_t qlen = strlen(query);
+    *rects = NULL;
+
+    g_mutex_lock(&ti->lock);
+
+    if (page < 1 || page > ti->done)
+    {
+        g_mutex_unlock(&ti->lock);
+        return -1;
+    }
+
+    // The character number of pos is carried along, not counted per match.
+    const IndexedPage *ip = &ti->pages[page - 1];
+    int count = 0, capacity = 0;
+    uint32_t chars = 0;
+    for (uint32_t pos = 0; ip->text && qlen > 0 && pos < ip->len; )
+    {
+        uint32_t mlen;
+        if (is_continuation(ip->text[pos]) || !match_at(ip, pos, query, qlen, flags, &mlen))
+        {
+            chars += !is_continuation(ip->text[pos]);
+            ++pos;
+            continue;
+        }
+
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 16;
+            *rects = realloc(*rects, capacity * sizeof(PopplerRectangle));
+        }
+        (*rects)[count++] = get_match_box(ip, chars, pos, mlen);
+        for (uint32_t end = pos + mlen; pos < end; ++pos)
+            chars += !is_continuation(ip->text[pos]);
+    }
+
+    g_mutex_unlock(&ti->lock);
+    return count;
+}
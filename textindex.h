@@ -0,0 +1,21 @@
+#ifndef TEXTINDEX_H
+#define TEXTINDEX_H
+
+#include <stdbool.h>
+#include <poppler.h>
+
+typedef struct TextIndex TextIndex;
+
+TextIndex *text_index_new(const char *file_name, int total_pages, bool persist);
+void text_index_free(TextIndex *ti);
+int text_index_pages_done(TextIndex *ti);
+size_t text_index_memory(TextIndex *ti);
+int text_index_find(TextIndex *ti, const char *query, PopplerFindFlags flags,
+    int from, int to, PopplerRectangle *rect);
+int text_index_match_pages(TextIndex *ti, const char *query, PopplerFindFlags flags,
+    const int *candidates, int ncandidates, int since, int *done,
+    const gint *cancel, int **pages);
+int text_index_page_matches(TextIndex *ti, int page, const char *query,
+    PopplerFindFlags flags, PopplerRectangle **rects);
+
+#endif // TEXTINDEX_H
@@ -0,0 +1,218 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poppler.h>
+#include "textlayout.h"
+
+// A page's text and per-character boxes (top-left origin), fetched once and
+// split into lines at the '\n' characters of the text.  Lines are also kept
+// sorted by their top edge so a point is mapped to a character boundary with
+// two binary searches.  Selections run in text order between two boundaries,
+// like POPPLER_SELECTION_GLYPH.
+
+typedef struct {
+    int start, end;          // characters [start, end)
+    double x1, y1, x2, y2;   // bounding box
+} TextLine;
+
+struct TextLayout {
+    int page_num;
+    char *text;
+    int nchars;
+    int *offsets;            // byte offset of every character, plus the end
+    PopplerRectangle *boxes;
+    TextLine *lines;         // text order
+    int nlines;
+    int *by_top;             // line indices sorted by y1
+    double max_height;
+};
+
+static gint compare_line_top(gconstpointer a, gconstpointer b, gpointer data)
+{
+    const TextLayout *tl = data;
+    double ya = tl->lines[*(const int *)a].y1;
+    double yb = tl->lines[*(const int *)b].y1;
+    return (ya > yb) - (ya < yb);
+}
+
+static void add_line(TextLayout *tl, int start, int end)
+{
+    if (end <= start)
+        return;
+
+    TextLine *line = &tl->lines[tl->nlines++];
+    *line = (TextLine){start, end, INFINITY, INFINITY, -INFINITY, -INFINITY};
+    for (int c = start; c < end; ++c)
+    {
+        line->x1 = fmin(line->x1, tl->boxes[c].x1);
+        line->y1 = fmin(line->y1, tl->boxes[c].y1);
+        line->x2 = fmax(line->x2, tl->boxes[c].x2);
+        line->y2 = fmax(line->y2, tl->boxes[c].y2);
+    }
+    tl->max_height = fmax(tl->max_height, line->y2 - line->y1);
+}
+
+TextLayout *text_layout_new(PopplerPage *page, int page_num)
+{
+    TextLayout *tl = calloc(1, sizeof(TextLayout));
+    tl->page_num = page_num;
+
+    char *text = poppler_page_get_text(page);
+    tl->text = strdup(text ? text : "");
+    g_free(text);
+
+    guint nboxes = 0;
+    if (!poppler_page_get_text_layout(page, &tl->boxes, &nboxes))
+        tl->boxes = NULL;
+
+    // Character i of the text owns box i; offsets[nchars] ends the last one.
+    int len = strlen(tl->text);
+    int total = 0;
+    tl->offsets = malloc((len + 1) * sizeof(int));
+    for (int i = 0; i < len; ++i)
+        if (((unsigned char)tl->text[i] & 0xc0) != 0x80)
+            tl->offsets[total++] = i;
+    tl->nchars = total < (int)nboxes ? total : (int)nboxes;
+    if (tl->nchars == total)
+        tl->offsets[total] = len;
+
+    tl->lines = malloc((tl->nchars + 1) * sizeof(TextLine));
+    int start = 0;
+    for (int c = 0; c < tl->nchars; ++c)
+    {
+        if (tl->text[tl->offsets[c]] == '\n')
+        {
+            add_line(tl, start, c);
+            start = c + 1;
+        }
+    }
+    add_line(tl, start, tl->nchars);
+
+    tl->by_top = malloc((tl->nlines + 1) * sizeof(int));
+    for (int i = 0; i < tl->nlines; ++i)
+        tl->by_top[i] = i;
+    g_qsort_with_data(tl->by_top, tl->nlines, sizeof(int), compare_line_top, tl);
+
+    return tl;
+}
+
+void text_layout_free(TextLayout *tl)
+{
+    if (tl == NULL)
+        return;
+
+    g_free(tl->boxes);
+    free(tl->text);
+    free(tl->offsets);
+    free(tl->lines);
+    free(tl->by_top);
+    free(tl);
+}
+
+int text_layout_page(const TextLayout *tl)
+{
+    return tl->page_num;
+}
+
+// Maps a point in page coordinates to the character boundary nearest to it.
+int text_layout_hit(const TextLayout *tl, double x, double y)
+{
+    if (tl->nlines == 0)
+        return 0;
+
+    // Last line (by top edge) starting above y
+    int lo = 0, hi = tl->nlines;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (tl->lines[tl->by_top[mid]].y1 <= y)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return tl->lines[tl->by_top[0]].start;
+
+    // Of the lines spanning y (several in multi-column text), the one
+    // horizontally closest to x
+    int best = -1;
+    double best_dist = INFINITY;
+    for (int k = lo - 1; k >= 0 && tl->lines[tl->by_top[k]].y1 >= y - tl->max_height; --k)
+    {
+        const TextLine *line = &tl->lines[tl->by_top[k]];
+        if (y > line->y2)
+            continue;
+        double d = x < line->x1 ? line->x1 - x : (x > line->x2 ? x - line->x2 : 0);
+        if (d < best_dist)
+        {
+            best = tl->by_top[k];
+            best_dist = d;
+        }
+    }
+    if (best < 0)
+        return tl->lines[tl->by_top[lo - 1]].end;
+
+    // First character on the line whose center lies right of x
+    const TextLine *line = &tl->lines[best];
+    lo = line->start;
+    hi = line->end;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if ((tl->boxes[mid].x1 + tl->boxes[mid].x2) / 2 <= x)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Fills rects with one box per line of the characters [first, last) and
+// returns how many lines that takes, which may exceed max.
+int text_layout_selection(const TextLayout *tl, int first, int last, Rectangle *rects, int max)
+{
+    // First line ending after first
+    int lo = 0, hi = tl->nlines;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (tl->lines[mid].end <= first)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    int n = 0;
+    for (int i = lo; i < tl->nlines && tl->lines[i].start < last; ++i)
+    {
+        const TextLine *line = &tl->lines[i];
+        int a = first > line->start ? first : line->start;
+        int b = last < line->end ? last : line->end;
+        if (a >= b)
+            continue;
+        if (n < max)
+        {
+            double x1 = tl->boxes[a].x1, x2 = tl->boxes[b - 1].x2;
+            rects[n] = (Rectangle){(int)floor(fmin(x1, x2)), (int)floor(line->y1),
+                (int)ceil(fabs(x2 - x1)), (int)ceil(line->y2 - line->y1)};
+        }
+        ++n;
+    }
+    return n;
+}
+
+char *text_layout_get_text(const TextLayout *tl, int first, int last)
+{
+    if (first < 0)
+        first = 0;
+    if (last > tl->nchars)
+        last = tl->nchars;
+    if (last <= first)
+        return strdup("");
+
+    int a = tl->offsets[first], b = tl->offsets[last];
+    char *text = malloc(b - a + 1);
+    memcpy(text, tl->text + a, b - a);
+    text[b - a] = '\0';
+    return text;
+}
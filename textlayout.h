@@ -0,0 +1,16 @@
+#ifndef TEXTLAYOUT_H
+#define TEXTLAYOUT_H
+
+#include <poppler.h>
+#include "rectangle.h"
+
+typedef struct TextLayout TextLayout;
+
+TextLayout *text_layout_new(PopplerPage *page, int page_num);
+void text_layout_free(TextLayout *tl);
+int text_layout_page(const TextLayout *tl);
+int text_layout_hit(const TextLayout *tl, double x, double y);
+int text_layout_selection(const TextLayout *tl, int first, int last, Rectangle *rects, int max);
+char *text_layout_get_text(const TextLayout *tl, int first, int last);
+
+#endif // TEXTLAYOUT_H
@@ -0,0 +1,373 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <cairo/cairo.h>
+#include <poppler.h>
+#include "diskcache.h"
+#include "docload.h"
+#include "thumbs.h"
+
+// Page thumbnails for the overview, rendered by worker threads (each with its
+// own PopplerDocument) at a fixed width of a few dozen DPI.  The viewer names
+// the pages on screen; workers take the unrendered page nearest to their
+// middle, then spread outwards into the prefetch margin.  Thumbnails are kept
+// as RGB16 surfaces, at most max_kb worth, evicting those farthest from the
+// view, and optionally go through the disk cache as well.
+//
+// A reload keeps the thumbnails, marked stale: they are shown until a
+// worker has rendered the page from the new document, and replaced only
+// when the new one hashes differently.
+
+enum {
+    THUMB_NONE,
+    THUMB_BUSY,
+    THUMB_READY,
+    THUMB_STALE,    // from before a reload, still shown until checked
+};
+
+#define THUMB_DISK_DPI -1  // disk cache key of thumbnails, apart from page renders
+
+struct ThumbCache {
+    char *file_name;
+    int total_pages;
+    int width;
+    int wake_fd;
+    DiskCache *disk;
+    long disk_bytes;
+    int max_thumbs;
+
+    GThread **threads;
+    int nthreads;
+    GMutex lock;
+    GCond cond;
+    bool quit;
+
+    // Guarded by lock; only the main thread frees thumbnails.
+    cairo_surface_t **thumbs;
+    uint64_t *prints;           // hash of each thumbnail's pixels
+    unsigned char *state;
+    cairo_surface_t **replaced; // stale thumbnails a worker replaced, to free
+    int nreplaced;
+    int count;
+    size_t bytes;               // pixels of the kept thumbnails
+    int first, last, center;    // wanted pages, 1-based
+};
+
+// Takes the wanted, unstarted page nearest the middle of the view; 0 if none.
+static int pick_page(ThumbCache *tc)
+{
+    if (tc->first < 1)
+        return 0;
+
+    int span = (tc->center - tc->first > tc->last - tc->center)
+        ? tc->center - tc->first : tc->last - tc->center;
+    for (int d = 0; d <= span; ++d)
+    {
+        int candidates[2] = {tc->center + d, tc->center - d};
+        for (int i = 0; i < (d ? 2 : 1); ++i)
+        {
+            int p = candidates[i];
+            if (p >= tc->first && p <= tc->last &&
+                (tc->state[p - 1] == THUMB_NONE || tc->state[p - 1] == THUMB_STALE))
+                return p;
+        }
+    }
+    return 0;
+}
+
+static cairo_surface_t *render_thumb(ThumbCache *tc, PopplerDocument *doc, int page_num)
+{
+    PopplerPage *page = poppler_document_get_page(doc, page_num - 1);
+    if (page == NULL)
+        return NULL;
+
+    double width, height;
+    poppler_page_get_size(page, &width, &height);
+    double scale = tc->width / width;
+    int h = (int)(height * scale + 0.5);
+    if (h < 1)
+        h = 1;
+
+    DiskCacheKey key = {page_num, THUMB_DISK_DPI, 0, 0};
+    cairo_surface_t *rgb = disk_cache_load(tc->disk, &key, tc->width, h);
+    if (rgb == NULL)
+    {
+        rgb = cairo_image_surface_create(CAIRO_FORMAT_RGB24, tc->width, h);
+        cairo_t *cr = cairo_create(rgb);
+        cairo_set_source_rgb(cr, 1, 1, 1);
+        cairo_paint(cr);
+        cairo_scale(cr, scale, scale);
+        poppler_page_render(page, cr);
+        cairo_destroy(cr);
+        cairo_surface_flush(rgb);
+        disk_cache_store(tc->disk, &key, rgb);
+    }
+    g_object_unref(page);
+
+    // Half the memory of RGB24, plenty for a thumbnail.
+    cairo_surface_t *thumb = cairo_image_surface_create(CAIRO_FORMAT_RGB16_565, tc->width, h);
+    cairo_t *cr = cairo_create(thumb);
+    cairo_set_source_surface(cr, rgb, 0, 0);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+    cairo_surface_destroy(rgb);
+    return thumb;
+}
+
+static size_t thumb_bytes(cairo_surface_t *thumb)
+{
+    return (size_t)cairo_image_surface_get_stride(thumb) * cairo_image_surface_get_height(thumb);
+}
+
+static uint64_t thumb_print(cairo_surface_t *thumb)
+{
+    const unsigned char *data = cairo_image_surface_get_data(thumb);
+    int stride = cairo_image_surface_get_stride(thumb);
+    int width = cairo_image_surface_get_width(thumb);
+    int height = cairo_image_surface_get_height(thumb);
+    uint64_t h = 14695981039346656037ULL ^ ((uint64_t)width << 32 | (uint32_t)height);
+    for (int y = 0; y < height; ++y)
+        for (int x = 0; x < 2 * width; ++x)
+            h = (h ^ data[(size_t)y * stride + x]) * 1099511628211ULL;
+    return h;
+}
+
+// Files a freshly rendered thumbnail of page p.  A stale one it replaces is
+// only freed by the main thread, which may be drawing it.
+static void put_thumb(ThumbCache *tc, int p, cairo_surface_t *thumb, uint64_t print)
+{
+    cairo_surface_t *old = tc->thumbs[p - 1];
+    tc->state[p - 1] = THUMB_READY;
+    if (old != NULL && tc->prints[p - 1] == print)
+    {
+        cairo_surface_destroy(thumb);
+        return;
+    }
+    if (old != NULL)
+    {
+        tc->replaced = realloc(tc->replaced, (tc->nreplaced + 1) * sizeof(cairo_surface_t *));
+        tc->replaced[tc->nreplaced++] = old;
+        --tc->count;
+    }
+    if (thumb != NULL)
+    {
+        tc->bytes += thumb_bytes(thumb);
+        ++tc->count;
+    }
+    tc->thumbs[p - 1] = thumb;  // NULL if unrenderable, shown as blank
+    tc->prints[p - 1] = print;
+}
+
+static gpointer thumb_thread(gpointer data)
+{
+    ThumbCache *tc = data;
+    PopplerDocument *doc = doc_load(tc->file_name, NULL);
+    int rendered = 0;
+
+    g_mutex_lock(&tc->lock);
+    while (doc != NULL && !tc->quit)
+    {
+        int p = pick_page(tc);
+        if (p == 0)
+        {
+            g_cond_wait(&tc->cond, &tc->lock);
+            continue;
+        }
+        tc->state[p - 1] = THUMB_BUSY;
+        g_mutex_unlock(&tc->lock);
+
+        cairo_surface_t *thumb = render_thumb(tc, doc, p);
+        uint64_t print = thumb ? thumb_print(thumb) : 0;
+        if (++rendered % 16 == 0)
+            doc_trim(doc);
+
+        g_mutex_lock(&tc->lock);
+        put_thumb(tc, p, thumb, print);
+
+        char c = 0;
+        ssize_t r = write(tc->wake_fd, &c, 1);
+        (void)r;
+    }
+    g_mutex_unlock(&tc->lock);
+
+    if (doc != NULL)
+        g_object_unref(doc);
+    return NULL;
+}
+
+static void start_workers(ThumbCache *tc)
+{
+    tc->quit = false;
+    for (int i = 0; i < tc->nthreads; ++i)
+        tc->threads[i] = g_thread_new("thumbnail", thumb_thread, tc);
+}
+
+static void stop_workers(ThumbCache *tc)
+{
+    g_mutex_lock(&tc->lock);
+    tc->quit = true;
+    g_cond_broadcast(&tc->cond);
+    g_mutex_unlock(&tc->lock);
+    for (int i = 0; i < tc->nthreads; ++i)
+        g_thread_join(tc->threads[i]);
+}
+
+static void free_replaced(ThumbCache *tc)
+{
+    for (int i = 0; i < tc->nreplaced; ++i)
+    {
+        tc->bytes -= thumb_bytes(tc->replaced[i]);
+        cairo_surface_destroy(tc->replaced[i]);
+    }
+    tc->nreplaced = 0;
+}
+
+// Thumbnails are width pixels wide; nthreads <= 0 uses one worker per core.
+// With disk_bytes > 0 they also go through the disk cache of that size.
+ThumbCache *thumb_cache_new(const char *file_name, int total_pages, int width,
+    int nthreads, int max_kb, int wake_fd, long disk_bytes)
+{
+    if (nthreads <= 0)
+        nthreads = g_get_num_processors();
+
+    ThumbCache *tc = calloc(1, sizeof(ThumbCache));
+    tc->file_name = strdup(file_name);
+    tc->total_pages = total_pages;
+    tc->width = width;
+    tc->wake_fd = wake_fd;
+    tc->disk_bytes = disk_bytes;
+    tc->disk = disk_bytes > 0 ? disk_cache_new(file_name, disk_bytes) : NULL;
+    // Budget by a portrait page's thumbnail, two bytes per pixel.
+    tc->max_thumbs = (int)((long)max_kb * 1024 / ((long)width * width * 3 / 2 * 2));
+    if (tc->max_thumbs < 16)
+        tc->max_thumbs = 16;
+    tc->thumbs = calloc(total_pages, sizeof(cairo_surface_t *));
+    tc->prints = calloc(total_pages, sizeof(uint64_t));
+    tc->state = calloc(total_pages, 1);
+    tc->first = tc->last = tc->center = 0;
+    g_mutex_init(&tc->lock);
+    g_cond_init(&tc->cond);
+
+    tc->nthreads = nthreads;
+    tc->threads = calloc(nthreads, sizeof(GThread *));
+    start_workers(tc);
+    return tc;
+}
+
+// The file was reloaded and now has total_pages.  The workers restart on
+// the new document, the disk cache follows the file's new key, and kept
+// thumbnails turn stale.
+void thumb_cache_reload(ThumbCache *tc, int total_pages)
+{
+    stop_workers(tc);
+    free_replaced(tc);
+
+    for (int i = total_pages; i < tc->total_pages; ++i)
+        if (tc->thumbs[i])
+        {
+            tc->bytes -= thumb_bytes(tc->thumbs[i]);
+            cairo_surface_destroy(tc->thumbs[i]);
+            --tc->count;
+        }
+    tc->thumbs = realloc(tc->thumbs, total_pages * sizeof(cairo_surface_t *));
+    tc->prints = realloc(tc->prints, total_pages * sizeof(uint64_t));
+    tc->state = realloc(tc->state, total_pages);
+    for (int i = 0; i < total_pages; ++i)
+    {
+        if (i >= tc->total_pages)
+            tc->thumbs[i] = NULL;
+        tc->state[i] = tc->thumbs[i] ? THUMB_STALE : THUMB_NONE;
+    }
+    tc->total_pages = total_pages;
+    if (tc->last > total_pages)
+        tc->last = total_pages;
+    if (tc->center > total_pages)
+        tc->center = total_pages;
+
+    disk_cache_free(tc->disk);
+    tc->disk = tc->disk_bytes > 0 ? disk_cache_new(tc->file_name, tc->disk_bytes) : NULL;
+    start_workers(tc);
+}
+
+void thumb_cache_free(ThumbCache *tc)
+{
+    if (tc == NULL)
+        return;
+
+    stop_workers(tc);
+    free_replaced(tc);
+    for (int i = 0; i < tc->total_pages; ++i)
+        if (tc->thumbs[i])
+            cairo_surface_destroy(tc->thumbs[i]);
+
+    disk_cache_free(tc->disk);
+    g_mutex_clear(&tc->lock);
+    g_cond_clear(&tc->cond);
+    free(tc->threads);
+    free(tc->thumbs);
+    free(tc->prints);
+    free(tc->replaced);
+    free(tc->state);
+    free(tc->file_name);
+    free(tc);
+}
+
+// Pages first..last are on screen; prefetch more on either side are wanted
+// next.  Drops the thumbnails farthest away once over budget.
+void thumb_cache_request(ThumbCache *tc, int first, int last, int prefetch)
+{
+    g_mutex_lock(&tc->lock);
+    free_replaced(tc);
+    tc->center = (first + last) / 2;
+    tc->first = first - prefetch > 1 ? first - prefetch : 1;
+    tc->last = last + prefetch < tc->total_pages ? last + prefetch : tc->total_pages;
+
+    for (int d = tc->total_pages; d >= 0 && tc->count > tc->max_thumbs; --d)
+    {
+        int candidates[2] = {tc->center + d, tc->center - d};
+        for (int i = 0; i < 2 && tc->count > tc->max_thumbs; ++i)
+        {
+            int p = candidates[i];
+            if (p < 1 || p > tc->total_pages || (p >= tc->first && p <= tc->last))
+                continue;
+            if (tc->state[p - 1] == THUMB_READY || tc->state[p - 1] == THUMB_STALE)
+            {
+                if (tc->thumbs[p - 1])
+                {
+                    tc->bytes -= thumb_bytes(tc->thumbs[p - 1]);
+                    cairo_surface_destroy(tc->thumbs[p - 1]);
+                    tc->thumbs[p - 1] = NULL;
+                    --tc->count;
+                }
+                tc->state[p - 1] = THUMB_NONE;
+            }
+        }
+    }
+
+    g_cond_broadcast(&tc->cond);
+    g_mutex_unlock(&tc->lock);
+}
+
+// The page's thumbnail, or NULL while it is not rendered yet; after a reload
+// maybe the one from before.  It stays valid until the next
+// thumb_cache_request().
+cairo_surface_t *thumb_cache_get(ThumbCache *tc, int page)
+{
+    g_mutex_lock(&tc->lock);
+    cairo_surface_t *thumb = tc->thumbs[page - 1];
+    g_mutex_unlock(&tc->lock);
+    return thumb;
+}
+
+// Memory held by the thumbnails, for the viewer's budget.
+size_t thumb_cache_memory(ThumbCache *tc)
+{
+    if (tc == NULL)
+        return 0;
+    g_mutex_lock(&tc->lock);
+    size_t bytes = tc->bytes;
+    g_mutex_unlock(&tc->lock);
+    return bytes;
+}
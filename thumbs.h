@@ -0,0 +1,17 @@
+#ifndef THUMBS_H
+#define THUMBS_H
+
+#include <stddef.h>
+#include <cairo/cairo.h>
+
+typedef struct ThumbCache ThumbCache;
+
+ThumbCache *thumb_cache_new(const char *file_name, int total_pages, int width,
+    int nthreads, int max_kb, int wake_fd, long disk_bytes);
+void thumb_cache_free(ThumbCache *tc);
+void thumb_cache_reload(ThumbCache *tc, int total_pages);
+void thumb_cache_request(ThumbCache *tc, int first, int last, int prefetch);
+cairo_surface_t *thumb_cache_get(ThumbCache *tc, int page);
+size_t thumb_cache_memory(ThumbCache *tc);
+
+#endif // THUMBS_H